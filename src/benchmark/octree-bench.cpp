@@ -0,0 +1,417 @@
+/**
+ * Benchmark of octree operations on reproducible workloads.
+ *
+ * Every case is run several times after warmup runs, statistics of run times are
+ * written as JSON, so results of different commits may be compared by scripts.
+ * Run with --help to see options.
+ */
+
+#include "octree.hpp"
+#include "kernels.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace octree;
+
+namespace {
+
+struct Options
+{
+    size_t count = 100000;
+    std::string distribution = "uniform";
+    std::string scales = "linear:0.5";
+    std::vector<std::string> cases = {"insert", "build", "mass_center_update", "get_nearest", "get_close", "convolute"};
+    size_t queries = 1000;
+    double radius = 0.05;
+    int repeats = 10;
+    int warmup = 2;
+    unsigned threads = 0;
+    uint64_t seed = 1;
+    std::string output;
+};
+
+void printUsage()
+{
+    std::cout <<
+        "Usage: octree-bench [options]\n"
+        "  --count N             Count of points, default 100000\n"
+        "  --distribution NAME   uniform, gaussian, clustered or shell, default uniform\n"
+        "  --scales CONFIG       linear:K or discrete:DIST:SCALE[,DIST:SCALE...], default linear:0.5\n"
+        "  --cases LIST          Comma separated cases: insert, build, mass_center_update,\n"
+        "                        get_nearest, get_close, convolute. Default is all\n"
+        "  --queries N           Count of queries for query cases, default 1000\n"
+        "  --radius R            Radius of get_close queries, points are in unit cube, default 0.05\n"
+        "  --repeats N           Measured runs of every case, default 10\n"
+        "  --warmup N            Runs before measurement, default 2\n"
+        "  --threads N           Threads of build pool, 0 means all cores, default 0\n"
+        "  --seed N              Seed of points and queries generator, default 1\n"
+        "  --output FILE         Write JSON to file instead of standard output\n";
+}
+
+std::vector<std::string> split(const std::string& text, char separator)
+{
+    std::vector<std::string> result;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, separator))
+        result.push_back(item);
+    return result;
+}
+
+Options parseOptions(int argc, char** argv)
+{
+    Options options;
+    for (int i=1; i<argc; i++)
+    {
+        std::string name = argv[i];
+        if (name == "--help")
+        {
+            printUsage();
+            std::exit(0);
+        }
+        if (i + 1 == argc)
+            throw std::invalid_argument("No value for option " + name);
+        std::string value = argv[++i];
+        if (name == "--count")
+            options.count = std::stoull(value);
+        else if (name == "--distribution")
+            options.distribution = value;
+        else if (name == "--scales")
+            options.scales = value;
+        else if (name == "--cases")
+            options.cases = split(value, ',');
+        else if (name == "--queries")
+            options.queries = std::stoull(value);
+        else if (name == "--radius")
+            options.radius = std::stod(value);
+        else if (name == "--repeats")
+            options.repeats = std::max(1, std::stoi(value));
+        else if (name == "--warmup")
+            options.warmup = std::max(0, std::stoi(value));
+        else if (name == "--threads")
+            options.threads = std::stoul(value);
+        else if (name == "--seed")
+            options.seed = std::stoull(value);
+        else if (name == "--output")
+            options.output = value;
+        else
+            throw std::invalid_argument("Unknown option " + name);
+    }
+    return options;
+}
+
+std::unique_ptr<IScalesConfig> createScales(const std::string& config)
+{
+    std::vector<std::string> parts = split(config, ':');
+    if (parts.size() == 2 && parts[0] == "linear")
+        return std::unique_ptr<IScalesConfig>(new LinearScales(std::stod(parts[1])));
+    if (parts.size() >= 1 && parts[0] == "discrete")
+    {
+        std::unique_ptr<DiscreteScales> scales(new DiscreteScales());
+        for (const std::string& pair : split(config.substr(config.find(':') + 1), ','))
+        {
+            std::vector<std::string> values = split(pair, ':');
+            if (values.size() != 2)
+                throw std::invalid_argument("Wrong discrete scale " + pair);
+            scales->addScale(std::stod(values[0]), std::stod(values[1]));
+        }
+        return std::move(scales);
+    }
+    throw std::invalid_argument("Wrong scales config " + config);
+}
+
+/**
+ * @brief Points in unit cube [0, 1)^3. Generator is seeded, so the same seed
+ * gives the same points with the same standard library
+ */
+std::vector<Position> generatePoints(const std::string& distribution, size_t count, std::mt19937_64& generator)
+{
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    std::vector<Position> points;
+    points.reserve(count);
+
+    std::vector<Position> clusters;
+    if (distribution == "clustered")
+    {
+        for (int i=0; i<16; i++)
+            clusters.push_back(Position(uniform(generator), uniform(generator), uniform(generator)));
+    }
+
+    while (points.size() < count)
+    {
+        Position p;
+        if (distribution == "uniform")
+        {
+            p = Position(uniform(generator), uniform(generator), uniform(generator));
+        } else if (distribution == "gaussian") {
+            p = Position(0.5 + 0.15 * normal(generator), 0.5 + 0.15 * normal(generator), 0.5 + 0.15 * normal(generator));
+        } else if (distribution == "clustered") {
+            const Position& c = clusters[generator() % clusters.size()];
+            p = Position(c[0] + 0.02 * normal(generator), c[1] + 0.02 * normal(generator), c[2] + 0.02 * normal(generator));
+        } else if (distribution == "shell") {
+            Position d(normal(generator), normal(generator), normal(generator));
+            double len = d.len();
+            if (len == 0.0)
+                continue;
+            p = Position(0.5, 0.5, 0.5) + d * (0.45 / len);
+        } else {
+            throw std::invalid_argument("Unknown distribution " + distribution);
+        }
+        // Points out of cube are dropped, so all distributions fit the same box
+        bool inside = true;
+        for (int i=0; i<3; i++)
+            inside = inside && p[i] >= 0.0 && p[i] < 1.0;
+        if (inside)
+            points.push_back(p);
+    }
+    return points;
+}
+
+struct Statistics
+{
+    double min, p10, median, p90, p99, max, mean;
+};
+
+/// Nearest-rank percentile of sorted values
+double percentile(const std::vector<double>& sorted, double p)
+{
+    size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::min(sorted.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+
+Statistics statistics(std::vector<double> times)
+{
+    std::sort(times.begin(), times.end());
+    Statistics result;
+    result.min = times.front();
+    result.p10 = percentile(times, 0.1);
+    result.median = percentile(times, 0.5);
+    result.p90 = percentile(times, 0.9);
+    result.p99 = percentile(times, 0.99);
+    result.max = times.back();
+    result.mean = 0.0;
+    for (double t : times)
+        result.mean += t;
+    result.mean /= times.size();
+    return result;
+}
+
+/**
+ * @brief Benchmark case. prepare() is not measured, run() is
+ */
+struct Case
+{
+    std::string name;
+    size_t operations;
+    std::function<void()> prepare;
+    std::function<void()> run;
+};
+
+class Benchmark
+{
+public:
+    Benchmark(const Options& options) :
+        m_options(options),
+        m_generator(options.seed),
+        m_pool(options.threads),
+        m_scales(createScales(options.scales)),
+        m_convolution(*m_scales)
+    {
+        m_points = generatePoints(options.distribution, options.count, m_generator);
+        std::uniform_real_distribution<double> value(0.5, 1.5);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        for (size_t i=0; i<m_points.size(); i++)
+            m_values.push_back(value(m_generator));
+        for (size_t i=0; i<options.queries; i++)
+            m_queries.push_back(Position(uniform(m_generator), uniform(m_generator), uniform(m_generator)));
+    }
+
+    Case createCase(const std::string& name)
+    {
+        if (name == "insert")
+        {
+            return Case{name, m_points.size(),
+                [this]() { m_octree.clear(); },
+                [this]()
+                {
+                    for (size_t i=0; i<m_points.size(); i++)
+                        m_octree.add(std::make_shared<ElementValue>(m_points[i], m_values[i]));
+                }
+            };
+        }
+        if (name == "build")
+        {
+            return Case{name, m_points.size(),
+                [this]() { m_octree.clear(); },
+                [this]() { m_octree.build(m_points.data(), m_values.data(), m_points.size(), &m_pool); }
+            };
+        }
+        if (name == "mass_center_update")
+        {
+            // All values are changed while calculation is muted, so all nodes are recalculated once
+            return Case{name, m_points.size(),
+                [this]()
+                {
+                    ensureBuilt();
+                    m_elements.clear();
+                    m_octree.root().pushBackAllElements(m_elements);
+                },
+                [this]()
+                {
+                    CenterMassUpdatingMute mute(m_octree);
+                    for (Element* e : m_elements)
+                    {
+                        e->value *= 1.0001;
+                        m_octree.elementChanged(*e);
+                    }
+                }
+            };
+        }
+        if (name == "get_nearest")
+        {
+            return Case{name, m_queries.size(),
+                [this]() { ensureBuilt(); },
+                [this]()
+                {
+                    for (const Position& q : m_queries)
+                        m_checksum += m_octree.getNearest(q).value;
+                }
+            };
+        }
+        if (name == "get_close")
+        {
+            return Case{name, m_queries.size(),
+                [this]() { ensureBuilt(); },
+                [this]()
+                {
+                    std::vector<Element*> close;
+                    for (const Position& q : m_queries)
+                    {
+                        close.clear();
+                        m_octree.getClose(close, q, m_options.radius);
+                        m_checksum += close.size();
+                    }
+                }
+            };
+        }
+        if (name == "convolute")
+        {
+            return Case{name, m_queries.size(),
+                [this]() { ensureBuilt(); },
+                [this]()
+                {
+                    for (const Position& q : m_queries)
+                        m_checksum += m_convolution.convolute(m_octree, q, m_coulomb);
+                }
+            };
+        }
+        throw std::invalid_argument("Unknown case " + name);
+    }
+
+    void runCase(const Case& c, std::ostream& out, bool last)
+    {
+        std::vector<double> times;
+        for (int i=0; i < m_options.warmup + m_options.repeats; i++)
+        {
+            c.prepare();
+            auto start = std::chrono::steady_clock::now();
+            c.run();
+            std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+            if (i >= m_options.warmup)
+                times.push_back(duration.count());
+        }
+        // Insertion cases leave the tree in unknown state
+        m_built = false;
+
+        Statistics s = statistics(times);
+        out << "    {\"case\": \"" << c.name << "\", \"operations\": " << c.operations
+            << ", \"repeats\": " << times.size() << ", \"unit\": \"ms\""
+            << ", \"min\": " << s.min << ", \"p10\": " << s.p10 << ", \"median\": " << s.median
+            << ", \"p90\": " << s.p90 << ", \"p99\": " << s.p99 << ", \"max\": " << s.max
+            << ", \"mean\": " << s.mean
+            << ", \"median_ns_per_operation\": " << s.median * 1e6 / std::max<size_t>(c.operations, 1)
+            << "}" << (last ? "" : ",") << "\n";
+    }
+
+    void run(std::ostream& out)
+    {
+        out << "{\n";
+        out << "  \"config\": {\"count\": " << m_points.size()
+            << ", \"distribution\": \"" << m_options.distribution << "\""
+            << ", \"scales\": \"" << m_options.scales << "\""
+            << ", \"queries\": " << m_queries.size()
+            << ", \"radius\": " << m_options.radius
+            << ", \"repeats\": " << m_options.repeats
+            << ", \"warmup\": " << m_options.warmup
+            << ", \"threads\": " << m_pool.threadsCount()
+            << ", \"seed\": " << m_options.seed << "},\n";
+        out << "  \"results\": [\n";
+        for (size_t i=0; i<m_options.cases.size(); i++)
+            runCase(createCase(m_options.cases[i]), out, i + 1 == m_options.cases.size());
+        out << "  ],\n";
+        // Checksum keeps query results used, so they are not optimized out
+        out << "  \"checksum\": " << m_checksum << "\n";
+        out << "}\n";
+    }
+
+private:
+    void ensureBuilt()
+    {
+        if (m_built)
+            return;
+        m_octree.clear();
+        m_octree.build(m_points.data(), m_values.data(), m_points.size(), &m_pool);
+        m_built = true;
+    }
+
+    const Options& m_options;
+    std::mt19937_64 m_generator;
+    ThreadPool m_pool;
+    std::unique_ptr<IScalesConfig> m_scales;
+    Convolution<double> m_convolution;
+    Convolution<double>::Visitor m_coulomb = CoulombPotentialKernel();
+
+    std::vector<Position> m_points;
+    std::vector<double> m_values;
+    std::vector<Position> m_queries;
+
+    Octree m_octree;
+    bool m_built = false;
+    std::vector<Element*> m_elements;
+    double m_checksum = 0.0;
+};
+
+}
+
+int main(int argc, char** argv)
+{
+    try {
+        Options options = parseOptions(argc, argv);
+        Benchmark benchmark(options);
+        if (options.output.empty())
+        {
+            benchmark.run(std::cout);
+        } else {
+            std::ofstream file(options.output);
+            if (!file)
+                throw std::runtime_error("Cannot open " + options.output);
+            benchmark.run(file);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "octree-bench: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,197 @@
+#ifndef OCTREE_ADAPTIVE_CONVOLUTION_HPP_INCLUDED
+#define OCTREE_ADAPTIVE_CONVOLUTION_HPP_INCLUDED
+
+#include "octree.hpp"
+#include "kernels.hpp"
+
+#include <vector>
+#include <cmath>
+#include <utility>
+
+namespace octree {
+
+/**
+ * @brief Error bounds of approximation of node elements by node mass placed in its mass center.
+ * It is specialized for kernels whose bounds are known.
+ *
+ * If all elements of node have the same sign, dipole moment about mass center is zero,
+ * so the error is of the second order of node radius instead of the first one.
+ */
+template<typename Kernel>
+struct MonopoleErrorBound;
+
+/**
+ * @brief Bounds for 1/r follow from expansion of 1/|target - r| by Legendre polynomials
+ */
+template<>
+struct MonopoleErrorBound<CoulombPotentialKernel>
+{
+    /**
+     * @param dist   Distance from target to node mass center
+     * @param radius Radius of sphere around mass center that contains node, less than dist
+     */
+    static double error(double mass, double absMass, double dist, double radius)
+    {
+        double ratio = radius / dist;
+        if (std::fabs(mass) == absMass)
+            return absMass * ratio * ratio / (dist - radius);
+        return absMass * ratio / (dist - radius);
+    }
+
+    /**
+     * @brief Lower bound of sum of |value / |target - r|| for node elements
+     */
+    static double magnitude(double absMass, double dist, double radius)
+    {
+        return absMass / (dist + radius);
+    }
+};
+
+/**
+ * @brief Bounds for field follow from Taylor expansion with |D^k (1/r)| <= k! / r^(k+1)
+ */
+template<>
+struct MonopoleErrorBound<CoulombFieldKernel>
+{
+    static double error(double mass, double absMass, double dist, double radius)
+    {
+        double near = dist - radius;
+        double near3 = near * near * near;
+        if (std::fabs(mass) == absMass)
+            return 3.0 * absMass * radius * radius / (near3 * near);
+        return 2.0 * absMass * radius / near3;
+    }
+
+    static double magnitude(double absMass, double dist, double radius)
+    {
+        double far = dist + radius;
+        return absMass / (far * far);
+    }
+};
+
+/**
+ * @brief Convolution that takes requested error of result instead of scales.
+ *
+ * Node is accepted when error bound of its mass center approximation (see MonopoleErrorBound)
+ * is not larger than its share of tolerance:
+ * absoluteTolerance * node absMass / root absMass + relativeTolerance * lower bound of sum of
+ * |kernel(target, r, value)| for node elements. Other nodes are opened, leafs are summed directly.
+ * So result differs from exact sum not more than by returned error bound, which is not larger than
+ * absoluteTolerance + relativeTolerance * sum of |kernel(target, r, value)| for all elements.
+ * For potential of elements with the same sign it is relativeTolerance * |result|.
+ *
+ * Kernel is CoulombPotentialKernel or CoulombFieldKernel, length of vector is used as error of field.
+ */
+template<typename Kernel>
+class AdaptiveConvolution
+{
+public:
+    using ResultType = decltype(std::declval<const Kernel&>()(Position(), Position(), 0.0));
+
+    struct Result
+    {
+        ResultType value;
+        /// Upper bound of |value - exact sum|, it is sum of error bounds of accepted nodes
+        double errorBound;
+    };
+
+    /**
+     * @param relativeTolerance Requested error relative to sum of elements contributions
+     * @param absoluteTolerance Requested absolute error, it is added to relative one
+     */
+    AdaptiveConvolution(double relativeTolerance, double absoluteTolerance = 0.0, const Kernel& kernel = Kernel()) :
+        m_relativeTolerance(relativeTolerance),
+        m_absoluteTolerance(absoluteTolerance),
+        m_kernel(kernel)
+    {
+    }
+
+    /**
+     * @brief Calculate convolution by Octree or LinearOctree at target
+     */
+    template<typename OctreeType>
+    Result convolute(const OctreeType& oct, const Position& target) const
+    {
+        NoStats stats;
+        return convolute(oct, target, stats);
+    }
+
+    /**
+     * @brief The same as convolute(), counters of tree traversal are added to stats
+     */
+    template<typename OctreeType, typename Stats>
+    Result convolute(const OctreeType& oct, const Position& target, Stats& stats) const
+    {
+        using NodeType = typename std::decay<decltype(oct.root())>::type;
+        Result result{ResultType(), 0.0};
+        if (oct.empty())
+            return result;
+        details::refreshAggregates(oct);
+        if (oct.root().absMass == 0.0)
+            return result;
+
+        // Absolute tolerance is shared between nodes in proportion to their absolute masses
+        const double absolutePerMass = m_absoluteTolerance / oct.root().absMass;
+        std::vector<const NodeType*> nodesVector;
+        nodesVector.reserve(200);
+        nodesVector.push_back(&oct.root());
+        stats.start();
+        for (size_t i=0; i != nodesVector.size(); i++)
+        {
+            const NodeType *n = nodesVector[i];
+            stats.visitQueued(i, nodesVector.size());
+            if (n->isLeaf())
+            {
+                stats.leaf();
+                result.value += oct.template directSum<ResultType>(*n, target, m_kernel);
+                continue;
+            }
+
+            double dist = n->massCenter.distTo(target);
+            double radius = enclosingRadius(*n);
+            if (dist > radius)
+            {
+                double error = Bound::error(n->mass, n->absMass, dist, radius);
+                double tolerance = absolutePerMass * n->absMass
+                        + m_relativeTolerance * Bound::magnitude(n->absMass, dist, radius);
+                if (error <= tolerance)
+                {
+                    stats.accept();
+                    result.value += m_kernel(target, n->massCenter, n->mass);
+                    result.errorBound += error;
+                    continue;
+                }
+            }
+            n->pushBackSubnodes(nodesVector);
+        }
+        return result;
+    }
+
+private:
+    using Bound = MonopoleErrorBound<Kernel>;
+
+    /**
+     * @brief Radius of sphere around mass center that contains node box.
+     * Mass center may be out of box if elements have different signs
+     */
+    template<typename NodeType>
+    static double enclosingRadius(const NodeType& n)
+    {
+        double hs = n.size * 0.5;
+        double result = 0.0;
+        for (int i=0; i<3; i++)
+        {
+            double d = std::fabs(n.massCenter.x[i] - n.center.x[i]) + hs;
+            result += d * d;
+        }
+        return sqrt(result);
+    }
+
+    double m_relativeTolerance;
+    double m_absoluteTolerance;
+    Kernel m_kernel;
+};
+
+}
+
+#endif // OCTREE_ADAPTIVE_CONVOLUTION_HPP_INCLUDED
@@ -0,0 +1,190 @@
+#include "concurrent-octree.hpp"
+
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+
+using namespace octree;
+
+namespace {
+
+void collectElements(const Node& node, std::vector<std::shared_ptr<Element>>& elements)
+{
+    if (node.element != nullptr)
+    {
+        elements.push_back(node.element);
+        return;
+    }
+    for (int i=0; i<8; i++)
+    {
+        if (node.subnodes[i] != nullptr)
+            collectElements(*node.subnodes[i], elements);
+    }
+}
+
+}
+
+ConcurrentOctree::Reader::Reader(std::atomic<uint64_t>* slot, const Snapshot* snapshot) :
+    m_slot(slot),
+    m_snapshot(snapshot)
+{
+}
+
+ConcurrentOctree::Reader::Reader(Reader&& other) :
+    m_slot(other.m_slot),
+    m_snapshot(other.m_snapshot)
+{
+    other.m_slot = nullptr;
+    other.m_snapshot = nullptr;
+}
+
+ConcurrentOctree::Reader::~Reader()
+{
+    if (m_slot != nullptr)
+        m_slot->store(0, std::memory_order_release);
+}
+
+ConcurrentOctree::ConcurrentOctree(double initialSize) :
+    m_octree(initialSize)
+{
+    m_current.store(new Snapshot());
+}
+
+ConcurrentOctree::~ConcurrentOctree()
+{
+    // There should be no readers already
+    delete m_current.load();
+    for (const auto& retired : m_retired)
+        delete retired.second;
+    SlotsBlock* block = m_slots.next.load();
+    while (block != nullptr)
+    {
+        SlotsBlock* next = block->next.load();
+        delete block;
+        block = next;
+    }
+}
+
+void* ConcurrentOctree::SlotsBlock::operator new(size_t size)
+{
+    // Pointer to allocated memory is kept just before aligned block
+    const uintptr_t alignment = alignof(SlotsBlock);
+    char* memory = static_cast<char*>(::operator new(size + alignment + sizeof(void*)));
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(memory) + sizeof(void*) + alignment - 1) & ~(alignment - 1);
+    reinterpret_cast<void**>(aligned)[-1] = memory;
+    return reinterpret_cast<void*>(aligned);
+}
+
+void ConcurrentOctree::SlotsBlock::operator delete(void* ptr)
+{
+    if (ptr != nullptr)
+        ::operator delete(static_cast<void**>(ptr)[-1]);
+}
+
+ConcurrentOctree::Reader ConcurrentOctree::read() const
+{
+    // Threads start search of free slot from different places
+    size_t start = std::hash<std::thread::id>()(std::this_thread::get_id()) % slotsPerBlock;
+    SlotsBlock* block = &m_slots;
+    for (;;)
+    {
+        for (size_t i=0; i<slotsPerBlock; i++)
+        {
+            std::atomic<uint64_t>& slot = block->slots[(start + i) % slotsPerBlock].epoch;
+            uint64_t expected = 0;
+            if (slot.load(std::memory_order_relaxed) != 0)
+                continue;
+            // Epoch is stored before snapshot pointer is loaded, so snapshot is not
+            // freed by publish() that replaced it after this epoch
+            uint64_t epoch = m_epoch.load();
+            if (slot.compare_exchange_strong(expected, epoch))
+                return Reader(&slot, m_current.load());
+        }
+        SlotsBlock* next = block->next.load();
+        if (next == nullptr)
+        {
+            // All slots are busy, new block is appended unless other reader did it first
+            std::unique_ptr<SlotsBlock> created(new SlotsBlock());
+            if (block->next.compare_exchange_strong(next, created.get()))
+                next = created.release();
+        }
+        block = next;
+    }
+}
+
+void ConcurrentOctree::add(std::shared_ptr<Element> e)
+{
+    std::unique_lock<std::mutex> lock(m_writerMutex);
+    m_changed = true;
+    m_octree.add(std::move(e));
+}
+
+void ConcurrentOctree::addMany(const std::vector<std::shared_ptr<Element>>& elements, ThreadPool* pool)
+{
+    std::unique_lock<std::mutex> lock(m_writerMutex);
+    m_changed = true;
+    m_octree.addMany(elements, pool);
+}
+
+bool ConcurrentOctree::remove(Element& e)
+{
+    std::unique_lock<std::mutex> lock(m_writerMutex);
+    bool removed = m_octree.remove(e);
+    m_changed = m_changed || removed;
+    return removed;
+}
+
+void ConcurrentOctree::publish()
+{
+    std::unique_lock<std::mutex> lock(m_writerMutex);
+    if (m_changed)
+        publishLocked();
+}
+
+size_t ConcurrentOctree::retiredCount() const
+{
+    std::unique_lock<std::mutex> lock(m_writerMutex);
+    return m_retired.size();
+}
+
+void ConcurrentOctree::publishLocked()
+{
+    std::unique_ptr<Snapshot> snapshot(new Snapshot());
+    snapshot->tree.build(m_octree);
+    if (!m_octree.empty())
+        collectElements(m_octree.root(), snapshot->elements);
+    snapshot->version = ++m_version;
+    m_changed = false;
+    m_retired.reserve(m_retired.size() + 1);
+
+    const Snapshot* previous = m_current.exchange(snapshot.release());
+    // Readers that may see previous snapshot stored epoch not larger than this one
+    uint64_t retireEpoch = m_epoch.fetch_add(1);
+    m_retired.push_back(std::make_pair(retireEpoch, previous));
+    reclaimLocked();
+}
+
+void ConcurrentOctree::reclaimLocked()
+{
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (const SlotsBlock* block = &m_slots; block != nullptr; block = block->next.load())
+    {
+        for (size_t i=0; i<slotsPerBlock; i++)
+        {
+            uint64_t epoch = block->slots[i].epoch.load();
+            if (epoch != 0)
+                oldest = std::min(oldest, epoch);
+        }
+    }
+    size_t kept = 0;
+    for (size_t i=0; i<m_retired.size(); i++)
+    {
+        if (m_retired[i].first < oldest)
+            delete m_retired[i].second;
+        else
+            m_retired[kept++] = m_retired[i];
+    }
+    m_retired.resize(kept);
+}
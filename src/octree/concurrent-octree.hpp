@@ -0,0 +1,174 @@
+#ifndef OCTREE_CONCURRENT_OCTREE_HPP_INCLUDED
+#define OCTREE_CONCURRENT_OCTREE_HPP_INCLUDED
+
+#include "octree.hpp"
+#include "linear-octree.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <utility>
+
+namespace octree {
+
+/**
+ * @brief Octree that may be queried by many threads while other threads modify it.
+ *
+ * Writers modify an Octree under writer mutex and publish() its LinearOctree snapshot
+ * by atomic pointer exchange. Readers never lock: read() gives a Reader that sees
+ * the last published snapshot, which is not changed while the Reader exists.
+ *
+ * Replaced snapshots are freed by epoch-based reclamation. Reader stores current epoch
+ * in its slot before loading snapshot pointer, and publish() frees snapshots retired
+ * before the oldest epoch of active readers, so a snapshot is never freed under a reader.
+ * Snapshot keeps shared pointers to its elements, so Reader::tree().element() stays valid
+ * after writers removed the element.
+ *
+ * Reader slots are kept in blocks of slotsPerBlock slots. If all slots are busy, reader
+ * appends a new block by atomic exchange instead of waiting, so readers count is not limited.
+ * Blocks are freed only by destructor.
+ *
+ * Publishing is not incremental: it rebuilds whole LinearOctree and copies pointers
+ * of all elements, so its cost is O(N). Writers should batch changes: use addMany()
+ * or modify() for many changes or several add() and remove() calls before one publish().
+ */
+class ConcurrentOctree
+{
+public:
+    /// Count of reader slots allocated at once
+    constexpr static size_t slotsPerBlock = 64;
+
+    /**
+     * @brief Published version of tree
+     */
+    struct Snapshot
+    {
+        LinearOctree tree;
+        std::vector<std::shared_ptr<Element>> elements;
+        /// Count of publish() calls before this snapshot, 0 for initial empty snapshot
+        uint64_t version = 0;
+    };
+
+    /**
+     * @brief Access of one reader to published snapshot. Reader holds one reader slot,
+     * so it should be short-lived and it should not be passed to other threads
+     */
+    class Reader
+    {
+    public:
+        Reader(Reader&& other);
+        ~Reader();
+
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+        Reader& operator=(Reader&&) = delete;
+
+        const LinearOctree& tree() const { return m_snapshot->tree; }
+        const Snapshot& snapshot() const { return *m_snapshot; }
+
+    private:
+        friend class ConcurrentOctree;
+        Reader(std::atomic<uint64_t>* slot, const Snapshot* snapshot);
+
+        std::atomic<uint64_t>* m_slot;
+        const Snapshot* m_snapshot;
+    };
+
+    /**
+     * @param initialSize Size of writers octree, see Octree::Octree()
+     */
+    explicit ConcurrentOctree(double initialSize = 1.0);
+    ~ConcurrentOctree();
+
+    ConcurrentOctree(const ConcurrentOctree&) = delete;
+    ConcurrentOctree& operator=(const ConcurrentOctree&) = delete;
+
+    /**
+     * @brief Get reader of the last published snapshot. It does not lock
+     */
+    Reader read() const;
+
+    /**
+     * @brief Add element to writers octree. It is visible to readers after publish()
+     */
+    void add(std::shared_ptr<Element> e);
+
+    /**
+     * @brief Add elements to writers octree by threads of pool, see Octree::addMany().
+     * They are visible to readers after publish()
+     */
+    void addMany(const std::vector<std::shared_ptr<Element>>& elements, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Remove element from writers octree, see Octree::remove()
+     */
+    bool remove(Element& e);
+
+    /**
+     * @brief Change writers octree by function(Octree&) under writer mutex and publish result.
+     * Function should not keep references to octree
+     */
+    template<typename Function>
+    void modify(Function function)
+    {
+        std::unique_lock<std::mutex> lock(m_writerMutex);
+        m_changed = true;
+        function(m_octree);
+        publishLocked();
+    }
+
+    /**
+     * @brief Build snapshot of writers octree, make it visible for new readers and
+     * free snapshots that are not used by readers anymore. It takes O(N) time,
+     * it does nothing if writers octree was not changed since the last publish()
+     */
+    void publish();
+
+    /**
+     * @brief Count of replaced snapshots that are not freed yet, because readers may use them
+     */
+    size_t retiredCount() const;
+
+private:
+    /**
+     * @brief Reader slot on its own cache line, so readers do not share lines
+     */
+    struct alignas(64) ReaderSlot
+    {
+        /// Epoch that reader saw when it started or 0 if slot is free
+        std::atomic<uint64_t> epoch{0};
+    };
+
+    struct SlotsBlock
+    {
+        ReaderSlot slots[slotsPerBlock];
+        std::atomic<SlotsBlock*> next{nullptr};
+
+        /// Global new of C++11 does not respect alignment of slots, so blocks are aligned here
+        static void* operator new(size_t size);
+        static void operator delete(void* ptr);
+    };
+
+    void publishLocked();
+    void reclaimLocked();
+
+    mutable std::mutex m_writerMutex;
+    Octree m_octree;
+    uint64_t m_version = 0;
+    /// Writers octree was changed after the last publish()
+    bool m_changed = false;
+
+    std::atomic<const Snapshot*> m_current{nullptr};
+    /// Epochs start from 1, so 0 marks free reader slot
+    mutable std::atomic<uint64_t> m_epoch{1};
+    /// The first block of reader slots, other blocks are appended by readers
+    mutable SlotsBlock m_slots;
+    /// Replaced snapshots with epochs when they were replaced, changed by writers only
+    std::vector<std::pair<uint64_t, const Snapshot*>> m_retired;
+};
+
+}
+
+#endif // OCTREE_CONCURRENT_OCTREE_HPP_INCLUDED
@@ -0,0 +1,296 @@
+#ifndef OCTREE_DUAL_TREE_CONVOLUTION_HPP_INCLUDED
+#define OCTREE_DUAL_TREE_CONVOLUTION_HPP_INCLUDED
+
+#include "octree.hpp"
+
+#include <vector>
+
+namespace octree {
+
+/**
+ * @brief Convolution at positions of all elements of target octree by node-to-node
+ * interactions, like fast multipole method do.
+ *
+ * Target and source nodes that are far enough from each other interact once. Result of
+ * such interaction is kept in target node as a local expansion: value and gradient at node
+ * center. Gradient is given by visitor or found by central differences along axes.
+ * Expansion is shifted to children centers and passed down to every element of target node.
+ *
+ * Node pair is accepted when both node diameters are not larger than the scale for the
+ * distance between nodes bounding spheres, so for single element target nodes criterion
+ * is the same as Convolution uses.
+ *
+ * ResultType should support operator+= and multiplication by double.
+ */
+template<typename ResultType = double>
+class DualTreeConvolution
+{
+public:
+    using Visitor = typename Convolution<ResultType>::Visitor;
+
+    DualTreeConvolution(const IScalesConfig& scalesConfig) :
+        m_scalesConfig(scalesConfig)
+    {
+    }
+
+    /**
+     * @brief Visitor that gives derivatives of result by target coordinates too
+     * @param gradient Array of 3 derivatives to fill or nullptr if only value is needed
+     */
+    using GradientVisitor = std::function<ResultType(const Position& target, const Position& object, double mass, ResultType* gradient)>;
+
+    /**
+     * @brief Calculate convolution by sources octree at positions of all elements of targets octree.
+     * Gradients for local expansions are found by central differences, so every accepted pair of
+     * nodes costs 7 visitor calls
+     * @param sources   Octree with objects
+     * @param targets   Octree with elements where to calculate. May be the same as sources
+     * @param v         Visitor function. It is called concurrently from different threads
+     * @param elements  Elements of targets octree in depth-first order
+     * @param results   Results for corresponding elements
+     */
+    void convolute(const Octree& sources, const Octree& targets, Visitor v,
+                   std::vector<const Element*>& elements, std::vector<ResultType>& results)
+    {
+        run(sources, targets, DifferencesInteraction{v}, elements, results);
+    }
+
+    /**
+     * @brief Calculate convolution by octree at positions of all its elements
+     */
+    void convolute(const Octree& oct, Visitor v,
+                   std::vector<const Element*>& elements, std::vector<ResultType>& results)
+    {
+        run(oct, oct, DifferencesInteraction{v}, elements, results);
+    }
+
+    /**
+     * @brief The same as convolute(), but visitor calculates gradient itself,
+     * so every accepted pair of nodes costs one visitor call
+     */
+    void convoluteWithGradient(const Octree& sources, const Octree& targets, GradientVisitor v,
+                               std::vector<const Element*>& elements, std::vector<ResultType>& results)
+    {
+        run(sources, targets, GradientInteraction{v}, elements, results);
+    }
+
+    void convoluteWithGradient(const Octree& oct, GradientVisitor v,
+                               std::vector<const Element*>& elements, std::vector<ResultType>& results)
+    {
+        run(oct, oct, GradientInteraction{v}, elements, results);
+    }
+
+    /**
+     * @brief Set threads used by convolute()
+     * @param pool Thread pool or nullptr to use ThreadPool::defaultPool()
+     */
+    void setThreadPool(ThreadPool* pool)
+    {
+        m_threadPool = pool;
+    }
+
+private:
+    struct DifferencesInteraction
+    {
+        ResultType operator()(const Position& target, const Position& object, double mass, double step, ResultType* gradient) const
+        {
+            if (gradient != nullptr)
+            {
+                for (int j=0; j<3; j++)
+                {
+                    Position forward = target, backward = target;
+                    forward.x[j] += step;
+                    backward.x[j] -= step;
+                    gradient[j] += v(forward, object, mass) * (0.5 / step);
+                    gradient[j] += v(backward, object, mass) * (-0.5 / step);
+                }
+            }
+            return v(target, object, mass);
+        }
+        const Visitor& v;
+    };
+
+    struct GradientInteraction
+    {
+        ResultType operator()(const Position& target, const Position& object, double mass, double, ResultType* gradient) const
+        {
+            return v(target, object, mass, gradient);
+        }
+        const GradientVisitor& v;
+    };
+
+    template<typename Interaction>
+    void run(const Octree& sources, const Octree& targets, const Interaction& interaction,
+             std::vector<const Element*>& elements, std::vector<ResultType>& results)
+    {
+        elements.clear();
+        results.clear();
+        if (targets.empty())
+            return;
+        targets.root().pushBackAllElements(elements);
+        results.assign(elements.size(), ResultType());
+        if (sources.empty())
+            return;
+
+        ThreadPool& pool = m_threadPool != nullptr ? *m_threadPool : ThreadPool::defaultPool();
+        // Aggregates are updated once before the parallel pass
+        sources.updateDirtyNodes(&pool);
+        targets.updateDirtyNodes(&pool);
+        const Node* targetRoot = &targets.root();
+
+        // Interaction with the root and splitting to target subtrees are done in calling thread,
+        // then subtrees are processed in parallel
+        Lists rootLists;
+        rootLists.resize(1);
+        rootLists.queues[0].push_back(&sources.root());
+        LocalExpansion local;
+        local.center = targetRoot->element != nullptr ? targetRoot->element->pos : targetRoot->center;
+        if (processNode(targetRoot, 0, rootLists, local, interaction))
+        {
+            if (!results.empty())
+                results[0] = local.value;
+            return;
+        }
+
+        std::vector<const Node*> subtrees;
+        std::vector<size_t> slots;
+        size_t slot = 0;
+        for (int i=0; i<8; i++)
+        {
+            const Node* child = targetRoot->subnodes[i].get();
+            if (child == nullptr)
+                continue;
+            subtrees.push_back(child);
+            slots.push_back(slot);
+            slot += child->elementsCount();
+        }
+
+        std::vector<Lists> workersLists(pool.threadsCount());
+        pool.parallelFor(subtrees.size(), 1,
+            [this, &subtrees, &slots, &rootLists, &workersLists, &local, &results, &interaction](unsigned worker, size_t begin, size_t end)
+            {
+                Lists& lists = workersLists[worker];
+                for (size_t i=begin; i<end; i++)
+                {
+                    lists.resize(2);
+                    lists.queues[1] = rootLists.next[0];
+                    size_t slot = slots[i];
+                    processSubtree(subtrees[i], 1, lists, local, interaction, results, slot);
+                }
+            }
+        );
+    }
+
+    /**
+     * @brief Source nodes lists for every depth of target tree.
+     * queues[d] are sources that should be checked against current node of depth d,
+     * next[d] are sources that are passed to its children
+     */
+    struct Lists
+    {
+        void resize(size_t depth)
+        {
+            if (queues.size() < depth)
+            {
+                queues.resize(depth);
+                next.resize(depth);
+            }
+        }
+        std::vector<std::vector<const Node*>> queues;
+        std::vector<std::vector<const Node*>> next;
+    };
+
+    /**
+     * @brief First order expansion of result near target node center
+     */
+    struct LocalExpansion
+    {
+        ResultType value = ResultType();
+        ResultType gradient[3] = {ResultType(), ResultType(), ResultType()};
+        Position center;
+
+        LocalExpansion shifted(const Position& newCenter) const
+        {
+            LocalExpansion result(*this);
+            result.center = newCenter;
+            for (int i=0; i<3; i++)
+                result.value += gradient[i] * (newCenter.x[i] - center.x[i]);
+            return result;
+        }
+    };
+
+    template<typename Interaction>
+    void processSubtree(const Node* target, size_t depth, Lists& lists, const LocalExpansion& inherited,
+                        const Interaction& interaction, std::vector<ResultType>& results, size_t& slot) const
+    {
+        if (target->isLeaf() && target->element == nullptr)
+            return;
+        LocalExpansion local = inherited.shifted(target->element != nullptr ? target->element->pos : target->center);
+        if (processNode(target, depth, lists, local, interaction))
+        {
+            results[slot++] = local.value;
+            return;
+        }
+        lists.resize(depth + 2);
+        for (int i=0; i<8; i++)
+        {
+            const Node* child = target->subnodes[i].get();
+            if (child == nullptr)
+                continue;
+            lists.queues[depth + 1] = lists.next[depth];
+            processSubtree(child, depth + 1, lists, local, interaction, results, slot);
+        }
+    }
+
+    /**
+     * @brief Interact target node with sources from lists.queues[depth]
+     * @param local Expansion of target node centered at its center or element position
+     * @return true if node is a leaf and all sources are processed
+     */
+    template<typename Interaction>
+    bool processNode(const Node* target, size_t depth, Lists& lists, LocalExpansion& local, const Interaction& interaction) const
+    {
+        bool isLeaf = target->isLeaf();
+        const Position& point = local.center;
+        double targetDia = target->element != nullptr ? 0.0 : target->dia;
+        // Step for central differences
+        double h = target->size * 0.5;
+
+        std::vector<const Node*>& queue = lists.queues[depth];
+        std::vector<const Node*>& next = lists.next[depth];
+        next.clear();
+        for (size_t i=0; i != queue.size(); i++)
+        {
+            const Node* source = queue[i];
+            double dist = source->getDistToCenter(point) - (source->dia + targetDia) * 0.5;
+            double scale = m_scalesConfig.findScale(dist);
+            bool sourceIsLeaf = source->isLeaf();
+            if (std::max(source->dia, targetDia) <= scale || (isLeaf && sourceIsLeaf))
+            {
+                // Pair is far enough or both nodes are single elements
+                if (isLeaf)
+                {
+                    local.value += interaction(point, source->massCenter, source->mass, h, nullptr);
+                    continue;
+                }
+                ResultType gradient[3] = {ResultType(), ResultType(), ResultType()};
+                local.value += interaction(point, source->massCenter, source->mass, h, gradient);
+                for (int j=0; j<3; j++)
+                    local.gradient[j] += gradient[j];
+            } else if (!isLeaf && (sourceIsLeaf || source->dia <= targetDia)) {
+                // Target node is larger, so it should be divided
+                next.push_back(source);
+            } else {
+                source->pushBackSubnodes(queue);
+            }
+        }
+        return isLeaf;
+    }
+
+    const IScalesConfig& m_scalesConfig;
+    ThreadPool* m_threadPool = nullptr;
+};
+
+}
+
+#endif // OCTREE_DUAL_TREE_CONVOLUTION_HPP_INCLUDED
@@ -0,0 +1,232 @@
+#include "kernels.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define OCTREE_X86_SIMD
+    #include <immintrin.h>
+#endif
+
+using namespace octree;
+
+namespace {
+
+double coulombPotentialSumScalar(const Position& target, const double* x, const double* y, const double* z,
+                                 const double* values, size_t count)
+{
+    double result = 0.0;
+    for (size_t i=0; i<count; i++)
+    {
+        double dx = target.x[0] - x[i];
+        double dy = target.x[1] - y[i];
+        double dz = target.x[2] - z[i];
+        double r2 = dx * dx + dy * dy + dz * dz;
+        if (r2 != 0.0)
+            result += values[i] / sqrt(r2);
+    }
+    return result;
+}
+
+void childrenSquaredDistsScalar(const Position& pos, const Position& center, double size,
+                                double* nearest, double* farest)
+{
+    // Children centers are center +- q along every axis and their half size is q
+    const double q = size * 0.25;
+    for (int i=0; i<8; i++)
+        nearest[i] = farest[i] = 0.0;
+    for (int k=0; k<3; k++)
+    {
+        double delta = pos.x[k] - center.x[k];
+        for (int i=0; i<8; i++)
+        {
+            double d = std::fabs(delta - ((i >> k) & 1 ? q : -q));
+            double outside = std::max(d - q, 0.0);
+            nearest[i] += outside * outside;
+            farest[i] += (d + q) * (d + q);
+        }
+    }
+}
+
+#ifdef OCTREE_X86_SIMD
+
+__attribute__((target("avx2")))
+void childrenSquaredDistsAvx2(const Position& pos, const Position& center, double size,
+                              double* nearest, double* farest)
+{
+    const double q = size * 0.25;
+    const __m256d vq = _mm256_set1_pd(q);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d signBit = _mm256_set1_pd(-0.0);
+    // Children 0..3 are lower half along z and children 4..7 are upper one
+    const __m256d offsets[2][3] = {
+        {_mm256_setr_pd(-q, q, -q, q), _mm256_setr_pd(-q, -q, q, q), _mm256_set1_pd(-q)},
+        {_mm256_setr_pd(-q, q, -q, q), _mm256_setr_pd(-q, -q, q, q), _mm256_set1_pd(q)}
+    };
+    for (int half=0; half<2; half++)
+    {
+        __m256d near = zero, far = zero;
+        for (int k=0; k<3; k++)
+        {
+            __m256d delta = _mm256_set1_pd(pos.x[k] - center.x[k]);
+            __m256d d = _mm256_andnot_pd(signBit, _mm256_sub_pd(delta, offsets[half][k]));
+            __m256d outside = _mm256_max_pd(_mm256_sub_pd(d, vq), zero);
+            __m256d sum = _mm256_add_pd(d, vq);
+            near = _mm256_add_pd(near, _mm256_mul_pd(outside, outside));
+            far = _mm256_add_pd(far, _mm256_mul_pd(sum, sum));
+        }
+        _mm256_storeu_pd(nearest + 4 * half, near);
+        _mm256_storeu_pd(farest + 4 * half, far);
+    }
+}
+
+__attribute__((target("avx512f")))
+void childrenSquaredDistsAvx512(const Position& pos, const Position& center, double size,
+                                double* nearest, double* farest)
+{
+    const double q = size * 0.25;
+    const __m512d vq = _mm512_set1_pd(q);
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d offsets[3] = {
+        _mm512_setr_pd(-q, q, -q, q, -q, q, -q, q),
+        _mm512_setr_pd(-q, -q, q, q, -q, -q, q, q),
+        _mm512_setr_pd(-q, -q, -q, -q, q, q, q, q)
+    };
+    __m512d near = zero, far = zero;
+    for (int k=0; k<3; k++)
+    {
+        __m512d delta = _mm512_set1_pd(pos.x[k] - center.x[k]);
+        __m512d d = _mm512_abs_pd(_mm512_sub_pd(delta, offsets[k]));
+        // Zero-masking instead of _mm512_max_pd(), whose pass-through vector is undefined in GCC
+        __m512d outside = _mm512_maskz_sub_pd(_mm512_cmp_pd_mask(d, vq, _CMP_GT_OQ), d, vq);
+        __m512d sum = _mm512_add_pd(d, vq);
+        near = _mm512_add_pd(near, _mm512_mul_pd(outside, outside));
+        far = _mm512_add_pd(far, _mm512_mul_pd(sum, sum));
+    }
+    _mm512_storeu_pd(nearest, near);
+    _mm512_storeu_pd(farest, far);
+}
+
+__attribute__((target("avx2,fma")))
+double coulombPotentialSumAvx2(const Position& target, const double* x, const double* y, const double* z,
+                               const double* values, size_t count)
+{
+    const __m256d tx = _mm256_set1_pd(target.x[0]);
+    const __m256d ty = _mm256_set1_pd(target.x[1]);
+    const __m256d tz = _mm256_set1_pd(target.x[2]);
+    const __m256d zero = _mm256_setzero_pd();
+    __m256d sum = zero;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d dx = _mm256_sub_pd(tx, _mm256_loadu_pd(x + i));
+        __m256d dy = _mm256_sub_pd(ty, _mm256_loadu_pd(y + i));
+        __m256d dz = _mm256_sub_pd(tz, _mm256_loadu_pd(z + i));
+        __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+        __m256d nonZero = _mm256_cmp_pd(r2, zero, _CMP_NEQ_OQ);
+        __m256d term = _mm256_div_pd(_mm256_loadu_pd(values + i), _mm256_sqrt_pd(r2));
+        sum = _mm256_add_pd(sum, _mm256_and_pd(term, nonZero));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, sum);
+    double result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    return result + coulombPotentialSumScalar(target, x + i, y + i, z + i, values + i, count - i);
+}
+
+/**
+ * @brief values / sqrt(r2) for lanes of mask and zero for other ones.
+ * Zero-masking forms are used because unmasked sqrt of GCC takes
+ * undefined pass-through vector, which gives uninitialized warnings
+ */
+__attribute__((target("avx512f")))
+inline __m512d coulombTermsAvx512(__m512d values, __m512d r2, __mmask8 mask)
+{
+    return _mm512_maskz_div_pd(mask, values, _mm512_maskz_sqrt_pd(mask, r2));
+}
+
+__attribute__((target("avx512f")))
+double coulombPotentialSumAvx512(const Position& target, const double* x, const double* y, const double* z,
+                                 const double* values, size_t count)
+{
+    const __m512d tx = _mm512_set1_pd(target.x[0]);
+    const __m512d ty = _mm512_set1_pd(target.x[1]);
+    const __m512d tz = _mm512_set1_pd(target.x[2]);
+    const __m512d zero = _mm512_setzero_pd();
+    __m512d sum = zero;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m512d dx = _mm512_sub_pd(tx, _mm512_loadu_pd(x + i));
+        __m512d dy = _mm512_sub_pd(ty, _mm512_loadu_pd(y + i));
+        __m512d dz = _mm512_sub_pd(tz, _mm512_loadu_pd(z + i));
+        __m512d r2 = _mm512_fmadd_pd(dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+        __mmask8 nonZero = _mm512_cmp_pd_mask(r2, zero, _CMP_NEQ_OQ);
+        sum = _mm512_add_pd(sum, coulombTermsAvx512(_mm512_loadu_pd(values + i), r2, nonZero));
+    }
+    // Tail is processed with masked loads. Lanes out of tail are not used
+    // because nonZero mask is ANDed with tail mask
+    if (i < count)
+    {
+        __mmask8 tail = static_cast<__mmask8>((1u << (count - i)) - 1);
+        __m512d dx = _mm512_sub_pd(tx, _mm512_maskz_loadu_pd(tail, x + i));
+        __m512d dy = _mm512_sub_pd(ty, _mm512_maskz_loadu_pd(tail, y + i));
+        __m512d dz = _mm512_sub_pd(tz, _mm512_maskz_loadu_pd(tail, z + i));
+        __m512d r2 = _mm512_fmadd_pd(dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+        __mmask8 nonZero = _mm512_cmp_pd_mask(r2, zero, _CMP_NEQ_OQ) & tail;
+        sum = _mm512_add_pd(sum, coulombTermsAvx512(_mm512_maskz_loadu_pd(tail, values + i), r2, nonZero));
+    }
+    // _mm512_reduce_add_pd() is not used for the same reason as unmasked sqrt
+    double lanes[8];
+    _mm512_storeu_pd(lanes, sum);
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+SimdLevel detectSimdLevel()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SimdLevel::avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SimdLevel::avx2;
+    return SimdLevel::scalar;
+}
+
+#else
+
+SimdLevel detectSimdLevel()
+{
+    return SimdLevel::scalar;
+}
+
+#endif
+
+}
+
+SimdLevel octree::supportedSimdLevel()
+{
+    static const SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+double octree::coulombPotentialSum(const Position& target, const double* x, const double* y, const double* z,
+                                   const double* values, size_t count, SimdLevel level)
+{
+    level = std::min(level, supportedSimdLevel());
+#ifdef OCTREE_X86_SIMD
+    if (level == SimdLevel::avx512)
+        return coulombPotentialSumAvx512(target, x, y, z, values, count);
+    if (level == SimdLevel::avx2)
+        return coulombPotentialSumAvx2(target, x, y, z, values, count);
+#endif
+    return coulombPotentialSumScalar(target, x, y, z, values, count);
+}
+
+void octree::childrenSquaredDists(const Position& pos, const Position& center, double size,
+                                  double* nearest, double* farest, SimdLevel level)
+{
+    level = std::min(level, supportedSimdLevel());
+#ifdef OCTREE_X86_SIMD
+    if (level == SimdLevel::avx512)
+        return childrenSquaredDistsAvx512(pos, center, size, nearest, farest);
+    if (level == SimdLevel::avx2)
+        return childrenSquaredDistsAvx2(pos, center, size, nearest, farest);
+#endif
+    childrenSquaredDistsScalar(pos, center, size, nearest, farest);
+}
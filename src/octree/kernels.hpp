@@ -0,0 +1,148 @@
+#ifndef OCTREE_KERNELS_HPP_INCLUDED
+#define OCTREE_KERNELS_HPP_INCLUDED
+
+#include "octree.hpp"
+
+namespace octree {
+
+/**
+ * @brief Instruction sets used by vectorized kernels
+ */
+enum class SimdLevel
+{
+    scalar = 0,
+    avx2,
+    avx512
+};
+
+/**
+ * @brief The best instruction set supported by CPU, detected once at runtime
+ */
+SimdLevel supportedSimdLevel();
+
+/**
+ * @brief Sum of values[i] / |target - r_i| for elements given as structure of arrays.
+ * Elements that are exactly at target are skipped
+ * @param level Instruction set to use, it is lowered to supportedSimdLevel() if needed
+ */
+double coulombPotentialSum(const Position& target, const double* x, const double* y, const double* z,
+                           const double* values, size_t count, SimdLevel level);
+
+inline double coulombPotentialSum(const Position& target, const double* x, const double* y, const double* z,
+                                  const double* values, size_t count)
+{
+    return coulombPotentialSum(target, x, y, z, values, count, supportedSimdLevel());
+}
+
+/**
+ * @brief Squared nearest and farest distances from point to boxes of all 8 children of cube,
+ * computed in one pass. Child i is subdivision index i, its half is upper along axis k
+ * if bit k of i is set, the same as SubdivisionPos::index() gives
+ * @param center  Cube center
+ * @param size    Cube size
+ * @param nearest Array of 8 squared distances to nearest points of children, 0 if point is inside
+ * @param farest  Array of 8 squared distances to farest corners of children
+ * @param level   Instruction set to use, it is lowered to supportedSimdLevel() if needed
+ */
+void childrenSquaredDists(const Position& pos, const Position& center, double size,
+                          double* nearest, double* farest, SimdLevel level);
+
+inline void childrenSquaredDists(const Position& pos, const Position& center, double size,
+                                 double* nearest, double* farest)
+{
+    childrenSquaredDists(pos, center, size, nearest, farest, supportedSimdLevel());
+}
+
+/**
+ * @brief Coulomb potential kernel mass / |target - object| for StaticConvolution.
+ * Node that contains target itself gives zero
+ */
+struct CoulombPotentialKernel
+{
+    double operator()(const Position& target, const Position& object, double mass) const
+    {
+        double d = (target - object).len();
+        if (d == 0.0)
+            return 0.0;
+        return mass / d;
+    }
+
+    double directSum(const Position& target, const double* x, const double* y, const double* z,
+                     const double* values, size_t count) const
+    {
+        return coulombPotentialSum(target, x, y, z, values, count);
+    }
+};
+
+/**
+ * @brief Coulomb field kernel mass * (target - object) / |target - object|^3,
+ * it is minus gradient of CoulombPotentialKernel. Node that contains target itself gives zero
+ */
+struct CoulombFieldKernel
+{
+    Position operator()(const Position& target, const Position& object, double mass) const
+    {
+        Position r = target - object;
+        double r2 = r * r;
+        if (r2 == 0.0)
+            return Position();
+        double invR = 1.0 / sqrt(r2);
+        return r * (mass * invR * invR * invR);
+    }
+};
+
+/**
+ * @brief Coulomb potential sum value / |target - r| for elements of node approximated
+ * by monopole, dipole and quadrupole terms. May be used as Convolution::MultipoleVisitor
+ * @param target     Point where to calculate
+ * @param center     Node mass center
+ * @param mass       Node mass
+ * @param multipoles Node moments relative to mass center
+ */
+inline double multipolePotential(const Position& target, const Position& center, double mass, const Multipoles& multipoles)
+{
+    Position r = target - center;
+    double r2 = r * r;
+    if (r2 == 0.0)
+        return 0.0;
+    double invR = 1.0 / sqrt(r2);
+    double invR2 = invR * invR;
+    double invR3 = invR * invR2;
+    const double* q = multipoles.quadrupole;
+    double rQr = q[0] * r[0] * r[0] + q[1] * r[1] * r[1] + q[2] * r[2] * r[2]
+            + 2.0 * (q[3] * r[0] * r[1] + q[4] * r[0] * r[2] + q[5] * r[1] * r[2]);
+    return mass * invR + (multipoles.dipole * r) * invR3 + 0.5 * rQr * invR3 * invR2;
+}
+
+/**
+ * @brief Coulomb field (minus gradient of multipolePotential()) for elements of node
+ * approximated by monopole, dipole and quadrupole terms
+ */
+inline Position multipoleField(const Position& target, const Position& center, double mass, const Multipoles& multipoles)
+{
+    Position r = target - center;
+    double r2 = r * r;
+    if (r2 == 0.0)
+        return Position();
+    double invR = 1.0 / sqrt(r2);
+    double invR2 = invR * invR;
+    double invR3 = invR * invR2;
+    double invR5 = invR3 * invR2;
+    const double* q = multipoles.quadrupole;
+    const Position& p = multipoles.dipole;
+    Position qr(
+        q[0] * r[0] + q[3] * r[1] + q[4] * r[2],
+        q[3] * r[0] + q[1] * r[1] + q[5] * r[2],
+        q[4] * r[0] + q[5] * r[1] + q[2] * r[2]
+    );
+    double rQr = qr * r;
+    double pr = p * r;
+    Position field = r * (mass * invR3);
+    field += r * (3.0 * pr * invR5) - p * invR3;
+    field += r * (2.5 * rQr * invR5 * invR2) - qr * invR5;
+    return field;
+}
+
+}
+
+#endif // OCTREE_KERNELS_HPP_INCLUDED
@@ -0,0 +1,824 @@
+#include "linear-octree.hpp"
+#include "snapshot-format.hpp"
+#include "kernels.hpp"
+
+#include <stdexcept>
+#include <limits>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+
+using namespace octree;
+using namespace octree::details;
+
+namespace {
+
+size_t countNodes(const Node& node)
+{
+    size_t count = 1;
+    for (int i=0; i<8; i++)
+    {
+        if (node.subnodes[i] != nullptr)
+            count += countNodes(*node.subnodes[i]);
+    }
+    return count;
+}
+
+}
+
+int LinearNode::childrenCount() const
+{
+    int count = 0;
+    for (uint8_t mask = childrenMask; mask != 0; mask &= mask - 1)
+        count++;
+    return count;
+}
+
+const LinearNode* LinearNode::child(int index) const
+{
+    if ((childrenMask & (1 << index)) == 0)
+        return nullptr;
+    // Children are stored in subdivision index order, so we need to skip
+    // existing children with lower indexes
+    int skip = 0;
+    for (uint8_t mask = childrenMask & ((1 << index) - 1); mask != 0; mask &= mask - 1)
+        skip++;
+    return firstChild() + skip;
+}
+
+DistToNode LinearNode::getDistsToNode(const Position& pos) const
+{
+    DistToNode result;
+    if (isLeaf() && elementsCount == 1)
+    {
+        // Mass center of single element node is exactly element position
+        result.nearest = result.farest = massCenter.distTo(pos);
+        return result;
+    }
+    double hs = size * 0.5;
+    double nearest = 0.0, farest = 0.0;
+    for (int i=0; i<3; i++)
+    {
+        double d = std::fabs(pos.x[i] - center.x[i]);
+        double outside = d - hs;
+        if (outside > 0.0)
+            nearest += outside * outside;
+        farest += (d + hs) * (d + hs);
+    }
+    result.nearest = sqrt(nearest);
+    result.farest = sqrt(farest);
+    return result;
+}
+
+bool LinearNode::isInside(const Position& pos) const
+{
+    const double *p = pos.x;
+    const double *c = center.x;
+    double hs = size*0.5;
+    return (p[0] >= c[0] - hs) & (p[0] < c[0] + hs)
+            & (p[1] >= c[1] - hs) & (p[1] < c[1] + hs)
+            & (p[2] >= c[2] - hs) & (p[2] < c[2] + hs);
+}
+
+/////////////////////////////////
+// LinearOctree
+LinearOctree::LinearOctree()
+{
+}
+
+LinearOctree::LinearOctree(const Octree& octree)
+{
+    build(octree);
+}
+
+LinearOctree::LinearOctree(const LinearOctree& other) :
+    m_nodes(other.m_nodesTable, other.m_nodesTable + other.m_nodesCount),
+    m_values(other.m_valuesTable, other.m_valuesTable + other.m_count),
+    m_sourceIndexes(other.m_sourceIndexesTable, other.m_sourceIndexesTable + other.m_count),
+    m_elements(other.m_elements)
+{
+    // Tables of mapped tree are copied too, so updateValues() of copy does not change original
+    for (int j=0; j<3; j++)
+        m_coordinates[j].assign(other.m_coordinatesTable[j], other.m_coordinatesTable[j] + other.m_count);
+    attachOwnedTables();
+}
+
+LinearOctree::LinearOctree(LinearOctree&& other) :
+    m_nodes(std::move(other.m_nodes)),
+    m_values(std::move(other.m_values)),
+    m_sourceIndexes(std::move(other.m_sourceIndexes)),
+    m_elements(std::move(other.m_elements)),
+    m_snapshot(std::move(other.m_snapshot))
+{
+    for (int j=0; j<3; j++)
+        m_coordinates[j] = std::move(other.m_coordinates[j]);
+    copyTables(other);
+    other.clear();
+}
+
+LinearOctree& LinearOctree::operator=(const LinearOctree& other)
+{
+    if (this != &other)
+    {
+        LinearOctree copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+LinearOctree& LinearOctree::operator=(LinearOctree&& other)
+{
+    if (this != &other)
+    {
+        m_nodes = std::move(other.m_nodes);
+        for (int j=0; j<3; j++)
+            m_coordinates[j] = std::move(other.m_coordinates[j]);
+        m_values = std::move(other.m_values);
+        m_sourceIndexes = std::move(other.m_sourceIndexes);
+        m_elements = std::move(other.m_elements);
+        m_snapshot = std::move(other.m_snapshot);
+        copyTables(other);
+        other.clear();
+    }
+    return *this;
+}
+
+LinearOctree::LinearOctree(const Position* positions, const double* values, size_t count,
+                           uint32_t bucketSize, ThreadPool* pool)
+{
+    build(positions, values, count, bucketSize, pool);
+}
+
+void LinearOctree::build(const Octree& octree)
+{
+    clear();
+    if (octree.empty())
+        return;
+    octree.updateDirtyNodes();
+
+    size_t nodesCount = countNodes(octree.root());
+    if (nodesCount > std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("Octree is too large for linear representation");
+
+    // Nodes are referenced by index during building, but reserving prevents
+    // reallocations anyway
+    m_nodes.reserve(nodesCount);
+    // Element tables are read through table pointers while flattening, so they should not be reallocated
+    size_t count = octree.root().elementsCount();
+    for (int j=0; j<3; j++)
+        m_coordinates[j].reserve(count);
+    m_values.reserve(count);
+    m_sourceIndexes.reserve(count);
+    m_elements.reserve(count);
+    attachOwnedTables();
+    m_nodes.push_back(LinearNode());
+    flatten(octree.root(), 0);
+    attachOwnedTables();
+}
+
+void LinearOctree::build(const Position* positions, const double* values, size_t count,
+                         uint32_t bucketSize, ThreadPool* pool)
+{
+    if (count == 0)
+    {
+        clear();
+        return;
+    }
+
+    Position boxMin = positions[0], boxMax = positions[0];
+    for (size_t i=1; i<count; i++)
+    {
+        for (int j=0; j<3; j++)
+        {
+            boxMin.x[j] = std::min(boxMin.x[j], positions[i].x[j]);
+            boxMax.x[j] = std::max(boxMax.x[j], positions[i].x[j]);
+        }
+    }
+    double size = rootSize(boxMin, boxMax);
+    Position center = (boxMin + boxMax) * 0.5;
+    buildCell(MortonGrid(center, size), center, size, 0, positions, values, count, bucketSize, pool);
+}
+
+void LinearOctree::buildCell(const MortonGrid& grid, const Position& center, double size, int level,
+                             const Position* positions, const double* values, size_t count,
+                             uint32_t bucketSize, ThreadPool* pool)
+{
+    clear();
+    if (count == 0)
+        return;
+    if (count > std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("Too many points for linear representation");
+    if (bucketSize == 0)
+        bucketSize = 1;
+
+    LinearNode root{};
+    root.center = center;
+    root.size = size;
+
+    std::vector<MortonKey> keys(count);
+    for (size_t i=0; i<count; i++)
+        keys[i] = MortonKey(grid.key(positions[i]), i);
+    sortMortonKeys(keys, pool != nullptr ? *pool : ThreadPool::defaultPool());
+
+    for (int j=0; j<3; j++)
+        m_coordinates[j].reserve(count);
+    m_values.reserve(count);
+    m_sourceIndexes.reserve(count);
+    for (const MortonKey& key : keys)
+    {
+        pushBackElement(positions[key.second], values != nullptr ? values[key.second] : 0.0);
+        m_sourceIndexes.push_back(key.second);
+    }
+
+    attachOwnedTables();
+    m_nodes.push_back(root);
+    flattenSorted(keys, 0, count, level, bucketSize, 0);
+    attachOwnedTables();
+}
+
+double LinearOctree::rootSize(const Position& boxMin, const Position& boxMax)
+{
+    double extent = std::max(boxMax[0] - boxMin[0], std::max(boxMax[1] - boxMin[1], boxMax[2] - boxMin[2]));
+    // Root box is a bit larger than bounding box, so the farthest points are strictly inside
+    return extent > 0.0 ? extent * 1.001 : 1.0;
+}
+
+void LinearOctree::clear()
+{
+    m_nodes.clear();
+    for (int j=0; j<3; j++)
+        m_coordinates[j].clear();
+    m_values.clear();
+    m_sourceIndexes.clear();
+    m_elements.clear();
+    m_snapshot.reset();
+    attachOwnedTables();
+}
+
+void LinearOctree::save(const std::string& path) const
+{
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+    header.version = snapshotVersion;
+    header.byteOrder = byteOrderMark;
+    header.nodeSize = sizeof(LinearNode);
+    header.nodesCount = m_nodesCount;
+    header.elementsCount = m_count;
+
+    uint64_t offset = alignTable(sizeof(SnapshotHeader));
+    header.nodesOffset = offset;
+    offset = alignTable(offset + m_nodesCount * sizeof(LinearNode));
+    for (int j=0; j<3; j++)
+    {
+        header.coordinatesOffset[j] = offset;
+        offset = alignTable(offset + m_count * sizeof(double));
+    }
+    header.valuesOffset = offset;
+    offset = alignTable(offset + m_count * sizeof(double));
+    header.sourceIndexesOffset = offset;
+    header.fileSize = offset + m_count * sizeof(uint32_t);
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+        throw std::runtime_error("Cannot open file " + path + " for writing");
+    uint64_t written = 0;
+    auto writeTable = [&file, &written](uint64_t offset, const void* data, uint64_t size)
+    {
+        static const char padding[tableAlignment] = {};
+        file.write(padding, offset - written);
+        file.write(static_cast<const char*>(data), size);
+        written = offset + size;
+    };
+    writeTable(0, &header, sizeof(header));
+    writeTable(header.nodesOffset, m_nodesTable, m_nodesCount * sizeof(LinearNode));
+    for (int j=0; j<3; j++)
+        writeTable(header.coordinatesOffset[j], m_coordinatesTable[j], m_count * sizeof(double));
+    writeTable(header.valuesOffset, m_valuesTable, m_count * sizeof(double));
+    writeTable(header.sourceIndexesOffset, m_sourceIndexesTable, m_count * sizeof(uint32_t));
+    file.flush();
+    if (!file)
+        throw std::runtime_error("Cannot write snapshot to " + path);
+}
+
+void LinearOctree::load(const std::string& path)
+{
+    std::shared_ptr<MappedFile> snapshot = std::make_shared<MappedFile>(path);
+    if (snapshot->size() < sizeof(SnapshotHeader))
+        throw std::runtime_error(path + " is not an octree snapshot");
+    SnapshotHeader header;
+    std::memcpy(&header, snapshot->data(), sizeof(header));
+    if (std::memcmp(header.magic, snapshotMagic, sizeof(header.magic)) != 0)
+        throw std::runtime_error(path + " is not an octree snapshot");
+    if (header.version != snapshotVersion)
+        throw std::runtime_error("Unsupported version of octree snapshot " + path);
+    if (header.byteOrder != byteOrderMark || header.nodeSize != sizeof(LinearNode))
+        throw std::runtime_error("Octree snapshot " + path + " was written on incompatible platform");
+    if (header.fileSize != snapshot->size() || header.elementsCount > std::numeric_limits<uint32_t>::max()
+            || header.nodesCount > header.fileSize / sizeof(LinearNode))
+        throw std::runtime_error("Octree snapshot " + path + " is damaged");
+
+    auto table = [&header, &snapshot, &path](uint64_t offset, uint64_t size) -> char*
+    {
+        if (offset % tableAlignment != 0 || offset > header.fileSize || size > header.fileSize - offset)
+            throw std::runtime_error("Octree snapshot " + path + " is damaged");
+        return snapshot->data() + offset;
+    };
+    LinearNode* nodes = reinterpret_cast<LinearNode*>(table(header.nodesOffset, header.nodesCount * sizeof(LinearNode)));
+    double* coordinates[3];
+    for (int j=0; j<3; j++)
+        coordinates[j] = reinterpret_cast<double*>(table(header.coordinatesOffset[j], header.elementsCount * sizeof(double)));
+    double* values = reinterpret_cast<double*>(table(header.valuesOffset, header.elementsCount * sizeof(double)));
+    const uint32_t* sourceIndexes = reinterpret_cast<const uint32_t*>(
+                table(header.sourceIndexesOffset, header.elementsCount * sizeof(uint32_t)));
+
+    // Queries and updateValues() use nodes links and source indexes without checks,
+    // so they are validated by one pass instead of trusting the file
+    for (uint64_t i=0; i<header.nodesCount; i++)
+    {
+        const LinearNode& node = nodes[i];
+        bool valid = uint64_t(node.elementsBegin) + node.elementsCount <= header.elementsCount;
+        if (node.childrenMask != 0)
+            valid = valid && node.childrenOffset != 0 && i + node.childrenOffset + node.childrenCount() <= header.nodesCount;
+        if (!valid)
+            throw std::runtime_error("Octree snapshot " + path + " is damaged");
+    }
+    for (uint64_t i=0; i<header.elementsCount; i++)
+    {
+        if (sourceIndexes[i] >= header.elementsCount)
+            throw std::runtime_error("Octree snapshot " + path + " is damaged");
+    }
+
+    clear();
+    m_snapshot = std::move(snapshot);
+    m_nodesTable = nodes;
+    m_nodesCount = header.nodesCount;
+    for (int j=0; j<3; j++)
+        m_coordinatesTable[j] = coordinates[j];
+    m_valuesTable = values;
+    m_sourceIndexesTable = sourceIndexes;
+    m_count = header.elementsCount;
+}
+
+bool LinearOctree::isMapped() const
+{
+    return m_snapshot != nullptr;
+}
+
+bool LinearOctree::empty() const
+{
+    return m_nodesCount == 0;
+}
+
+size_t LinearOctree::count() const
+{
+    return m_count;
+}
+
+size_t LinearOctree::nodesCount() const
+{
+    return m_nodesCount;
+}
+
+const LinearNode& LinearOctree::root() const
+{
+    return m_nodesTable[0];
+}
+
+double LinearOctree::mass() const
+{
+    if (empty())
+        return 0.0;
+    return root().mass;
+}
+
+const Position& LinearOctree::massCenter() const
+{
+    return root().massCenter;
+}
+
+Position LinearOctree::position(uint32_t index) const
+{
+    return Position(m_coordinatesTable[0][index], m_coordinatesTable[1][index], m_coordinatesTable[2][index]);
+}
+
+double LinearOctree::value(uint32_t index) const
+{
+    return m_valuesTable[index];
+}
+
+uint32_t LinearOctree::sourceIndex(uint32_t index) const
+{
+    return m_sourceIndexesTable[index];
+}
+
+void LinearOctree::updateValues(const double* values)
+{
+    for (size_t i=0; i<m_count; i++)
+        m_valuesTable[i] = values[m_sourceIndexesTable[i]];
+    // Children are always stored after their parent, so reverse order is bottom-up
+    for (size_t i=m_nodesCount; i-- > 0; )
+        updateAggregates(m_nodesTable[i]);
+}
+
+const double* LinearOctree::coordinates(int axis) const
+{
+    return m_coordinatesTable[axis];
+}
+
+const double* LinearOctree::values() const
+{
+    return m_valuesTable;
+}
+
+const Element* LinearOctree::element(uint32_t index) const
+{
+    if (m_elements.empty())
+        return nullptr;
+    return m_elements[index];
+}
+
+uint32_t LinearOctree::getNearest(const Position& pos) const
+{
+    if (empty() || count() == 0)
+        throw(std::runtime_error("Octree is empty"));
+    // Buffer is reused by calls from the same thread
+    thread_local std::vector<uint32_t> nearest;
+    getKNearest(nearest, pos, 1);
+    return nearest.front();
+}
+
+void LinearOctree::getKNearest(std::vector<uint32_t>& result, const Position& pos, size_t k, double epsilon) const
+{
+    result.clear();
+    if (empty() || k == 0)
+        return;
+
+    // nd = squared distance and node, queue is min-heap by distance
+    using nd = std::pair<double, const LinearNode*>;
+    // ed = squared distance and element index, found is max-heap by distance
+    using ed = std::pair<double, uint32_t>;
+    auto farther = [](const nd& left, const nd& right) { return left.first > right.first; };
+    auto closer = [](const ed& left, const ed& right) { return left.first < right.first; };
+    // Buffers are reused by calls from the same thread, so there are no allocations in most calls
+    thread_local std::vector<nd> queue;
+    thread_local std::vector<ed> found;
+    queue.clear();
+    found.clear();
+
+    // Node is opened only if its box is closer than current k-th distance divided by (1 + epsilon)
+    const double factor = (1.0 + epsilon) * (1.0 + epsilon);
+    auto worth = [factor, k](double dist)
+    {
+        return found.size() < k || dist * factor < found.front().first;
+    };
+
+    queue.push_back(nd(root().getSquaredDistToBox(pos), &root()));
+    while (!queue.empty())
+    {
+        nd top = queue.front();
+        std::pop_heap(queue.begin(), queue.end(), farther);
+        queue.pop_back();
+        // All other nodes are not closer
+        if (!worth(top.first))
+            break;
+
+        const LinearNode* n = top.second;
+        if (n->isLeaf())
+        {
+            for (uint32_t j = n->elementsBegin; j != n->elementsBegin + n->elementsCount; j++)
+            {
+                Position d = position(j) - pos;
+                double dist = d * d;
+                if (found.size() < k)
+                {
+                    found.push_back(ed(dist, j));
+                    std::push_heap(found.begin(), found.end(), closer);
+                } else if (dist < found.front().first) {
+                    std::pop_heap(found.begin(), found.end(), closer);
+                    found.back() = ed(dist, j);
+                    std::push_heap(found.begin(), found.end(), closer);
+                }
+            }
+            continue;
+        }
+
+        double nearest[8], farest[8];
+        childrenSquaredDists(pos, n->center, n->size, nearest, farest);
+        const LinearNode* subnode = n->firstChild();
+        for (int i=0; i<8; i++)
+        {
+            if ((n->childrenMask & (1 << i)) == 0)
+                continue;
+            // Single element leaf is checked by element position instead of its box
+            double dist = subnode->isLeaf() && subnode->elementsCount == 1 ? subnode->getSquaredDistToBox(pos) : nearest[i];
+            if (worth(dist))
+            {
+                queue.push_back(nd(dist, subnode));
+                std::push_heap(queue.begin(), queue.end(), farther);
+            }
+            subnode++;
+        }
+    }
+
+    std::sort_heap(found.begin(), found.end(), closer);
+    for (const ed& it : found)
+        result.push_back(it.second);
+}
+
+void LinearOctree::getClose(std::vector<uint32_t>& target, const Position& pos, double dist) const
+{
+    std::vector<const LinearNode*> nodesVector;
+    nodesVector.reserve(200);
+    getClose(target, pos, dist, nodesVector);
+}
+
+void LinearOctree::getNearestMany(const Position* points, size_t count, uint32_t* result, ThreadPool* pool) const
+{
+    if (count == 0)
+        return;
+    if (empty() || this->count() == 0)
+        throw(std::runtime_error("Octree is empty"));
+    ThreadPool& threads = pool != nullptr ? *pool : ThreadPool::defaultPool();
+    MortonGrid grid(root().center, root().size);
+    std::vector<MortonKey> order(count);
+    for (size_t i=0; i<count; i++)
+        order[i] = MortonKey(grid.key(points[i]), i);
+    sortMortonKeys(order, threads);
+
+    threads.parallelFor(count, 64,
+        [this, points, result, &order](unsigned, size_t begin, size_t end)
+        {
+            std::vector<uint32_t> nearest;
+            for (size_t i=begin; i<end; i++)
+            {
+                size_t index = order[i].second;
+                getKNearest(nearest, points[index], 1);
+                result[index] = nearest.front();
+            }
+        }
+    );
+}
+
+void LinearOctree::getCloseMany(const Position* points, const double* radii, size_t count,
+                                std::vector<size_t>& offsets, std::vector<uint32_t>& indexes, ThreadPool* pool) const
+{
+    indexes.clear();
+    if (empty())
+    {
+        offsets.assign(count + 1, 0);
+        return;
+    }
+    ThreadPool& threads = pool != nullptr ? *pool : ThreadPool::defaultPool();
+    std::vector<std::vector<const LinearNode*>> scratch(threads.threadsCount());
+    runMortonOrderedQueries(threads, MortonGrid(root().center, root().size), points, count, offsets, indexes,
+        [this, points, radii, &scratch](unsigned worker, size_t index, std::vector<uint32_t>& out)
+        {
+            getClose(out, points[index], radii[index], scratch[worker]);
+        }
+    );
+}
+
+void LinearOctree::getClose(std::vector<uint32_t>& target, const Position& pos, double dist,
+                            std::vector<const LinearNode*>& nodesVector) const
+{
+    nodesVector.clear();
+    if (empty())
+        return;
+
+    const double squaredDist = dist * dist;
+    // Node that is partially close and has no children, its elements are checked one by one
+    auto checkElements = [this, &target, &pos, squaredDist](const LinearNode& n)
+    {
+        for (uint32_t j = n.elementsBegin; j != n.elementsBegin + n.elementsCount; j++)
+        {
+            Position d = position(j) - pos;
+            if (d * d <= squaredDist)
+                target.push_back(j);
+        }
+    };
+    auto pushAll = [&target](const LinearNode& n)
+    {
+        for (uint32_t j = n.elementsBegin; j != n.elementsBegin + n.elementsCount; j++)
+            target.push_back(j);
+    };
+
+    // Root is checked alone, other nodes are checked together with their siblings
+    const LinearNode& r = root();
+    DistToNode rootDist = r.getDistsToNode(pos);
+    if (rootDist.nearest > dist)
+        return;
+    if (rootDist.farest <= dist)
+    {
+        pushAll(r);
+        return;
+    }
+    if (r.isLeaf())
+    {
+        checkElements(r);
+        return;
+    }
+
+    nodesVector.push_back(&r);
+    for (size_t i=0; i != nodesVector.size(); i++)
+    {
+        const LinearNode *n = nodesVector[i];
+        double nearest[8], farest[8];
+        childrenSquaredDists(pos, n->center, n->size, nearest, farest);
+        const LinearNode* subnode = n->firstChild();
+        for (int j=0; j<8; j++)
+        {
+            if ((n->childrenMask & (1 << j)) == 0)
+                continue;
+            const LinearNode& child = *subnode++;
+            // All node is too far
+            if (nearest[j] > squaredDist)
+                continue;
+            // All node is enough close, its elements are continuous range
+            if (farest[j] <= squaredDist)
+                pushAll(child);
+            else if (child.isLeaf())
+                checkElements(child);
+            else
+                nodesVector.push_back(&child);
+        }
+    }
+}
+
+void LinearOctree::flatten(const Node& node, uint32_t index)
+{
+    {
+        LinearNode& ln = m_nodes[index];
+        ln.center = node.center;
+        ln.size = node.size;
+        ln.childrenOffset = 0;
+        ln.childrenMask = 0;
+        ln.elementsBegin = m_values.size();
+        ln.elementsCount = 0;
+    }
+
+    if (node.element != nullptr)
+    {
+        pushBackElement(node.element->pos, node.element->value);
+        m_sourceIndexes.push_back(m_elements.size());
+        m_elements.push_back(node.element.get());
+        m_nodes[index].elementsCount = 1;
+        updateAggregates(m_nodes[index]);
+        return;
+    }
+
+    // Placing all children in one block
+    uint32_t first = m_nodes.size();
+    uint8_t mask = 0;
+    for (int i=0; i<8; i++)
+    {
+        if (node.subnodes[i] == nullptr)
+            continue;
+        mask |= 1 << i;
+        m_nodes.push_back(LinearNode());
+    }
+    m_nodes[index].childrenMask = mask;
+    if (mask != 0)
+        m_nodes[index].childrenOffset = first - index;
+
+    uint32_t child = first;
+    for (int i=0; i<8; i++)
+    {
+        if (node.subnodes[i] != nullptr)
+            flatten(*node.subnodes[i], child++);
+    }
+    LinearNode& ln = m_nodes[index];
+    ln.elementsCount = m_values.size() - ln.elementsBegin;
+    updateAggregates(ln);
+}
+
+void LinearOctree::flattenSorted(const std::vector<MortonKey>& keys, uint32_t begin, uint32_t end, int level,
+                                 uint32_t bucketSize, uint32_t index)
+{
+    {
+        LinearNode& ln = m_nodes[index];
+        ln.childrenOffset = 0;
+        ln.childrenMask = 0;
+        ln.elementsBegin = begin;
+        ln.elementsCount = end - begin;
+    }
+
+    if (end - begin <= bucketSize || level == MortonGrid::bitsPerAxis)
+    {
+        updateAggregates(m_nodes[index]);
+        return;
+    }
+
+    // Keys are sorted, so elements of every child are continuous range
+    // and 3 bits of key for this level is subdivision index
+    int shift = 3 * (MortonGrid::bitsPerAxis - 1 - level);
+    uint32_t bounds[9];
+    bounds[0] = begin;
+    uint32_t j = begin;
+    for (int i=0; i<8; i++)
+    {
+        while (j != end && static_cast<int>((keys[j].first >> shift) & 7) == i)
+            j++;
+        bounds[i+1] = j;
+    }
+
+    uint32_t first = m_nodes.size();
+    uint8_t mask = 0;
+    const Position center = m_nodes[index].center;
+    const double childSize = m_nodes[index].size * 0.5;
+    for (int i=0; i<8; i++)
+    {
+        if (bounds[i] == bounds[i+1])
+            continue;
+        mask |= 1 << i;
+        LinearNode child{};
+        for (int k=0; k<3; k++)
+            child.center.x[k] = center.x[k] + ((i >> k) & 1 ? childSize : -childSize) * 0.5;
+        child.size = childSize;
+        m_nodes.push_back(child);
+    }
+    m_nodes[index].childrenMask = mask;
+    m_nodes[index].childrenOffset = first - index;
+
+    uint32_t child = first;
+    for (int i=0; i<8; i++)
+    {
+        if (bounds[i] != bounds[i+1])
+            flattenSorted(keys, bounds[i], bounds[i+1], level + 1, bucketSize, child++);
+    }
+    updateAggregates(m_nodes[index]);
+}
+
+void LinearOctree::pushBackElement(const Position& pos, double value)
+{
+    for (int j=0; j<3; j++)
+        m_coordinates[j].push_back(pos.x[j]);
+    m_values.push_back(value);
+}
+
+void LinearOctree::updateAggregates(LinearNode& ln)
+{
+    // Aggregates are calculated the same way as Node::updateMassCenter() do
+    ln.massCenter = {0.0, 0.0, 0.0};
+    ln.mass = 0.0;
+    ln.absMass = 0.0;
+    if (ln.isLeaf())
+    {
+        if (ln.elementsCount == 1)
+        {
+            // Mass center of single element is its position even if value is zero
+            ln.dia = 0.0;
+            ln.mass = m_valuesTable[ln.elementsBegin];
+            ln.absMass = std::fabs(ln.mass);
+            ln.massCenter = position(ln.elementsBegin);
+            return;
+        }
+        for (uint32_t j = ln.elementsBegin; j != ln.elementsBegin + ln.elementsCount; j++)
+        {
+            ln.massCenter += position(j) * m_valuesTable[j];
+            ln.mass += m_valuesTable[j];
+            ln.absMass += std::fabs(m_valuesTable[j]);
+        }
+    } else {
+        const LinearNode* subnode = ln.firstChild();
+        for (int i = 0, cnt = ln.childrenCount(); i < cnt; i++, subnode++)
+        {
+            ln.massCenter += subnode->massCenter * subnode->mass;
+            ln.mass += subnode->mass;
+            ln.absMass += subnode->absMass;
+        }
+    }
+    ln.dia = ln.size * sqrt(3.0);
+    if (ln.mass != 0.0)
+        ln.massCenter /= ln.mass;
+    else
+        ln.massCenter = ln.center;
+}
+
+void LinearOctree::attachOwnedTables()
+{
+    m_nodesTable = m_nodes.data();
+    m_nodesCount = m_nodes.size();
+    for (int j=0; j<3; j++)
+        m_coordinatesTable[j] = m_coordinates[j].data();
+    m_valuesTable = m_values.data();
+    m_sourceIndexesTable = m_sourceIndexes.data();
+    m_count = m_values.size();
+}
+
+void LinearOctree::copyTables(const LinearOctree& other)
+{
+    if (m_snapshot == nullptr)
+    {
+        attachOwnedTables();
+        return;
+    }
+    // Mapped tables are shared
+    m_nodesTable = other.m_nodesTable;
+    m_nodesCount = other.m_nodesCount;
+    for (int j=0; j<3; j++)
+        m_coordinatesTable[j] = other.m_coordinatesTable[j];
+    m_valuesTable = other.m_valuesTable;
+    m_sourceIndexesTable = other.m_sourceIndexesTable;
+    m_count = other.m_count;
+}
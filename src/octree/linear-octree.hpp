@@ -0,0 +1,309 @@
+#ifndef LINEAR_OCTREE_HPP_INCLUDED
+#define LINEAR_OCTREE_HPP_INCLUDED
+
+#include "octree.hpp"
+#include "memory.hpp"
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <memory>
+
+namespace octree {
+
+/**
+ * @brief Node of LinearOctree.
+ * All nodes live in one array. Children of a node are stored one after another
+ * in subdivision index order, so node keeps only offset to its first child and
+ * the mask of existing children. Elements of any subtree occupy a continuous
+ * range of LinearOctree elements table. Leaf may hold several elements (bucket),
+ * then its diameter is the diameter of its box.
+ */
+struct LinearNode
+{
+    Position center;
+    double size;
+
+    double dia;
+
+    Position massCenter;
+    double mass;
+    /// Sum of absolute values of elements
+    double absMass;
+
+    /// Offset (in nodes) from this node to its first child, 0 for leafs
+    uint32_t childrenOffset;
+    /// Index of first element of this subtree in LinearOctree elements table
+    uint32_t elementsBegin;
+    /// Count of elements in this subtree
+    uint32_t elementsCount;
+    /// Bit i is set when child with subdivision index i exists
+    uint8_t childrenMask;
+
+    bool isLeaf() const { return childrenMask == 0; }
+
+    int childrenCount() const;
+
+    /**
+     * @brief Get child node by subdivision index
+     * @return Pointer to child or nullptr if there is no such child
+     */
+    const LinearNode* child(int index) const;
+
+    const LinearNode* firstChild() const { return this + childrenOffset; }
+
+    /**
+     * @brief Returns minimal and maximal distance to node (to its box)
+     * @param pos Point that distance should be calculated from
+     */
+    DistToNode getDistsToNode(const Position& pos) const;
+
+    double getDistToCenter(const Position& pos) const
+    {
+        return pos.distTo(center);
+    }
+
+    /**
+     * @brief Squared distance from point to node box, or to element for single element leaf
+     */
+    double getSquaredDistToBox(const Position& pos) const
+    {
+        if (isLeaf() && elementsCount == 1)
+        {
+            Position d = massCenter - pos;
+            return d * d;
+        }
+        double hs = size * 0.5;
+        double result = 0.0;
+        for (int i=0; i<3; i++)
+        {
+            double outside = std::fabs(pos.x[i] - center.x[i]) - hs;
+            if (outside > 0.0)
+                result += outside * outside;
+        }
+        return result;
+    }
+
+    bool isInside(const Position& pos) const;
+
+    /**
+     * @brief Put all const pointers to subnodes into container
+     * @param container Any container supporting push_back method
+     */
+    template<class T>
+    void pushBackSubnodes(T& container) const
+    {
+        const LinearNode* subnode = firstChild();
+        for (int i = 0, n = childrenCount(); i < n; i++)
+            container.push_back(subnode + i);
+    }
+};
+
+/**
+ * @brief Read-only octree with all nodes stored in one contiguous array in
+ * depth-first (Morton) order. Elements coordinates and values are stored as
+ * structure of arrays in the same order and nodes refer them by 32-bit indexes.
+ *
+ * Elements are referred by 32-bit indexes of tree tables. sourceIndex() maps them
+ * to indexes of user-owned arrays the tree was built from, so no per-element objects
+ * are needed. Custom Element objects are supported by building from Octree.
+ *
+ * LinearOctree is built from Octree or directly from points and may be used
+ * with Convolution the same way. When built from points, leafs hold up to
+ * bucketSize elements and leafs that are too close to target are summed directly
+ * by kernel, that may be vectorized.
+ *
+ * Tree may be saved to binary snapshot and mapped back from it, queries read mapped
+ * file directly.
+ */
+class LinearOctree
+{
+public:
+    LinearOctree();
+    LinearOctree(const Octree& octree);
+    LinearOctree(const Position* positions, const double* values, size_t count,
+                 uint32_t bucketSize = 1, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Copy has its own tables, copy of mapped tree is not mapped
+     */
+    LinearOctree(const LinearOctree& other);
+    LinearOctree(LinearOctree&& other);
+    LinearOctree& operator=(const LinearOctree& other);
+    LinearOctree& operator=(LinearOctree&& other);
+
+    /**
+     * @brief Rebuild linear representation from octree
+     */
+    void build(const Octree& octree);
+
+    /**
+     * @brief Build tree from points. Points are sorted by Morton key, then nodes
+     * are subdivided until they have not more than bucketSize points. Coincident
+     * points are allowed, they are kept in one leaf at the deepest Morton level
+     * @param positions  Points positions
+     * @param values     Points values or nullptr to use zeros
+     * @param count      Points count
+     * @param bucketSize Maximal count of points in leaf
+     * @param pool       Threads used for sorting, ThreadPool::defaultPool() if nullptr
+     */
+    void build(const Position* positions, const double* values, size_t count,
+               uint32_t bucketSize = 1, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Build tree of one cell of larger tree. Points keys are calculated by grid of
+     * larger tree, so nodes are the same as nodes of this cell in larger tree built by build()
+     * @param grid   Grid of larger tree root
+     * @param center Cell center
+     * @param size   Cell size
+     * @param level  Subdivision level of cell in larger tree
+     */
+    void buildCell(const MortonGrid& grid, const Position& center, double size, int level,
+                   const Position* positions, const double* values, size_t count,
+                   uint32_t bucketSize = 1, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Size of root box that build() uses for points bounding box
+     */
+    static double rootSize(const Position& boxMin, const Position& boxMax);
+
+    void clear();
+
+    /**
+     * @brief Write snapshot of tree: header with format version, then nodes, coordinates,
+     * values and source indexes tables, every table is aligned to 64 bytes. Nodes refer
+     * children by relative offsets and elements by indexes, so snapshot does not depend
+     * on addresses. Element objects of source Octree are not saved.
+     * Snapshot is read on platform with the same byte order and LinearNode layout
+     * @throws std::runtime_error if file cannot be written
+     */
+    void save(const std::string& path) const;
+
+    /**
+     * @brief Replace tree by snapshot written by save(). File is mapped to memory and
+     * queries use it directly without deserialization. Nodes links and source indexes
+     * are validated by one pass, coordinates and values pages are read on demand.
+     * updateValues() changes only private copy of mapped pages. File should not be
+     * changed or truncated while it is mapped
+     * @throws std::runtime_error if file cannot be mapped or it is not compatible snapshot
+     */
+    void load(const std::string& path);
+
+    /**
+     * @brief Tree tables are in mapped snapshot file
+     */
+    bool isMapped() const;
+
+    bool empty() const;
+    size_t count() const;
+    size_t nodesCount() const;
+
+    const LinearNode& root() const;
+    double mass() const;
+    const Position& massCenter() const;
+
+    Position position(uint32_t index) const;
+    double value(uint32_t index) const;
+
+    /**
+     * @brief Table of elements coordinates along axis
+     * @param axis 0, 1 or 2 for x, y or z
+     */
+    const double* coordinates(int axis) const;
+    const double* values() const;
+
+    /**
+     * @brief Element of source octree
+     * @return pointer to element or nullptr if tree was not built from Octree
+     */
+    const Element* element(uint32_t index) const;
+
+    /**
+     * @brief Index of element in arrays given to build(), or index in depth-first
+     * order of elements of source Octree (the order Node::pushBackAllElements() gives)
+     */
+    uint32_t sourceIndex(uint32_t index) const;
+
+    /**
+     * @brief Reload values from user table and recalculate masses and mass centers
+     * of all nodes. Positions should not be changed
+     * @param values Values indexed the same way as sourceIndex() gives
+     */
+    void updateValues(const double* values);
+
+    /**
+     * @brief Find element that is nearest to point
+     * @return Index of element in elements table
+     */
+    uint32_t getNearest(const Position& pos) const;
+
+    /**
+     * @brief Find k elements that are nearest to point, the same as Octree::getKNearest()
+     * @param result Indexes of elements sorted by distance
+     */
+    void getKNearest(std::vector<uint32_t>& result, const Position& pos, size_t k, double epsilon = 0.0) const;
+
+    /**
+     * @brief Put indexes of all elements that are not farer than dist from pos into target
+     */
+    void getClose(std::vector<uint32_t>& target, const Position& pos, double dist) const;
+
+    /**
+     * @brief Find nearest elements for many points in parallel, see Octree::getNearestMany()
+     * @param result Array of count indexes of nearest elements
+     */
+    void getNearestMany(const Position* points, size_t count, uint32_t* result, ThreadPool* pool = nullptr) const;
+
+    /**
+     * @brief Find close elements for many points in parallel, see Octree::getCloseMany()
+     * @param indexes Filled by indexes of close elements of all points
+     */
+    void getCloseMany(const Position* points, const double* radii, size_t count,
+                      std::vector<size_t>& offsets, std::vector<uint32_t>& indexes, ThreadPool* pool = nullptr) const;
+
+    /**
+     * @brief Sum of kernel over elements of leaf, used by convolution for leafs
+     * that are too close to target to be averaged
+     */
+    template<typename ResultType, typename Kernel>
+    ResultType directSum(const LinearNode& leaf, const Position& target, const Kernel& kernel) const
+    {
+        uint32_t b = leaf.elementsBegin;
+        return details::directSum<ResultType>(kernel, target, m_coordinatesTable[0] + b, m_coordinatesTable[1] + b,
+                                              m_coordinatesTable[2] + b, m_valuesTable + b, leaf.elementsCount);
+    }
+
+private:
+    void getClose(std::vector<uint32_t>& target, const Position& pos, double dist,
+                  std::vector<const LinearNode*>& nodesVector) const;
+    void flatten(const Node& node, uint32_t index);
+    void flattenSorted(const std::vector<MortonKey>& keys, uint32_t begin, uint32_t end, int level,
+                       uint32_t bucketSize, uint32_t index);
+    void pushBackElement(const Position& pos, double value);
+    void updateAggregates(LinearNode& node);
+
+    /**
+     * @brief Point tables to data of own vectors
+     */
+    void attachOwnedTables();
+    void copyTables(const LinearOctree& other);
+
+    std::vector<LinearNode> m_nodes;
+    std::vector<double> m_coordinates[3];
+    std::vector<double> m_values;
+    std::vector<uint32_t> m_sourceIndexes;
+    std::vector<const Element*> m_elements;
+
+    // Tables used by queries. They point to data of vectors above or into mapped snapshot
+    LinearNode* m_nodesTable = nullptr;
+    size_t m_nodesCount = 0;
+    double* m_coordinatesTable[3] = {nullptr, nullptr, nullptr};
+    double* m_valuesTable = nullptr;
+    const uint32_t* m_sourceIndexesTable = nullptr;
+    size_t m_count = 0;
+    std::shared_ptr<MappedFile> m_snapshot;
+};
+
+}
+
+#endif // LINEAR_OCTREE_HPP_INCLUDED
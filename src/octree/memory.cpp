@@ -0,0 +1,226 @@
+#include "memory.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace octree;
+
+namespace {
+
+const size_t maxAlignment = alignof(std::max_align_t);
+
+size_t alignUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+}
+
+/////////////////////////////////
+// FixedSizePool
+FixedSizePool::FixedSizePool(size_t blockSize, size_t blocksPerSlab) :
+    m_blockSize(alignUp(std::max(blockSize, sizeof(FreeBlock)), maxAlignment)),
+    m_blocksPerSlab(std::max<size_t>(blocksPerSlab, 1))
+{
+}
+
+void* FixedSizePool::allocate()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return allocateLocked();
+}
+
+void* FixedSizePool::allocateLocked()
+{
+    m_usedCount++;
+    if (m_freeList != nullptr)
+    {
+        FreeBlock* block = m_freeList;
+        m_freeList = block->next;
+        return block;
+    }
+    if (m_slabCursor == m_slabEnd)
+    {
+        // new[] of char gives memory aligned for any fundamental type
+        size_t slabSize = m_blockSize * m_blocksPerSlab;
+        m_slabs.emplace_back(new char[slabSize]);
+        m_slabCursor = m_slabs.back().get();
+        m_slabEnd = m_slabCursor + slabSize;
+    }
+    void* block = m_slabCursor;
+    m_slabCursor += m_blockSize;
+    return block;
+}
+
+void FixedSizePool::release(void* block)
+{
+    if (block == nullptr)
+        return;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+    freeBlock->next = m_freeList;
+    m_freeList = freeBlock;
+    m_usedCount--;
+}
+
+void FixedSizePool::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_slabs.clear();
+    m_freeList = nullptr;
+    m_slabCursor = m_slabEnd = nullptr;
+    m_usedCount = 0;
+}
+
+void FixedSizePool::swap(FixedSizePool& other)
+{
+    if (&other == this)
+        return;
+    std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+    std::unique_lock<std::mutex> otherLock(other.m_mutex, std::defer_lock);
+    std::lock(lock, otherLock);
+    std::swap(m_blockSize, other.m_blockSize);
+    std::swap(m_blocksPerSlab, other.m_blocksPerSlab);
+    m_slabs.swap(other.m_slabs);
+    std::swap(m_freeList, other.m_freeList);
+    std::swap(m_slabCursor, other.m_slabCursor);
+    std::swap(m_slabEnd, other.m_slabEnd);
+    std::swap(m_usedCount, other.m_usedCount);
+}
+
+size_t FixedSizePool::blockSize() const
+{
+    return m_blockSize;
+}
+
+size_t FixedSizePool::slabsCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_slabs.size();
+}
+
+size_t FixedSizePool::usedCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_usedCount;
+}
+
+/////////////////////////////////
+// FixedSizePool::LocalCache
+FixedSizePool::LocalCache::LocalCache(FixedSizePool& pool, size_t batchSize) :
+    m_pool(pool),
+    m_batchSize(std::max<size_t>(batchSize, 1))
+{
+}
+
+FixedSizePool::LocalCache::~LocalCache()
+{
+    if (m_blocks.empty())
+        return;
+    std::lock_guard<std::mutex> lock(m_pool.m_mutex);
+    for (void* block : m_blocks)
+    {
+        FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+        freeBlock->next = m_pool.m_freeList;
+        m_pool.m_freeList = freeBlock;
+    }
+    m_pool.m_usedCount -= m_blocks.size();
+}
+
+void* FixedSizePool::LocalCache::allocate()
+{
+    if (m_blocks.empty())
+    {
+        m_blocks.reserve(m_batchSize);
+        std::lock_guard<std::mutex> lock(m_pool.m_mutex);
+        for (size_t i=0; i<m_batchSize; i++)
+            m_blocks.push_back(m_pool.allocateLocked());
+    }
+    void* block = m_blocks.back();
+    m_blocks.pop_back();
+    return block;
+}
+
+/////////////////////////////////
+// Arena
+Arena::Arena(size_t slabSize) :
+    m_slabSize(slabSize)
+{
+}
+
+void* Arena::allocate(size_t size, size_t alignment)
+{
+    if (alignment > maxAlignment)
+        throw std::invalid_argument("Arena cannot align memory stronger than max_align_t");
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uintptr_t cursor = reinterpret_cast<uintptr_t>(m_cursor);
+    uintptr_t aligned = alignUp(cursor, alignment);
+    if (m_cursor == nullptr || aligned + size > reinterpret_cast<uintptr_t>(m_end))
+    {
+        // Large objects get their own slab
+        size_t slabSize = std::max(m_slabSize, size);
+        m_slabs.emplace_back(new char[slabSize]);
+        m_reservedBytes += slabSize;
+        m_cursor = m_slabs.back().get();
+        m_end = m_cursor + slabSize;
+        aligned = reinterpret_cast<uintptr_t>(m_cursor);
+    }
+    m_cursor = reinterpret_cast<char*>(aligned + size);
+    return reinterpret_cast<void*>(aligned);
+}
+
+size_t Arena::reservedBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_reservedBytes;
+}
+
+/////////////////////////////////
+// MappedFile
+MappedFile::MappedFile(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Cannot open file " + path);
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("Cannot get size of file " + path);
+    }
+    m_size = info.st_size;
+    if (m_size != 0)
+    {
+        void* data = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            ::close(fd);
+            throw std::runtime_error("Cannot map file " + path);
+        }
+        m_data = static_cast<char*>(data);
+    }
+    // Mapping stays valid after descriptor is closed
+    ::close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_data != nullptr)
+        munmap(m_data, m_size);
+}
+
+char* MappedFile::data() const
+{
+    return m_data;
+}
+
+size_t MappedFile::size() const
+{
+    return m_size;
+}
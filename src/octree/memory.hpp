@@ -0,0 +1,197 @@
+#ifndef OCTREE_MEMORY_HPP_INCLUDED
+#define OCTREE_MEMORY_HPP_INCLUDED
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <string>
+
+namespace octree {
+
+/**
+ * @brief Pool of fixed size blocks cut from large slabs. Released blocks are kept
+ * in free list and reused, all slabs are freed at once by clear() or destructor.
+ * Methods are thread safe.
+ */
+class FixedSizePool
+{
+public:
+    /**
+     * @param blockSize     Size of every block in bytes
+     * @param blocksPerSlab Count of blocks allocated from system at once
+     */
+    FixedSizePool(size_t blockSize, size_t blocksPerSlab = 4096);
+
+    FixedSizePool(const FixedSizePool&) = delete;
+    FixedSizePool& operator=(const FixedSizePool&) = delete;
+
+    void* allocate();
+    void release(void* block);
+
+    /**
+     * @brief Free all slabs. Blocks that were not released should not be used anymore
+     */
+    void clear();
+
+    /**
+     * @brief Exchange slabs and blocks with other pool, so allocated blocks change their owner
+     */
+    void swap(FixedSizePool& other);
+
+    size_t blockSize() const;
+    size_t slabsCount() const;
+
+    /// Count of allocated and not released blocks
+    size_t usedCount() const;
+
+    /**
+     * @brief Front of pool for one thread. Blocks are taken from pool by batches
+     * under one lock, so threads that allocate through their own caches rarely wait
+     * for each other. Unused blocks are returned to pool by destructor.
+     * Cache is not thread safe, every thread should have its own one.
+     */
+    class LocalCache
+    {
+    public:
+        LocalCache(FixedSizePool& pool, size_t batchSize = 64);
+        ~LocalCache();
+
+        LocalCache(const LocalCache&) = delete;
+        LocalCache& operator=(const LocalCache&) = delete;
+
+        void* allocate();
+        FixedSizePool& pool() const { return m_pool; }
+
+    private:
+        FixedSizePool& m_pool;
+        size_t m_batchSize;
+        std::vector<void*> m_blocks;
+    };
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    void* allocateLocked();
+
+    size_t m_blockSize;
+    size_t m_blocksPerSlab;
+
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<char[]>> m_slabs;
+    FreeBlock* m_freeList = nullptr;
+    char* m_slabCursor = nullptr;
+    char* m_slabEnd = nullptr;
+    size_t m_usedCount = 0;
+};
+
+/**
+ * @brief Monotonic memory arena. Memory is taken from large slabs and is never
+ * returned back until arena is destroyed. Methods are thread safe.
+ */
+class Arena
+{
+public:
+    Arena(size_t slabSize = 1 << 20);
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t alignment);
+
+    /// Total size of allocated slabs
+    size_t reservedBytes() const;
+
+private:
+    size_t m_slabSize;
+
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<char[]>> m_slabs;
+    size_t m_reservedBytes = 0;
+    char* m_cursor = nullptr;
+    char* m_end = nullptr;
+};
+
+/**
+ * @brief Standard allocator taking memory from Arena. Allocator shares ownership
+ * of arena, so objects created by std::allocate_shared keep arena alive:
+ *
+ *     auto arena = std::make_shared<Arena>();
+ *     auto e = std::allocate_shared<ElementValue>(ArenaAllocator<ElementValue>(arena), pos, value);
+ */
+template<typename T>
+class ArenaAllocator
+{
+public:
+    using value_type = T;
+
+    ArenaAllocator(std::shared_ptr<Arena> arena) :
+        m_arena(std::move(arena))
+    { }
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) :
+        m_arena(other.arena())
+    { }
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, size_t)
+    {
+        // Memory is freed with the whole arena
+    }
+
+    const std::shared_ptr<Arena>& arena() const
+    {
+        return m_arena;
+    }
+
+private:
+    std::shared_ptr<Arena> m_arena;
+};
+
+/**
+ * @brief File mapped to memory. Pages are mapped privately, so mapped data may be
+ * changed, but changes are not written to the file and are not seen by other processes
+ */
+class MappedFile
+{
+public:
+    /**
+     * @throws std::runtime_error if file cannot be opened or mapped
+     */
+    MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    char* data() const;
+    size_t size() const;
+
+private:
+    char* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>& left, const ArenaAllocator<U>& right)
+{
+    return left.arena() == right.arena();
+}
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& left, const ArenaAllocator<U>& right)
+{
+    return !(left == right);
+}
+
+}
+
+#endif // OCTREE_MEMORY_HPP_INCLUDED
@@ -0,0 +1,63 @@
+#include "morton.hpp"
+
+#include <algorithm>
+
+using namespace octree;
+
+namespace {
+
+bool keyLess(const MortonKey& left, const MortonKey& right)
+{
+    return left.first < right.first;
+}
+
+}
+
+void octree::sortMortonKeys(std::vector<MortonKey>& keys, ThreadPool& pool)
+{
+    // Too small arrays are not worth threads synchronization
+    const size_t minPiece = 16384;
+    size_t pieces = std::min<size_t>(pool.threadsCount(), keys.size() / minPiece);
+    if (pieces <= 1)
+    {
+        std::sort(keys.begin(), keys.end(), keyLess);
+        return;
+    }
+
+    std::vector<size_t> bounds(pieces + 1);
+    for (size_t i=0; i<=pieces; i++)
+        bounds[i] = keys.size() * i / pieces;
+
+    pool.parallelFor(pieces, 1,
+        [&keys, &bounds](unsigned, size_t begin, size_t end)
+        {
+            for (size_t i=begin; i<end; i++)
+                std::sort(keys.begin() + bounds[i], keys.begin() + bounds[i+1], keyLess);
+        }
+    );
+
+    std::vector<MortonKey> buffer(keys.size());
+    std::vector<MortonKey>* from = &keys;
+    std::vector<MortonKey>* to = &buffer;
+    for (size_t width = 1; width < pieces; width *= 2)
+    {
+        size_t pairs = (pieces + 2*width - 1) / (2*width);
+        pool.parallelFor(pairs, 1,
+            [from, to, &bounds, width, pieces](unsigned, size_t begin, size_t end)
+            {
+                for (size_t i=begin; i<end; i++)
+                {
+                    size_t left = i * 2 * width;
+                    size_t middle = std::min(left + width, pieces);
+                    size_t right = std::min(left + 2 * width, pieces);
+                    std::merge(from->begin() + bounds[left], from->begin() + bounds[middle],
+                               from->begin() + bounds[middle], from->begin() + bounds[right],
+                               to->begin() + bounds[left], keyLess);
+                }
+            }
+        );
+        std::swap(from, to);
+    }
+    if (from != &keys)
+        keys.swap(buffer);
+}
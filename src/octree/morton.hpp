@@ -0,0 +1,133 @@
+#ifndef OCTREE_MORTON_HPP_INCLUDED
+#define OCTREE_MORTON_HPP_INCLUDED
+
+#include "geom-vector.hpp"
+#include "thread-pool.hpp"
+
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+namespace octree {
+
+/**
+ * @brief Morton (Z-order) key and index of the object it was calculated for
+ */
+using MortonKey = std::pair<uint64_t, size_t>;
+
+/**
+ * @brief Cubic grid of 2^21 cells per axis used to calculate Morton keys.
+ * Key bits are interleaved so that 3 bits of every level of key is
+ * subdivision index of the cell in its parent, the same as SubdivisionPos::index() gives.
+ */
+class MortonGrid
+{
+public:
+    constexpr static int bitsPerAxis = 21;
+    constexpr static uint32_t cellsPerAxis = 1u << bitsPerAxis;
+
+    MortonGrid(const Position& center, double size) :
+        m_corner(center - Position(size, size, size) * 0.5),
+        m_scale(cellsPerAxis / size)
+    { }
+
+    uint64_t key(const Position& pos) const
+    {
+        uint64_t result = 0;
+        for (int i=0; i<3; i++)
+        {
+            double cell = (pos.x[i] - m_corner.x[i]) * m_scale;
+            uint32_t c = 0;
+            if (cell >= cellsPerAxis)
+                c = cellsPerAxis - 1;
+            else if (cell > 0.0)
+                c = static_cast<uint32_t>(cell);
+            result |= spread(c) << i;
+        }
+        return result;
+    }
+
+    /**
+     * @brief Spread lower 21 bits of value so there are 2 zero bits between them
+     */
+    static uint64_t spread(uint32_t value)
+    {
+        uint64_t x = value & (cellsPerAxis - 1);
+        x = (x | x << 32) & 0x1f00000000ffffULL;
+        x = (x | x << 16) & 0x1f0000ff0000ffULL;
+        x = (x | x << 8)  & 0x100f00f00f00f00fULL;
+        x = (x | x << 4)  & 0x10c30c30c30c30c3ULL;
+        x = (x | x << 2)  & 0x1249249249249249ULL;
+        return x;
+    }
+
+private:
+    Position m_corner;
+    double m_scale;
+};
+
+/**
+ * @brief Sort keys by Morton key value. Pieces of array are sorted in parallel
+ * and then merged pairwise in parallel too
+ */
+void sortMortonKeys(std::vector<MortonKey>& keys, ThreadPool& pool);
+
+/**
+ * @brief Run queries for many points in parallel. Points are processed in Morton order,
+ * so consecutive queries of one thread touch the same tree nodes. Results are collected
+ * in flat layout: results of query i are items[offsets[i]] .. items[offsets[i+1] - 1]
+ * @param grid    Grid of tree root
+ * @param offsets Filled by count + 1 offsets
+ * @param items   Filled by results of all queries
+ * @param query   Callable (unsigned worker, size_t index, std::vector<Item>& out)
+ *                appending results for points[index] to out
+ */
+template<typename Item, typename Query>
+void runMortonOrderedQueries(ThreadPool& pool, const MortonGrid& grid, const Position* points, size_t count,
+                             std::vector<size_t>& offsets, std::vector<Item>& items, const Query& query)
+{
+    std::vector<MortonKey> order(count);
+    for (size_t i=0; i<count; i++)
+        order[i] = MortonKey(grid.key(points[i]), i);
+    sortMortonKeys(order, pool);
+
+    // Every worker appends results to its own buffer, they are copied to items in queries order later
+    std::vector<std::vector<Item>> buffers(pool.threadsCount());
+    std::vector<unsigned> workers(count);
+    std::vector<size_t> begins(count);
+    offsets.assign(count + 1, 0);
+    pool.parallelFor(count, 64,
+        [&order, &buffers, &workers, &begins, &offsets, &query](unsigned worker, size_t begin, size_t end)
+        {
+            std::vector<Item>& buffer = buffers[worker];
+            for (size_t i=begin; i<end; i++)
+            {
+                size_t index = order[i].second;
+                size_t before = buffer.size();
+                query(worker, index, buffer);
+                workers[index] = worker;
+                begins[index] = before;
+                offsets[index + 1] = buffer.size() - before;
+            }
+        }
+    );
+
+    for (size_t i=0; i<count; i++)
+        offsets[i + 1] += offsets[i];
+    items.resize(offsets[count]);
+    pool.parallelFor(count, 1024,
+        [&buffers, &workers, &begins, &offsets, &items](unsigned, size_t begin, size_t end)
+        {
+            for (size_t i=begin; i<end; i++)
+            {
+                auto from = buffers[workers[i]].begin() + begins[i];
+                std::copy(from, from + (offsets[i + 1] - offsets[i]), items.begin() + offsets[i]);
+            }
+        }
+    );
+}
+
+}
+
+#endif // OCTREE_MORTON_HPP_INCLUDED
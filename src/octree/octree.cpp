@@ -1,12 +1,147 @@
 #include "octree.hpp"
+#include "thread-pool.hpp"
+#include "morton.hpp"
+#include "linear-octree.hpp"
+#include "kernels.hpp"
 #include <iostream>
 #include <cstring>
 #include <stdexcept>
-#include <list>
 #include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <exception>
 
 using namespace octree;
 
+namespace {
+
+/// Chunk size for parallel loops over elements of bulk build
+const size_t buildGrain = 4096;
+
+/// Minimal count of elements in subtree whose aggregates are updated by one task
+const size_t aggregatesGrain = 4096;
+
+template<typename PositionGetter>
+void findBoundingBox(size_t count, PositionGetter pos, ThreadPool& pool, Position& boxMin, Position& boxMax)
+{
+    std::vector<Position> mins(pool.threadsCount(), pos(0));
+    std::vector<Position> maxs(pool.threadsCount(), pos(0));
+    pool.parallelFor(count, buildGrain,
+        [&mins, &maxs, &pos](unsigned worker, size_t begin, size_t end)
+        {
+            Position& mn = mins[worker];
+            Position& mx = maxs[worker];
+            for (size_t i=begin; i<end; i++)
+            {
+                const Position& p = pos(i);
+                for (int j=0; j<3; j++)
+                {
+                    mn.x[j] = std::min(mn.x[j], p.x[j]);
+                    mx.x[j] = std::max(mx.x[j], p.x[j]);
+                }
+            }
+        }
+    );
+    boxMin = mins[0];
+    boxMax = maxs[0];
+    for (size_t i=1; i<mins.size(); i++)
+    {
+        for (int j=0; j<3; j++)
+        {
+            boxMin.x[j] = std::min(boxMin.x[j], mins[i].x[j]);
+            boxMax.x[j] = std::max(boxMax.x[j], maxs[i].x[j]);
+        }
+    }
+}
+
+template<typename PositionGetter>
+std::vector<MortonKey> sortedMortonKeys(size_t count, PositionGetter pos, const Node& root, ThreadPool& pool)
+{
+    MortonGrid grid(root.center, root.size);
+    std::vector<MortonKey> keys(count);
+    pool.parallelFor(count, buildGrain,
+        [&keys, &pos, &grid](unsigned, size_t begin, size_t end)
+        {
+            for (size_t i=begin; i<end; i++)
+                keys[i] = MortonKey(grid.key(pos(i)), i);
+        }
+    );
+    sortMortonKeys(keys, pool);
+    return keys;
+}
+
+/// Maximal depth of cells that addMany() gives to threads
+const int maxAddSplitDepth = 4;
+
+/// Node cache of current worker of addMany()
+thread_local FixedSizePool::LocalCache* nodeCache = nullptr;
+
+/**
+ * @brief Set node cache of calling thread while object exists
+ */
+class NodeCacheScope
+{
+public:
+    explicit NodeCacheScope(FixedSizePool::LocalCache* cache) :
+        m_previous(nodeCache)
+    {
+        nodeCache = cache;
+    }
+
+    ~NodeCacheScope()
+    {
+        nodeCache = m_previous;
+    }
+
+private:
+    FixedSizePool::LocalCache* m_previous;
+};
+
+/**
+ * @brief Index of cell of given depth below node where addElement() puts point.
+ * Existing nodes are descended by their centers, centers of missing nodes are
+ * calculated the same way as Node constructor does
+ */
+size_t cellIndex(const Node* node, const Position& p, int depth)
+{
+    Position center = node->center;
+    double size = node->size;
+    size_t cell = 0;
+    for (int level=0; level<depth; level++)
+    {
+        SubdivisionPos subdivision(center, p);
+        int index = subdivision.index();
+        cell = cell * 8 + index;
+        node = node != nullptr ? node->subnodes[index].get() : nullptr;
+        if (node != nullptr)
+        {
+            center = node->center;
+            size = node->size;
+            continue;
+        }
+        size *= 0.5;
+        double hs = size * 0.5;
+        for (int i=0; i<3; i++)
+        {
+            if (subdivision.s[i] == 0)
+                center.x[i] -= hs;
+            else
+                center.x[i] += hs;
+        }
+    }
+    return cell;
+}
+
+}
+
+void NodeDeleter::operator()(Node* node) const
+{
+    Octree* octree = node->m_octree;
+    node->~Node();
+    octree->m_nodePool.release(node);
+}
+
 SubdivisionPos::SubdivisionPos()
 {
 }
@@ -34,14 +169,12 @@ Node::Node(Octree* octree, SubdivisionPos subdivision, Node* parent) :
         else
             center.x[i] = parent->center.x[i] + hs;
     }
-    calculateCorners();
     updateDiameter();
 }
 
 Node::Node(Octree* octree, Position center, double size) :
         center(center), size(size), subdivisionLevel(0), m_octree(octree)
 {
-    calculateCorners();
     updateDiameter();
 }
 
@@ -52,10 +185,13 @@ void Node::addElement(std::shared_ptr<Element> e)
         // If this node is empty, adding rlement directly here
         if (element == nullptr)
         {
-            element = e;
+            element = std::move(e);
             element->parent = this;
+            m_elementsCount = 1;
             if (m_octree->centerMassUpdatingEnabled())
                 updateMassCenterReqursiveUp();
+            else
+                markDirty();
             updateDiameter();
             return;
         }
@@ -70,28 +206,16 @@ void Node::addElement(std::shared_ptr<Element> e)
             throw std::runtime_error("Cannot work with 2 elements at one place");
         }
         element->parent = nullptr;
-        giveElementToSubnodes(element);
-        element.reset();
+        // Ownership is moved without reference counting
+        giveElementToSubnodes(std::move(element));
     }
-    giveElementToSubnodes(e);
+    giveElementToSubnodes(std::move(e));
+    // Counted only when element is placed, so failed adding does not change counts
+    m_elementsCount++;
     updateDiameter();
 }
 
 
-size_t Node::elementsCount() const
-{
-    if (!hasSubnodes && element != nullptr)
-        return 1;
-
-    size_t count = 0;
-    for (int i=0; i<8; i++)
-    {
-        if (subnodes[i] != nullptr)
-            count += subnodes[i]->elementsCount();
-    }
-    return count;
-}
-
 DistToNode Node::getDistsToNode(Position pos) const
 {
     DistToNode result;
@@ -100,76 +224,30 @@ DistToNode Node::getDistsToNode(Position pos) const
         result.nearest = result.farest = element->pos.distTo(pos);
         return result;
     }
-    if (isInside(pos))
-    {
-        result.nearest = 0.0;
-        result.farest = m_corners[0].distTo(pos);
-        for (int i=1; i<8; i++)
-        {
-            double dist = m_corners[i].distTo(pos);
-            if (result.farest < dist)
-                result.farest = dist;
-        }
-        return result;
-    }
-
-    result.nearest = result.farest = m_corners[0].distTo(pos);
-    for (int i=1; i<8; i++)
+    // Nearest point of box is point clamped to box, farest is the opposite corner
+    double hs = size * 0.5;
+    double nearest = 0.0, farest = 0.0;
+    for (int i=0; i<3; i++)
     {
-        double dist = m_corners[i].distTo(pos);
-        if (result.farest < dist)
-            result.farest = dist;
-        if (result.nearest > dist)
-            result.nearest = dist;
+        double d = std::fabs(pos.x[i] - center.x[i]);
+        double outside = d - hs;
+        if (outside > 0.0)
+            nearest += outside * outside;
+        farest += (d + hs) * (d + hs);
     }
-
-    /*
-    result.nearest = -1;
-    result.farest = -1;
-    Position corner;
-
-    double hs = size*0.5;
-
-    corner.x[0] = center.x[0] + hs;
-    corner.x[1] = center.x[1] + hs;
-    corner.x[2] = center.x[2] + hs;
-    result.nearest = result.farest = (corner - pos).len();
-
-    for (int x = -1; x <=1; x += 2)
-        for (int y = -1; y <=1; y += 2)
-            for (int z = -1; z <=1; z += 2)
-            {
-                corner.x[0] = center.x[0] + x*hs;
-                corner.x[1] = center.x[1] + y*hs;
-                corner.x[2] = center.x[2] + z*hs;
-                double dist = (corner - pos).len();
-                if (result.farest < dist)
-                    result.farest = dist;
-                if (result.nearest > dist)
-                    result.nearest = dist;
-            }*/
+    result.nearest = sqrt(nearest);
+    result.farest = sqrt(farest);
     return result;
 }
 
-double Node::getMinDist(const Position& pos) const
+void Node::getSubnodesSquaredDists(const Position& pos, double* nearest, double* farest) const
 {
-    if (element != nullptr)
-    {
-        return element->pos.distTo(pos);
-    }
-    double minDist = m_corners[0].distTo(pos);
-    for (int i=1; i<8; i++)
-    {
-        double dist = m_corners[i].distTo(pos);
-        if (minDist > dist)
-            minDist = dist;
-    }
-    return minDist;
+    childrenSquaredDists(pos, center, size, nearest, farest);
 }
 
-double Node::getDistToCenter(const Position& pos) const
+double Node::getMinDist(const Position& pos) const
 {
-    return pos.distTo(center);
+    return sqrt(getSquaredDistToBox(pos));
 }
 
 bool Node::isInside(const Position& pos) const
@@ -205,10 +283,14 @@ void Node::updateMassCenter()
     {
         massCenter = element->pos;
         mass = element->value;
+        absMass = std::fabs(mass);
+        // Node may be collapsed from internal one, so its moments are not kept
+        multipoles = Multipoles();
         return;
     }
     massCenter = {0.0, 0.0, 0.0};
     mass = 0.0;
+    absMass = 0.0;
     for (int i=0; i<8; i++)
     {
         if (subnodes[i] != nullptr)
@@ -216,6 +298,7 @@ void Node::updateMassCenter()
             double nodeMass = subnodes[i]->mass;
             massCenter += subnodes[i]->massCenter * nodeMass;
             mass += nodeMass;
+            absMass += subnodes[i]->absMass;
         }
     }
     if (mass != 0.0)
@@ -224,6 +307,39 @@ void Node::updateMassCenter()
     {
         massCenter = center;
     }
+    if (m_octree != nullptr && m_octree->multipolesEnabled())
+        updateMultipoles();
+}
+
+void Node::updateMultipoles()
+{
+    multipoles = Multipoles();
+    if (element != nullptr)
+        return;
+
+    Position& p = multipoles.dipole;
+    double* q = multipoles.quadrupole;
+    for (int i=0; i<8; i++)
+    {
+        if (subnodes[i] == nullptr)
+            continue;
+        // Moments of subnode are shifted from its mass center to mass center of this node
+        const Node& n = *subnodes[i];
+        const Position& np = n.multipoles.dipole;
+        const double* nq = n.multipoles.quadrupole;
+        double m = n.mass;
+        Position d = n.massCenter - massCenter;
+        double d2 = d * d;
+        double pd = np * d;
+
+        p += np + d * m;
+        q[0] += nq[0] + 6 * np[0] * d[0] - 2 * pd + m * (3 * d[0] * d[0] - d2);
+        q[1] += nq[1] + 6 * np[1] * d[1] - 2 * pd + m * (3 * d[1] * d[1] - d2);
+        q[2] += nq[2] + 6 * np[2] * d[2] - 2 * pd + m * (3 * d[2] * d[2] - d2);
+        q[3] += nq[3] + 3 * (np[0] * d[1] + d[0] * np[1]) + 3 * m * d[0] * d[1];
+        q[4] += nq[4] + 3 * (np[0] * d[2] + d[0] * np[2]) + 3 * m * d[0] * d[2];
+        q[5] += nq[5] + 3 * (np[1] * d[2] + d[1] * np[2]) + 3 * m * d[1] * d[2];
+    }
 }
 
 void Node::updateMassCenterReqursiveUp()
@@ -240,6 +356,24 @@ void Node::updateMassCenterReqursiveDown()
         if (subnodes[i] != nullptr)
             subnodes[i]->updateMassCenterReqursiveDown();
     updateMassCenter();
+    m_dirty = false;
+}
+
+void Node::markDirty()
+{
+    for (Node* n = this; n != nullptr && !n->m_dirty; n = n->parent)
+        n->m_dirty = true;
+}
+
+void Node::updateDirty()
+{
+    if (!m_dirty)
+        return;
+    for (int i=0; i<8; i++)
+        if (subnodes[i] != nullptr)
+            subnodes[i]->updateDirty();
+    updateMassCenter();
+    m_dirty = false;
 }
 
 void Node::giveElementToSubnodes(std::shared_ptr<Element> e)
@@ -249,25 +383,10 @@ void Node::giveElementToSubnodes(std::shared_ptr<Element> e)
     int index = targerSubdivision.index();
     if (subnodes[index] == nullptr)
     {
-        subnodes[index].reset(new Node(m_octree, targerSubdivision, this));
+        subnodes[index] = m_octree->createNode(m_octree, targerSubdivision, this);
         hasSubnodes = true;
     }
-    subnodes[index]->addElement(e);
-}
-
-void Node::calculateCorners()
-{
-    double hs = size*0.5;
-    int i = 0;
-    for (int x = -1; x <=1; x += 2)
-        for (int y = -1; y <=1; y += 2)
-            for (int z = -1; z <=1; z += 2)
-            {
-                m_corners[i].x[0] = center.x[0] + x*hs;
-                m_corners[i].x[1] = center.x[1] + y*hs;
-                m_corners[i].x[2] = center.x[2] + z*hs;
-                i++;
-            }
+    subnodes[index]->addElement(std::move(e));
 }
 
 void Node::updateDiameter()
@@ -293,10 +412,82 @@ Octree::Octree(double initialSize) :
 {
 }
 
+Octree::~Octree()
+{
+    releaseNodes();
+}
+
+Octree::Octree(Octree&& other) :
+    m_center(other.m_center),
+    m_initialSize(other.m_initialSize),
+    m_centerIsSet(other.m_centerIsSet)
+{
+    takeNodes(other);
+}
+
+Octree& Octree::operator=(Octree&& other)
+{
+    if (&other == this)
+        return *this;
+    releaseNodes();
+    m_center = other.m_center;
+    m_initialSize = other.m_initialSize;
+    m_centerIsSet = other.m_centerIsSet;
+    takeNodes(other);
+    return *this;
+}
+
+void Octree::takeNodes(Octree& other)
+{
+    m_centerMassUpdatingEnabled = other.m_centerMassUpdatingEnabled;
+    m_multipolesEnabled = other.m_multipolesEnabled;
+    m_allNodesDirty = other.m_allNodesDirty;
+    // Other octree is left as cleared one
+    other.m_allNodesDirty = false;
+    other.m_centerIsSet = false;
+    // Pool of this octree is empty, so other octree gets empty pool
+    m_nodePool.swap(other.m_nodePool);
+    m_root = std::move(other.m_root);
+    if (m_root != nullptr)
+        adoptSubtree(m_root.get());
+}
+
+void Octree::adoptSubtree(Node* node)
+{
+    node->m_octree = this;
+    for (int i=0; i<8; i++)
+    {
+        if (node->subnodes[i] != nullptr)
+            adoptSubtree(node->subnodes[i].get());
+    }
+}
+
 void Octree::clear()
 {
-    m_root.reset();
+    releaseNodes();
     m_centerIsSet = false;
+    m_allNodesDirty = false;
+}
+
+void Octree::releaseNodes()
+{
+    // Blocks are not returned to pool one by one, all slabs are freed at once after the walk
+    Node* root = m_root.release();
+    if (root != nullptr)
+        destroySubtree(root);
+    m_nodePool.clear();
+}
+
+void Octree::destroySubtree(Node* node)
+{
+    for (int i=0; i<8; i++)
+    {
+        Node* subnode = node->subnodes[i].release();
+        if (subnode != nullptr)
+            destroySubtree(subnode);
+    }
+    // Only element reference is released, subnodes pointers are empty already
+    node->~Node();
 }
 
 bool Octree::empty() const
@@ -308,34 +499,429 @@ void Octree::add(std::shared_ptr<Element> e)
 {
     // Creating root if no
     if (m_root == nullptr)
+        createRoot(e->pos);
+    // Enlarging root cell
+    while (!m_root->isInside(e->pos))
+    {
+        enlargeSpaceIteration(e->pos);
+    }
+    m_root->addElement(std::move(e));
+}
+
+void Octree::addMany(const std::vector<std::shared_ptr<Element>>& elements, ThreadPool* pool)
+{
+    if (elements.empty())
+        return;
+    ThreadPool& threads = pool != nullptr ? *pool : ThreadPool::defaultPool();
+
+    bool wasEnabled = m_centerMassUpdatingEnabled;
+    m_centerMassUpdatingEnabled = false;
+
+    // Root that contains corners of bounding box contains all elements
+    auto pos = [&elements](size_t i) -> const Position& { return elements[i]->pos; };
+    Position boxMin, boxMax;
+    findBoundingBox(elements.size(), pos, threads, boxMin, boxMax);
+    if (m_root == nullptr)
+        createRoot(elements[0]->pos);
+    while (!m_root->isInside(boxMin))
+        enlargeSpaceIteration(boxMin);
+    while (!m_root->isInside(boxMax))
+        enlargeSpaceIteration(boxMax);
+    if (m_root->m_elementsCount == 0)
+    {
+        // Empty nodes of previous roots would become chains of nodes with one element
+        for (int i=0; i<8; i++)
+            m_root->subnodes[i].reset();
+        m_root->hasSubnodes = false;
+    }
+
+    // Cells are several times more than threads to balance load
+    int depth = 1;
+    while (depth < maxAddSplitDepth && (size_t(1) << (3 * depth)) < 8 * threads.threadsCount())
+        depth++;
+    const size_t cellsCount = size_t(1) << (3 * depth);
+
+    std::vector<uint32_t> cells(elements.size());
+    const Node* root = m_root.get();
+    threads.parallelFor(elements.size(), buildGrain,
+        [&cells, &elements, root, depth](unsigned, size_t begin, size_t end)
+        {
+            for (size_t i=begin; i<end; i++)
+                cells[i] = static_cast<uint32_t>(cellIndex(root, elements[i]->pos, depth));
+        }
+    );
+    // Elements indexes are sorted by cells by counting
+    std::vector<size_t> bounds(cellsCount + 1, 0);
+    for (uint32_t cell : cells)
+        bounds[cell + 1]++;
+    for (size_t i=0; i<cellsCount; i++)
+        bounds[i + 1] += bounds[i];
+    std::vector<size_t> order(elements.size());
+    {
+        std::vector<size_t> cursors(bounds.begin(), bounds.end() - 1);
+        for (size_t i=0; i<elements.size(); i++)
+            order[cursors[cells[i]]++] = i;
+    }
+
+    struct Group
+    {
+        Node* node;
+        size_t begin, end;
+        size_t countBefore;
+        std::exception_ptr error;
+    };
+    std::vector<Group> groups;
+    std::exception_ptr error;
+    for (size_t cell=0; cell<cellsCount; cell++)
     {
-        if (!m_centerIsSet)
+        size_t begin = bounds[cell], end = bounds[cell + 1];
+        if (begin == end)
+            continue;
+        if (end - begin == 1)
         {
-            m_center = e->pos;
-
-            /**
-             * We should not put grid center directly into the point due to double
-             * computetion errors: it may be concerned as a point from mode than one subnodes,
-             * because subnodes centers are not inaccurate.
-             *
-             * If you know better way to get rid of floating point errors, do it.
-             */
-            m_center[0] -= m_initialSize * 0.13;
-            m_center[1] -= m_initialSize * 0.13;
-            m_center[2] -= m_initialSize * 0.13;
-            m_centerIsSet = true;
+            // Single element is added serially instead of creating path for it
+            try {
+                m_root->addElement(elements[order[begin]]);
+            } catch (const std::runtime_error&) {
+                if (error == nullptr)
+                    error = std::current_exception();
+            }
+            continue;
         }
+        Node* node = createCellPath(cell, depth);
+        // Path is dirty already, so marking by threads stops at group node
+        node->markDirty();
+        groups.push_back(Group{node, begin, end, node->m_elementsCount, nullptr});
+    }
 
-        m_root.reset(
-            new Node(this, m_center, m_initialSize)
+    // Groups are inserted into disjoint subtrees, counts of nodes above them are updated after
+    auto finish = [this, &groups, &error, &threads, depth, wasEnabled]()
+    {
+        for (const Group& group : groups)
+        {
+            size_t added = group.node->m_elementsCount - group.countBefore;
+            for (Node* n = group.node->parent; n != nullptr; n = n->parent)
+                n->m_elementsCount += added;
+            if (group.error != nullptr && error == nullptr)
+                error = group.error;
+        }
+        if (error != nullptr)
+            repairUpperLevels(m_root.get(), depth);
+        m_centerMassUpdatingEnabled = wasEnabled;
+        if (wasEnabled)
+            updateDirtyNodes(&threads);
+    };
+    try {
+        threads.parallelFor(groups.size(), 1,
+            [this, &groups, &elements, &order](unsigned, size_t begin, size_t end)
+            {
+                FixedSizePool::LocalCache cache(m_nodePool);
+                NodeCacheScope scope(&cache);
+                for (size_t g=begin; g<end; g++)
+                {
+                    Group& group = groups[g];
+                    for (size_t i=group.begin; i<group.end; i++)
+                    {
+                        try {
+                            group.node->addElement(elements[order[i]]);
+                        } catch (const std::runtime_error&) {
+                            if (group.error == nullptr)
+                                group.error = std::current_exception();
+                        }
+                    }
+                }
+            }
         );
+    } catch (...) {
+        finish();
+        throw;
     }
-    // Enlarging root cell
-    while (!m_root->isInside(e->pos))
+    finish();
+    if (error != nullptr)
+        std::rethrow_exception(error);
+}
+
+void Octree::createRoot(const Position& firstPos)
+{
+    if (!m_centerIsSet)
     {
-        enlargeSpaceIteration(e->pos);
+        m_center = firstPos;
+
+        /**
+         * We should not put grid center directly into the point due to double
+         * computetion errors: it may be concerned as a point from mode than one subnodes,
+         * because subnodes centers are not inaccurate.
+         *
+         * If you know better way to get rid of floating point errors, do it.
+         */
+        m_center[0] -= m_initialSize * 0.13;
+        m_center[1] -= m_initialSize * 0.13;
+        m_center[2] -= m_initialSize * 0.13;
+        m_centerIsSet = true;
     }
-    m_root->addElement(e);
+
+    m_root = createNode(this, m_center, m_initialSize);
+}
+
+void Octree::build(const std::vector<std::shared_ptr<Element>>& elements, ThreadPool* pool)
+{
+    ThreadPool& threads = pool != nullptr ? *pool : ThreadPool::defaultPool();
+    m_root.reset();
+    if (elements.empty())
+        return;
+
+    auto pos = [&elements](size_t i) -> const Position& { return elements[i]->pos; };
+    Position boxMin, boxMax;
+    findBoundingBox(elements.size(), pos, threads, boxMin, boxMax);
+    createBuildRoot(boxMin, boxMax);
+
+    std::vector<MortonKey> keys = sortedMortonKeys(elements.size(), pos, *m_root, threads);
+    std::vector<std::shared_ptr<Element>> sorted(elements.size());
+    threads.parallelFor(keys.size(), buildGrain,
+        [&keys, &sorted, &elements](unsigned, size_t begin, size_t end)
+        {
+            for (size_t i=begin; i<end; i++)
+                sorted[i] = elements[keys[i].second];
+        }
+    );
+    buildSorted(sorted, threads);
+}
+
+void Octree::build(const Position* positions, const double* values, size_t count, ThreadPool* pool)
+{
+    ThreadPool& threads = pool != nullptr ? *pool : ThreadPool::defaultPool();
+    m_root.reset();
+    if (count == 0)
+        return;
+
+    auto pos = [positions](size_t i) -> const Position& { return positions[i]; };
+    Position boxMin, boxMax;
+    findBoundingBox(count, pos, threads, boxMin, boxMax);
+    createBuildRoot(boxMin, boxMax);
+
+    std::vector<MortonKey> keys = sortedMortonKeys(count, pos, *m_root, threads);
+    std::vector<std::shared_ptr<Element>> sorted(count);
+    // Every worker has its own arena, so allocations do not wait for each other.
+    // Arenas are freed when their last element is destroyed
+    std::vector<std::shared_ptr<Arena>> arenas(threads.threadsCount());
+    for (auto& arena : arenas)
+        arena = std::make_shared<Arena>();
+    threads.parallelFor(keys.size(), buildGrain,
+        [&keys, &sorted, &arenas, positions, values](unsigned worker, size_t begin, size_t end)
+        {
+            ArenaAllocator<ElementValue> allocator(arenas[worker]);
+            for (size_t i=begin; i<end; i++)
+            {
+                size_t index = keys[i].second;
+                sorted[i] = std::allocate_shared<ElementValue>(allocator, positions[index], values != nullptr ? values[index] : 0.0);
+            }
+        }
+    );
+    buildSorted(sorted, threads);
+}
+
+void Octree::update()
+{
+    if (empty())
+        return;
+    std::vector<Element*> elements;
+    elements.reserve(m_root->elementsCount());
+    m_root->pushBackAllElements(elements);
+
+    // Paths of every moved element are only marked, so shared nodes are recalculated once
+    bool wasEnabled = m_centerMassUpdatingEnabled;
+    m_centerMassUpdatingEnabled = false;
+    try {
+        for (Element* e : elements)
+            update(*e);
+    } catch (...) {
+        m_centerMassUpdatingEnabled = wasEnabled;
+        if (wasEnabled)
+            updateDirtyNodes();
+        throw;
+    }
+    m_centerMassUpdatingEnabled = wasEnabled;
+    if (wasEnabled)
+        updateDirtyNodes();
+}
+
+bool Octree::update(Element& element)
+{
+    Node* leaf = element.parent;
+    if (leaf == nullptr || leaf->m_octree != this)
+        return false;
+    if (leaf->isInside(element.pos))
+    {
+        if (centerMassUpdatingEnabled())
+            leaf->updateMassCenterReqursiveUp();
+        else
+            leaf->markDirty();
+        return false;
+    }
+
+    Node* ancestor = leaf->parent;
+    while (ancestor != nullptr && !ancestor->isInside(element.pos))
+        ancestor = ancestor->parent;
+
+    // New place is checked before element is detached, so element is kept by its leaf if place is taken
+    const Node* node = ancestor;
+    while (node != nullptr && node->element == nullptr)
+        node = node->subnodes[SubdivisionPos(node->center, element.pos).index()].get();
+    if (node != nullptr && node->element.get() != &element && node->element->pos == element.pos)
+        throw std::runtime_error("Cannot work with 2 elements at one place");
+
+    std::shared_ptr<Element> e = leaf->element;
+    Node* lowest = collapse(detachElement(leaf, ancestor));
+    if (centerMassUpdatingEnabled())
+        lowest->updateMassCenterReqursiveUp();
+    else
+        lowest->markDirty();
+
+    if (ancestor != nullptr)
+        ancestor->addElement(std::move(e));
+    else
+        add(std::move(e));
+    return true;
+}
+
+Node* Octree::detachElement(Node* leaf, Node* stop)
+{
+    leaf->element->parent = nullptr;
+    leaf->element.reset();
+    leaf->updateDiameter();
+
+    Node* lowest = leaf;
+    Node* node = leaf;
+    for (;;)
+    {
+        node->m_elementsCount--;
+        Node* parent = node->parent;
+        if (node == stop || parent == nullptr)
+            break;
+        if (node->m_elementsCount == 0)
+        {
+            bool hasOthers = false;
+            for (int i=0; i<8; i++)
+            {
+                if (parent->subnodes[i].get() == node)
+                    parent->subnodes[i].reset();
+                else if (parent->subnodes[i] != nullptr)
+                    hasOthers = true;
+            }
+            parent->hasSubnodes = hasOthers;
+            lowest = parent;
+        }
+        node = parent;
+    }
+    return lowest;
+}
+
+bool Octree::remove(Element& element)
+{
+    Node* leaf = element.parent;
+    if (leaf == nullptr || leaf->m_octree != this)
+        return false;
+    Node* lowest = collapse(detachElement(leaf, nullptr));
+    if (m_root->m_elementsCount == 0)
+    {
+        m_root.reset();
+        m_allNodesDirty = false;
+        return true;
+    }
+    if (centerMassUpdatingEnabled())
+        lowest->updateMassCenterReqursiveUp();
+    else
+        lowest->markDirty();
+    return true;
+}
+
+Node* Octree::collapse(Node* node)
+{
+    // Counts do not decrease up the tree, so nodes with one element are a chain from node
+    Node* top = nullptr;
+    for (Node* n = node; n != nullptr && n->m_elementsCount == 1; n = n->parent)
+        top = n;
+    if (top == nullptr || top->element != nullptr)
+        return node;
+
+    Node* leaf = top;
+    while (leaf->element == nullptr)
+    {
+        Node* next = nullptr;
+        for (int i=0; i<8 && next == nullptr; i++)
+            next = leaf->subnodes[i].get();
+        leaf = next;
+    }
+    std::shared_ptr<Element> e = std::move(leaf->element);
+    // Subtree nodes are returned to the pool
+    for (int i=0; i<8; i++)
+        top->subnodes[i].reset();
+    top->hasSubnodes = false;
+    e->parent = top;
+    top->element = std::move(e);
+    top->updateDiameter();
+    return top;
+}
+
+Node* Octree::createCellPath(size_t cell, int depth)
+{
+    Node* node = m_root.get();
+    for (int level=depth-1; level>=0; level--)
+    {
+        // Node gets more elements, so its own element goes down as in addElement()
+        if (node->element != nullptr)
+        {
+            std::shared_ptr<Element> e = std::move(node->element);
+            e->parent = nullptr;
+            node->giveElementToSubnodes(std::move(e));
+            node->updateDiameter();
+        }
+        int index = (cell >> (3 * level)) & 7;
+        if (node->subnodes[index] == nullptr)
+        {
+            SubdivisionPos subdivision;
+            for (int i=0; i<3; i++)
+                subdivision.s[i] = (index >> i) & 1;
+            node->subnodes[index] = createNode(this, subdivision, node);
+            node->hasSubnodes = true;
+        }
+        node = node->subnodes[index].get();
+    }
+    return node;
+}
+
+void Octree::repairUpperLevels(Node* node, int depth)
+{
+    if (node->m_elementsCount == 1 && node->element == nullptr)
+    {
+        collapse(node);
+        return;
+    }
+    if (!node->hasSubnodes)
+        return;
+    bool hasSubnodes = false;
+    for (int i=0; i<8; i++)
+    {
+        Node* subnode = node->subnodes[i].get();
+        if (subnode == nullptr)
+            continue;
+        if (subnode->m_elementsCount == 0)
+        {
+            node->subnodes[i].reset();
+            continue;
+        }
+        hasSubnodes = true;
+        if (depth > 0)
+            repairUpperLevels(subnode, depth - 1);
+    }
+    node->hasSubnodes = hasSubnodes;
+}
+
+void* Octree::allocateNode()
+{
+    if (nodeCache != nullptr && &nodeCache->pool() == &m_nodePool)
+        return nodeCache->allocate();
+    return m_nodePool.allocate();
 }
 
 size_t Octree::count()
@@ -348,85 +934,295 @@ size_t Octree::count()
 
 const Element& Octree::getNearest(Position pos)
 {
-    using namespace std;
+    NoStats stats;
+    if (m_root == nullptr)
+        throw(std::runtime_error("Octree is empty"));
+    // Buffer is reused by calls from the same thread
+    thread_local std::vector<const Element*> nearest;
+    findKNearest(nearest, pos, 1, 0.0, stats);
+    if (nearest.empty())
+        throw(std::runtime_error("Octree is empty"));
+    return *nearest.front();
+}
+
+const Element& Octree::getNearest(Position pos, TraversalStats& stats)
+{
     if (m_root == nullptr)
         throw(std::runtime_error("Octree is empty"));
-    // ndp = node-distance pair
-    using ndp = pair<const Node*, DistToNode>;
-    list<ndp> nodes;
-    list<ndp> nodesNext;
-    nodes.push_back(ndp(m_root.get(), m_root->getDistsToNode(pos)));
+    thread_local std::vector<const Element*> nearest;
+    findKNearest(nearest, pos, 1, 0.0, stats);
+    if (nearest.empty())
+        throw(std::runtime_error("Octree is empty"));
+    return *nearest.front();
+}
 
-    double minFarest = nodes.front().second.farest;
+void Octree::getKNearest(std::vector<const Element*>& result, const Position& pos, size_t k, double epsilon) const
+{
+    NoStats stats;
+    findKNearest(result, pos, k, epsilon, stats);
+}
 
-    do {
-        // Finding closes
-        for (auto it=nodes.begin(); it!=nodes.end(); it++)
-        {
-            double farest = it->second.farest;
-            if (farest < minFarest)
-                minFarest = farest;
-        }
+void Octree::getKNearest(std::vector<const Element*>& result, const Position& pos, size_t k, double epsilon,
+                         TraversalStats& stats) const
+{
+    findKNearest(result, pos, k, epsilon, stats);
+}
 
-        // Removing nodes that are too far
-        for (auto it=nodes.begin(); it != nodes.end(); )
+template<typename Stats>
+void Octree::findKNearest(std::vector<const Element*>& result, const Position& pos, size_t k, double epsilon,
+                          Stats& stats) const
+{
+    result.clear();
+    if (m_root == nullptr || k == 0)
+        return;
+
+    // nd = squared distance and node, queue is min-heap by distance
+    using nd = std::pair<double, const Node*>;
+    // ed = squared distance and element, found is max-heap by distance
+    using ed = std::pair<double, const Element*>;
+    auto farther = [](const nd& left, const nd& right) { return left.first > right.first; };
+    auto closer = [](const ed& left, const ed& right) { return left.first < right.first; };
+    // Buffers are reused by calls from the same thread, so there are no allocations in most calls
+    thread_local std::vector<nd> queue;
+    thread_local std::vector<ed> found;
+    queue.clear();
+    found.clear();
+
+    // Node is opened only if its box is closer than current k-th distance divided by (1 + epsilon)
+    const double factor = (1.0 + epsilon) * (1.0 + epsilon);
+    auto offerElement = [&closer, k](double dist, const Element* e)
+    {
+        if (found.size() < k)
         {
-            if (it->second.nearest > minFarest)
-                it = nodes.erase(it);
-            else
-                it++;
+            found.push_back(ed(dist, e));
+            std::push_heap(found.begin(), found.end(), closer);
+        } else if (dist < found.front().first) {
+            std::pop_heap(found.begin(), found.end(), closer);
+            found.back() = ed(dist, e);
+            std::push_heap(found.begin(), found.end(), closer);
         }
+    };
+    auto worth = [factor, k](double dist)
+    {
+        return found.size() < k || dist * factor < found.front().first;
+    };
 
-        nodesNext.clear();
-        // Subdivision
-        for (auto it=nodes.begin(); it!=nodes.end(); it++)
+    stats.start();
+    if (m_root->element != nullptr)
+    {
+        stats.visit(0, 0);
+        stats.leaf();
+        offerElement(m_root->getSquaredDistToBox(pos), m_root->element.get());
+    } else {
+        queue.push_back(nd(m_root->getSquaredDistToBox(pos), m_root.get()));
+    }
+
+    while (!queue.empty())
+    {
+        nd top = queue.front();
+        std::pop_heap(queue.begin(), queue.end(), farther);
+        queue.pop_back();
+        // All other nodes are not closer
+        if (!worth(top.first))
+            break;
+
+        const Node* n = top.second;
+        stats.visit(n->subdivisionLevel - m_root->subdivisionLevel, queue.size() + 1);
+        double nearest[8], farest[8];
+        n->getSubnodesSquaredDists(pos, nearest, farest);
+        for (int i=0; i<8; i++)
         {
-            const Node& n = *(it->first);
-            if (n.element != nullptr)
-            {
-                nodesNext.push_back(*it);
+            const Node* subnode = n->subnodes[i].get();
+            if (subnode == nullptr)
                 continue;
-            }
-            for (int i=0; i<8; i++)
+            if (subnode->element != nullptr)
             {
-                if (n.subnodes[i] == nullptr)
-                    continue;
-
-                nodesNext.push_back(ndp(n.subnodes[i].get(), n.subnodes[i]->getDistsToNode(pos)));
+                stats.leaf();
+                Position d = subnode->element->pos - pos;
+                offerElement(d * d, subnode->element.get());
+            } else if (subnode->hasSubnodes && worth(nearest[i])) {
+                queue.push_back(nd(nearest[i], subnode));
+                std::push_heap(queue.begin(), queue.end(), farther);
             }
         }
-        swap(nodes, nodesNext);
-    } while (!(nodes.size() == 1 && nodes.front().first->element != nullptr));
+    }
 
-    // const_cast is not bad, because const modifier used only for code above
-    // in this function, and its job is done
-    return *(nodes.front().first->element);
+    std::sort_heap(found.begin(), found.end(), closer);
+    for (const ed& it : found)
+        result.push_back(it.second);
+}
+
+void Octree::getNearestMany(const Position* points, size_t count, const Element** result, ThreadPool* pool) const
+{
+    if (count == 0)
+        return;
+    if (empty())
+        throw(std::runtime_error("Octree is empty"));
+    ThreadPool& threads = pool != nullptr ? *pool : ThreadPool::defaultPool();
+    MortonGrid grid(m_root->center, m_root->size);
+    std::vector<MortonKey> order(count);
+    for (size_t i=0; i<count; i++)
+        order[i] = MortonKey(grid.key(points[i]), i);
+    sortMortonKeys(order, threads);
+
+    threads.parallelFor(count, 64,
+        [this, points, result, &order](unsigned, size_t begin, size_t end)
+        {
+            std::vector<const Element*> nearest;
+            for (size_t i=begin; i<end; i++)
+            {
+                size_t index = order[i].second;
+                getKNearest(nearest, points[index], 1);
+                result[index] = nearest.front();
+            }
+        }
+    );
 }
 
 void Octree::getClose(std::vector<Element*>& target, const Position& pos, double dist) const
+{
+    NoStats stats;
+    std::vector<const Node*> nodesVector;
+    nodesVector.reserve(200);
+    getClose(target, pos, dist, nodesVector, stats);
+}
+
+void Octree::getClose(std::vector<Element*>& target, const Position& pos, double dist, TraversalStats& stats) const
 {
     std::vector<const Node*> nodesVector;
     nodesVector.reserve(200);
+    getClose(target, pos, dist, nodesVector, stats);
+}
+
+size_t Octree::countClose(const Position& pos, double dist) const
+{
+    if (empty())
+        return 0;
+    return reduceClose<size_t>(*m_root, pos, dist, [](const Node& n) { return n.elementsCount(); });
+}
+
+double Octree::sumClose(const Position& pos, double dist) const
+{
     if (empty())
+        return 0.0;
+    updateDirtyNodes();
+    return reduceClose<double>(*m_root, pos, dist, [](const Node& n) { return n.mass; });
+}
+
+template<typename T, typename NodeValue>
+T Octree::reduceClose(const Node& node, const Position& pos, double dist, const NodeValue& nodeValue) const
+{
+    DistToNode nodeDist = node.getDistsToNode(pos);
+    if (nodeDist.nearest > dist)
+        return T();
+    // Node aggregate is used instead of enumerating elements
+    if (nodeDist.farest <= dist)
+        return nodeValue(node);
+    return reduceCloseSubnodes<T>(node, pos, dist * dist, nodeValue);
+}
+
+template<typename T, typename NodeValue>
+T Octree::reduceCloseSubnodes(const Node& node, const Position& pos, double squaredDist, const NodeValue& nodeValue) const
+{
+    double nearest[8], farest[8];
+    node.getSubnodesSquaredDists(pos, nearest, farest);
+    T result = T();
+    for (int i=0; i<8; i++)
+    {
+        const Node* subnode = node.subnodes[i].get();
+        if (subnode == nullptr || nearest[i] > squaredDist)
+            continue;
+        if (subnode->element != nullptr)
+        {
+            Position d = subnode->element->pos - pos;
+            if (d * d <= squaredDist)
+                result += nodeValue(*subnode);
+        } else if (farest[i] <= squaredDist) {
+            result += nodeValue(*subnode);
+        } else {
+            result += reduceCloseSubnodes<T>(*subnode, pos, squaredDist, nodeValue);
+        }
+    }
+    return result;
+}
+
+void Octree::getCloseMany(const Position* points, const double* radii, size_t count,
+                          std::vector<size_t>& offsets, std::vector<Element*>& elements, ThreadPool* pool) const
+{
+    elements.clear();
+    if (empty())
+    {
+        offsets.assign(count + 1, 0);
+        return;
+    }
+    ThreadPool& threads = pool != nullptr ? *pool : ThreadPool::defaultPool();
+    std::vector<std::vector<const Node*>> scratch(threads.threadsCount());
+    runMortonOrderedQueries(threads, MortonGrid(m_root->center, m_root->size), points, count, offsets, elements,
+        [this, points, radii, &scratch](unsigned worker, size_t index, std::vector<Element*>& out)
+        {
+            NoStats stats;
+            getClose(out, points[index], radii[index], scratch[worker], stats);
+        }
+    );
+}
+
+template<typename Stats>
+void Octree::getClose(std::vector<Element*>& target, const Position& pos, double dist,
+                      std::vector<const Node*>& nodesVector, Stats& stats) const
+{
+    nodesVector.clear();
+    if (empty())
+        return;
+
+    stats.start();
+    // Root is checked alone, other nodes are checked together with their siblings
+    const Node& r = *m_root;
+    DistToNode rootDist = r.getDistsToNode(pos);
+    if (rootDist.nearest > dist)
         return;
+    if (rootDist.farest <= dist || r.isLeaf())
+    {
+        stats.visit(0, 1);
+        if (r.isLeaf())
+            stats.leaf();
+        else
+            stats.accept();
+        r.pushBackAllElements(target);
+        return;
+    }
 
-    nodesVector.push_back(&root());
+    const double squaredDist = dist * dist;
+    nodesVector.push_back(&r);
     for (size_t i=0; i != nodesVector.size(); i++)
     {
         const Node *n = nodesVector[i];
-        DistToNode nodeDist = n->getDistsToNode(pos);
-        // All node is too far
-        if (nodeDist.nearest > dist)
-            continue;
-        // All node is enough close
-        if (nodeDist.farest <= dist)
+        stats.visitQueued(i, nodesVector.size());
+        double nearest[8], farest[8];
+        n->getSubnodesSquaredDists(pos, nearest, farest);
+        for (int j=0; j<8; j++)
         {
-            n->pushBackAllElements(target);
-            continue;
+            const Node* subnode = n->subnodes[j].get();
+            // All node is too far
+            if (subnode == nullptr || nearest[j] > squaredDist)
+                continue;
+            if (subnode->element != nullptr)
+            {
+                // Element is checked by its position instead of its box
+                Position d = subnode->element->pos - pos;
+                if (d * d <= squaredDist)
+                {
+                    stats.leaf();
+                    target.push_back(subnode->element.get());
+                }
+            } else if (farest[j] <= squaredDist) {
+                // All node is enough close
+                stats.accept();
+                subnode->pushBackAllElements(target);
+            } else if (subnode->hasSubnodes) {
+                // Some parts are close and some are far. Need division
+                nodesVector.push_back(subnode);
+            }
         }
-
-        // Some parts are close and some are far. Need division
-        n->pushBackSubnodes(nodesVector);
     }
 }
 
@@ -439,19 +1235,106 @@ double Octree::mass()
 {
     if (m_root == nullptr)
         return 0.0;
+    updateDirtyNodes();
     return m_root->mass;
 }
 
 const Position& Octree::massCenter()
 {
+    updateDirtyNodes();
     return m_root->massCenter;
 }
 
+void Octree::updateDirtyNodes(ThreadPool* pool) const
+{
+    // Aggregates are cache of tree content, so they are updated in const method
+    std::unique_lock<std::mutex> lock(m_aggregatesMutex);
+    if (m_root == nullptr || (!m_allNodesDirty && !m_root->isDirty()))
+        return;
+    updateAggregates(m_allNodesDirty, pool != nullptr ? *pool : ThreadPool::defaultPool());
+    m_allNodesDirty = false;
+}
+
+void Octree::updateAggregates(bool allNodes, ThreadPool& pool) const
+{
+    size_t cutoff = std::max<size_t>(aggregatesGrain, m_root->m_elementsCount / (8 * pool.threadsCount()));
+    std::vector<Node*> splitted;
+    std::vector<Node*> tasks;
+    splitForAggregates(m_root.get(), allNodes, cutoff, splitted, tasks);
+    auto update = [&tasks, allNodes](unsigned, size_t begin, size_t end)
+    {
+        for (size_t i=begin; i<end; i++)
+        {
+            if (allNodes)
+                tasks[i]->updateMassCenterReqursiveDown();
+            else
+                tasks[i]->updateDirty();
+        }
+    };
+    if (tasks.size() == 1)
+        update(0, 0, 1);
+    else
+        pool.parallelFor(tasks.size(), 1, update);
+    // Parents are added before children, so reverse order is bottom-up
+    for (auto it = splitted.rbegin(); it != splitted.rend(); ++it)
+    {
+        (*it)->updateMassCenter();
+        (*it)->m_dirty = false;
+    }
+}
+
+void Octree::splitForAggregates(Node* node, bool allNodes, size_t cutoff, std::vector<Node*>& splitted, std::vector<Node*>& tasks)
+{
+    if (!allNodes && !node->m_dirty)
+        return;
+    if (node->m_elementsCount <= cutoff || !node->hasSubnodes)
+    {
+        tasks.push_back(node);
+        return;
+    }
+    splitted.push_back(node);
+    for (int i=0; i<8; i++)
+    {
+        if (node->subnodes[i] != nullptr)
+            splitForAggregates(node->subnodes[i].get(), allNodes, cutoff, splitted, tasks);
+    }
+}
+
+void Octree::elementChanged(const Element& element)
+{
+    if (element.parent == nullptr)
+        return;
+    if (centerMassUpdatingEnabled())
+        element.parent->updateMassCenterReqursiveUp();
+    else
+        element.parent->markDirty();
+}
+
 void Octree::dbgOutCoords(std::ostream& s)
 {
     m_root->dbgOutCoords(s);
 }
 
+void Octree::save(const std::string& path) const
+{
+    LinearOctree(*this).save(path);
+}
+
+void Octree::load(const std::string& path, ThreadPool* pool)
+{
+    LinearOctree snapshot;
+    snapshot.load(path);
+    std::vector<Position> positions(snapshot.count());
+    std::vector<double> values(snapshot.count());
+    for (uint32_t i=0; i<snapshot.count(); i++)
+    {
+        positions[snapshot.sourceIndex(i)] = snapshot.position(i);
+        values[snapshot.sourceIndex(i)] = snapshot.value(i);
+    }
+    clear();
+    build(positions.data(), values.data(), positions.size(), pool);
+}
+
 bool Octree::centerMassUpdatingEnabled() const
 {
     return m_centerMassUpdatingEnabled;
@@ -462,13 +1345,26 @@ void Octree::muteCenterMassCalculation()
     m_centerMassUpdatingEnabled = false;
 }
 
+void Octree::setMultipolesEnabled(bool enabled)
+{
+    m_multipolesEnabled = enabled;
+    if (!enabled || empty())
+        return;
+    if (centerMassUpdatingEnabled())
+        updateAggregates(true, ThreadPool::defaultPool());
+    else
+        m_allNodesDirty = true;
+}
+
+bool Octree::multipolesEnabled() const
+{
+    return m_multipolesEnabled;
+}
+
 void Octree::unmuteCenterMassCalculation()
 {
     m_centerMassUpdatingEnabled = true;
-    if (empty())
-        return;
-    /// @todo Optimization: update only if changed
-    m_root->updateMassCenterReqursiveDown();
+    updateDirtyNodes();
 }
 
 void Octree::enlargeSpaceIteration(const Position& p)
@@ -481,14 +1377,167 @@ void Octree::enlargeSpaceIteration(const Position& p)
             newRootCenter.x[i] = cx + (p.x[i] > cx ? dcx : -dcx);
     }
     SubdivisionPos subPos(newRootCenter, m_root->center);
-    std::unique_ptr<Node> n(new Node(this, newRootCenter, m_root->size * 2));
+    NodePtr n = createNode(this, newRootCenter, m_root->size * 2);
     n->hasSubnodes = true;
     n->subdivisionLevel = m_root->subdivisionLevel - 1;
     n->subdivisionPos = subPos;
+    m_root->parent = n.get();
+    n->m_elementsCount = m_root->m_elementsCount;
     n->subnodes[subPos.index()] = std::move(m_root);
     m_root = std::move(n);
     if (centerMassUpdatingEnabled())
         m_root->updateMassCenter();
+    else
+        m_root->markDirty();
+}
+
+void Octree::createBuildRoot(const Position& boxMin, const Position& boxMax)
+{
+    Position center;
+    double size = m_initialSize;
+    if (m_centerIsSet)
+    {
+        // Enlarging space the same way as adding one by one do
+        center = m_center;
+        for (;;)
+        {
+            Node box(this, center, size);
+            const Position* outside = nullptr;
+            if (!box.isInside(boxMin))
+                outside = &boxMin;
+            else if (!box.isInside(boxMax))
+                outside = &boxMax;
+            if (outside == nullptr)
+                break;
+            for (int i=0; i<3; i++)
+                center.x[i] += outside->x[i] > center.x[i] ? size / 2.0 : -size / 2.0;
+            size *= 2;
+        }
+    } else {
+        double extent = 0.0;
+        for (int i=0; i<3; i++)
+            extent = std::max(extent, boxMax.x[i] - boxMin.x[i]);
+        // Some gap is left to keep points far from cell borders
+        while (size <= extent * 1.001)
+            size *= 2;
+        center = (boxMin + boxMax) * 0.5;
+        m_center = center;
+        m_centerIsSet = true;
+    }
+    m_root = createNode(this, center, size);
+}
+
+void Octree::buildSorted(std::vector<std::shared_ptr<Element>>& sorted, ThreadPool& pool)
+{
+    // Upper part of tree is splitted serially to get tasks for all threads
+    size_t cutoff = std::max<size_t>(buildGrain, sorted.size() / (8 * pool.threadsCount()));
+    std::vector<Node*> splitted;
+    std::vector<BuildTask> tasks;
+    try {
+        splitForBuild(m_root.get(), sorted.data(), sorted.size(), cutoff, splitted, tasks);
+        pool.parallelFor(tasks.size(), 1,
+            [this, &tasks](unsigned, size_t begin, size_t end)
+            {
+                for (size_t i=begin; i<end; i++)
+                    buildSubtree(tasks[i].node, tasks[i].elements, tasks[i].count);
+            }
+        );
+    } catch (...) {
+        m_root.reset();
+        throw;
+    }
+    // Parents are created before children, so reverse order is bottom-up
+    for (auto it = splitted.rbegin(); it != splitted.rend(); ++it)
+        (*it)->updateMassCenter();
+}
+
+void Octree::splitForBuild(Node* node, std::shared_ptr<Element>* elements, size_t count, size_t cutoff,
+                           std::vector<Node*>& splitted, std::vector<BuildTask>& tasks)
+{
+    if (count <= cutoff)
+    {
+        tasks.push_back(BuildTask{node, elements, count});
+        return;
+    }
+    size_t bounds[9];
+    createSubnodesForBuild(node, elements, count, bounds);
+    splitted.push_back(node);
+    for (int i=0; i<8; i++)
+    {
+        if (node->subnodes[i] != nullptr)
+            splitForBuild(node->subnodes[i].get(), elements + bounds[i], bounds[i+1] - bounds[i], cutoff, splitted, tasks);
+    }
+}
+
+void Octree::buildSubtree(Node* node, std::shared_ptr<Element>* elements, size_t count)
+{
+    if (count == 1)
+    {
+        node->element = std::move(elements[0]);
+        node->element->parent = node;
+        node->m_elementsCount = 1;
+        node->updateDiameter();
+        node->updateMassCenter();
+        return;
+    }
+    size_t bounds[9];
+    createSubnodesForBuild(node, elements, count, bounds);
+    for (int i=0; i<8; i++)
+    {
+        if (node->subnodes[i] != nullptr)
+            buildSubtree(node->subnodes[i].get(), elements + bounds[i], bounds[i+1] - bounds[i]);
+    }
+    node->updateMassCenter();
+}
+
+void Octree::createSubnodesForBuild(Node* node, std::shared_ptr<Element>* elements, size_t count, size_t bounds[9])
+{
+    const Position& center = node->center;
+    auto index = [&center](const std::shared_ptr<Element>& e)
+    {
+        return SubdivisionPos(center, e->pos).index();
+    };
+
+    // Elements are sorted by Morton key, so they are almost always already grouped
+    // by subnodes. But Morton key is calculated with rounding, so order is checked
+    // against precise subdivision that Node::addElement uses
+    bool ordered = true;
+    for (size_t i=1; i<count && ordered; i++)
+        ordered = index(elements[i-1]) <= index(elements[i]);
+    if (!ordered)
+    {
+        std::stable_sort(elements, elements + count,
+            [&index](const std::shared_ptr<Element>& left, const std::shared_ptr<Element>& right)
+            { return index(left) < index(right); }
+        );
+    }
+
+    if (index(elements[0]) == index(elements[count-1]))
+    {
+        const Position& first = elements[0]->pos;
+        bool same = true;
+        for (size_t i=1; i<count && same; i++)
+            same = elements[i]->pos == first;
+        if (same)
+            throw std::runtime_error("Cannot work with 2 elements at one place");
+    }
+
+    size_t current = 0;
+    for (int i=0; i<8; i++)
+    {
+        bounds[i] = current;
+        while (current < count && index(elements[current]) == i)
+            current++;
+        if (current != bounds[i])
+        {
+            SubdivisionPos subdivision(center, elements[bounds[i]]->pos);
+            node->subnodes[i] = createNode(this, subdivision, node);
+        }
+    }
+    bounds[8] = count;
+    node->hasSubnodes = true;
+    node->m_elementsCount = count;
+    node->updateDiameter();
 }
 
 ///////////////////////////
@@ -516,11 +1565,66 @@ LinearScales::LinearScales(double k) :
 {
 }
 
-double LinearScales::findScale(double distance) const
+double LinearScales::minDistance(double scale) const
+{
+    if (scale <= 0.0)
+        return -std::numeric_limits<double>::infinity();
+    if (m_k <= 0.0)
+        return std::numeric_limits<double>::infinity();
+    return scale / m_k;
+}
+
+IScalesConfig& IScalesConfig::operator=(const IScalesConfig&)
+{
+    scalesChanged();
+    return *this;
+}
+
+double IScalesConfig::minDistance(double scale) const
+{
+    // Convolutions of the same tree request the same scales, so bisection is done once for them
+    std::unique_lock<std::mutex> lock(m_cacheMutex);
+    auto it = m_minDistances.find(scale);
+    if (it != m_minDistances.end())
+        return it->second;
+    lock.unlock();
+    double result = findMinDistance(scale);
+    lock.lock();
+    if (m_minDistances.size() >= maxCachedDistances)
+        m_minDistances.clear();
+    m_minDistances[scale] = result;
+    return result;
+}
+
+void IScalesConfig::scalesChanged()
+{
+    std::unique_lock<std::mutex> lock(m_cacheMutex);
+    m_minDistances.clear();
+}
+
+double IScalesConfig::findMinDistance(double scale) const
 {
-    if (distance < 0.0)
+    if (findScale(0.0) >= scale)
         return 0.0;
-    return distance*m_k;
+    double low = 0.0, high = 1.0;
+    while (findScale(high) < scale)
+    {
+        low = high;
+        high *= 2.0;
+        if (std::isinf(high))
+            return high;
+    }
+    for (;;)
+    {
+        double middle = 0.5 * (low + high);
+        if (middle <= low || middle >= high)
+            break;
+        if (findScale(middle) >= scale)
+            high = middle;
+        else
+            low = middle;
+    }
+    return high;
 }
 
 ///////////////////////////
@@ -534,6 +1638,16 @@ void DiscreteScales::addScale(double minDistance, double averagingScale)
 {
     m_distsScales.push_back(std::pair<double, double>(minDistance, averagingScale));
     sortDistsScales(); // Not very quick solutions, but we should not rewrite ScalesConfig often
+    for (size_t i=1; i<m_distsScales.size(); i++)
+    {
+        if (m_distsScales[i].second < m_distsScales[i-1].second)
+        {
+            auto added = std::find(m_distsScales.begin(), m_distsScales.end(),
+                                   std::pair<double, double>(minDistance, averagingScale));
+            m_distsScales.erase(added);
+            throw std::invalid_argument("Averaging scale should not decrease with distance");
+        }
+    }
 }
 
 void DiscreteScales::sortDistsScales()
@@ -560,3 +1674,17 @@ double DiscreteScales::findScale(double distance) const
     }
     return m_distsScales[l].second;
 }
+
+double DiscreteScales::minDistance(double scale) const
+{
+    // Scale of item i is used from its distance up to distance of item i+1,
+    // scale of the first item is used for all smaller distances too
+    double result = std::numeric_limits<double>::infinity();
+    for (size_t i = m_distsScales.size(); i-- > 0; )
+    {
+        if (m_distsScales[i].second < scale)
+            break;
+        result = i == 0 ? -std::numeric_limits<double>::infinity() : m_distsScales[i].first;
+    }
+    return result;
+}
@@ -2,16 +2,25 @@
 #define OCTREE_HPP_INCLUDED
 
 #include "geom-vector.hpp"
+#include "thread-pool.hpp"
+#include "morton.hpp"
+#include "memory.hpp"
+#include "traversal-stats.hpp"
 
 #include <ostream>
 #include <functional>
 #include <vector>
 #include <list>
+#include <unordered_map>
 
 #include <memory>
+#include <mutex>
 #include <cmath>
 #include <algorithm>
 #include <iostream>
+#include <type_traits>
+#include <utility>
+#include <string>
 
 namespace octree {
 
@@ -72,6 +81,27 @@ struct DistToNode
     double nearest = 0.0, farest = 0.0;
 };
 
+/**
+ * @brief Higher order moments of node elements values relative to node mass center
+ */
+struct Multipoles
+{
+    /// Sum of value * r, where r is element position relative to mass center
+    Position dipole;
+    /// Traceless quadrupole sum of value * (3 r_i r_j - r^2 delta_ij), components xx, yy, zz, xy, xz, yz
+    double quadrupole[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+};
+
+/**
+ * @brief Deleter returning node memory to the node pool of its octree
+ */
+struct NodeDeleter
+{
+    void operator()(Node* node) const;
+};
+
+using NodePtr = std::unique_ptr<Node, NodeDeleter>;
+
 /**
  * @brief The octree Node class.
  * Node has 3 states:
@@ -82,23 +112,64 @@ struct DistToNode
 class Node
 {
 friend class Octree;
+friend struct NodeDeleter;
 public:
     Node(Octree* octree, SubdivisionPos subdivision, Node* parent);
     Node(Octree* octree, Position center, double size);
     void addElement(std::shared_ptr<Element> e);
 
-    size_t elementsCount() const;
+    /**
+     * @brief Count of elements in subtree, it is stored in node
+     */
+    size_t elementsCount() const { return m_elementsCount; }
+
+    /**
+     * @brief Node is leaf if it is empty or holds element by itself
+     */
+    bool isLeaf() const { return !hasSubnodes; }
 
     /**
-     * @brief Returns minimal and maximal distance to node (to its corners)
+     * @brief Returns minimal and maximal distance to node (to its box)
      * @param pos Point that distance should be calculated from
      * @return
      */
     DistToNode getDistsToNode(Position pos) const;
 
+    /**
+     * @brief Squared nearest and farest distances from point to boxes of all 8 subnode
+     * positions at once, see childrenSquaredDists(). Missing subnodes are counted too
+     * @param nearest Array of 8 distances, item i is for subnodes[i]
+     * @param farest  Array of 8 distances
+     */
+    void getSubnodesSquaredDists(const Position& pos, double* nearest, double* farest) const;
+
     double getMinDist(const Position& pos) const;
 
-    double getDistToCenter(const Position& pos) const;
+    double getDistToCenter(const Position& pos) const
+    {
+        return pos.distTo(center);
+    }
+
+    /**
+     * @brief Squared distance from point to node box, or to element if node holds it
+     */
+    double getSquaredDistToBox(const Position& pos) const
+    {
+        if (element != nullptr)
+        {
+            Position d = element->pos - pos;
+            return d * d;
+        }
+        double hs = size * 0.5;
+        double result = 0.0;
+        for (int i=0; i<3; i++)
+        {
+            double outside = std::fabs(pos.x[i] - center.x[i]) - hs;
+            if (outside > 0.0)
+                result += outside * outside;
+        }
+        return result;
+    }
 
 	/**
 	* @brief Checks if some point is inside this cell
@@ -120,13 +191,31 @@ public:
 
     Position massCenter;
     double mass;
+    /// Sum of absolute values of elements, bounds errors of mass center approximation
+    double absMass;
 
-    std::unique_ptr<Node> subnodes[8];
+    /// Calculated only if Octree::multipolesEnabled()
+    Multipoles multipoles;
+
+    NodePtr subnodes[8];
 
     void updateMassCenterReqursiveUp();
     void updateMassCenterReqursiveDown();
     void updateMassCenter();
 
+    /**
+     * @brief Mark aggregates of this node and its parents as outdated.
+     * Dirty parents are not visited, because their parents are dirty already
+     */
+    void markDirty();
+
+    /**
+     * @brief Recalculate aggregates of dirty nodes of subtree, clean subtrees are skipped
+     */
+    void updateDirty();
+
+    bool isDirty() const { return m_dirty; }
+
     /**
      * @brief Put all non-zero const pointers to subnodes into container
      * @param container Any container supporting push_back method
@@ -160,51 +249,416 @@ public:
     }
 
 private:
+    void updateMultipoles();
+
     int subdivisionLevel = 0;
     bool hasSubnodes = false;
     Node* parent = nullptr;
 
     void giveElementToSubnodes(std::shared_ptr<Element> e);
-    void calculateCorners();
     void updateDiameter();
 
     Octree* m_octree = nullptr;
-    Position m_corners[8];
+    size_t m_elementsCount = 0;
+    /// Mass center and other aggregates of subtree are outdated
+    bool m_dirty = false;
 };
 
+/**
+ * @brief Octree of elements.
+ * Nodes are allocated from slabs of octree's node pool, so clear() releases
+ * all nodes memory at once
+ */
 class Octree
 {
+friend class Node;
+friend struct NodeDeleter;
 public:
 	Octree(double initialSize = 1.0);
 	Octree(Position center, double initialSize = 1.0);
+    ~Octree();
+
+    /**
+     * @brief Nodes are moved together with pool that holds them, every node
+     * gets new owner by one walk. Moved octree becomes empty as after clear()
+     */
+    Octree(Octree&& other);
+    Octree& operator=(Octree&& other);
+
+    /**
+     * @brief Remove all elements. Nodes are destroyed by one walk and their memory
+     * is freed with all slabs of node pool at once
+     */
     void clear();
     bool empty() const;
     void add(std::shared_ptr<Element> e);
+
+    /**
+     * @brief Add elements by threads of pool, existing elements are kept.
+     * Elements are grouped by cells of upper levels of tree, then every group is
+     * inserted into its own subtree by one thread, so threads do not share nodes
+     * and take new nodes from their own caches of node pool. Aggregates are not
+     * updated by insertions, changed nodes are recalculated in one pass at the end
+     * if center mass calculation is not muted.
+     * If some elements are at one place with other ones, all other elements are
+     * added and std::runtime_error is thrown
+     * @param elements  Elements to add
+     * @param pool      Threads to use, ThreadPool::defaultPool() if nullptr
+     */
+    void addMany(const std::vector<std::shared_ptr<Element>>& elements, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Replace octree content by elements. Elements are sorted by Morton key
+     * in parallel, then hierarchy with mass centers is built in one pass
+     * @param elements  Elements to put into the tree
+     * @param pool      Threads to use, ThreadPool::defaultPool() if nullptr
+     */
+    void build(const std::vector<std::shared_ptr<Element>>& elements, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Replace octree content by ElementValue objects created for every point.
+     * Elements are allocated from arenas shared by elements, so there are no
+     * separate heap allocations for every point
+     * @param positions Points positions
+     * @param values    Points values or nullptr to use zeros
+     * @param count     Points count
+     * @param pool      Threads to use, ThreadPool::defaultPool() if nullptr
+     */
+    void build(const Position* positions, const double* values, size_t count, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Relocate elements which positions left cells of their leaves. Aggregates are
+     * recalculated once for changed subtrees after all elements are processed.
+     * Throws std::runtime_error like add() if moved element coincides with another one,
+     * such element is not in the octree anymore
+     */
 	void update();
+
+    /**
+     * @brief Relocate one element after its position or value was changed. Element goes up
+     * to the lowest node containing its new position and down to a new leaf, nodes that
+     * became empty are deleted. Aggregates are updated only along old and new paths.
+     * If other element has the same position, std::runtime_error is thrown and element
+     * stays in its old leaf, so it should be moved and updated again
+     * @return true if element was moved to other leaf, false if it was not or element
+     * does not belong to this octree
+     */
+    bool update(Element& element);
+
+    /**
+     * @brief Remove element from octree. Empty nodes are deleted and subtree that holds
+     * only one element is collapsed to one leaf, released nodes are reused by next insertions.
+     * Aggregates are updated only along the path of element
+     * @return false if element does not belong to this octree
+     */
+    bool remove(Element& element);
 	size_t count();
 	
 	void dbgOutCoords(std::ostream& s);
 
+    /**
+     * @brief Save octree as LinearOctree snapshot, see LinearOctree::save().
+     * Snapshot may be mapped by LinearOctree::load() and queried without rebuilding
+     */
+    void save(const std::string& path) const;
+
+    /**
+     * @brief Replace content by ElementValue objects for elements of snapshot written by
+     * save() or LinearOctree::save(). Elements keep order of source indexes of snapshot.
+     * Octree is rebuilt by build(), use LinearOctree::load() to query snapshot without it
+     */
+    void load(const std::string& path, ThreadPool* pool = nullptr);
+
     const Element& getNearest(Position pos);
+
+    /**
+     * @brief The same as getNearest(pos), counters of tree traversal are added to stats
+     */
+    const Element& getNearest(Position pos, TraversalStats& stats);
+
+    /**
+     * @brief Find k elements that are nearest to point. Nodes are visited best-first
+     * by distance to their boxes, so only nodes that may contain one of k nearest are opened
+     * @param result  Elements sorted by distance, less than k if octree has not enough elements
+     * @param pos     Point to search from
+     * @param k       Count of elements to find
+     * @param epsilon Approximation factor: i-th found element is not farther
+     *                than (1 + epsilon) * distance to real i-th nearest
+     */
+    void getKNearest(std::vector<const Element*>& result, const Position& pos, size_t k, double epsilon = 0.0) const;
+    void getKNearest(std::vector<const Element*>& result, const Position& pos, size_t k, double epsilon,
+                     TraversalStats& stats) const;
+
+    /**
+     * @brief Find nearest elements for many points in parallel.
+     * Points are processed in Morton order, so octree should not be modified during call
+     * @param points  Query points
+     * @param count   Count of points
+     * @param result  Array of count pointers to nearest elements
+     * @param pool    Threads to use, ThreadPool::defaultPool() if nullptr
+     */
+    void getNearestMany(const Position* points, size_t count, const Element** result, ThreadPool* pool = nullptr) const;
     void getClose(std::vector<Element*>& target, const Position& pos, double dist) const;
+
+    /**
+     * @brief The same as getClose(), counters of tree traversal are added to stats
+     */
+    void getClose(std::vector<Element*>& target, const Position& pos, double dist, TraversalStats& stats) const;
+
+    /**
+     * @brief Call visitor for every element that is not farer than dist from pos.
+     * Nothing is stored, so it may be used for reductions over neighbours
+     * @param visitor Callable bool(Element*), returning false stops the search
+     * @return false if search was stopped by visitor
+     */
+    template<typename Visitor>
+    bool getClose(const Position& pos, double dist, const Visitor& visitor) const
+    {
+        if (empty())
+            return true;
+        return visitClose(*m_root, pos, dist, visitor);
+    }
+
+    /**
+     * @brief Count elements that are not farer than dist from pos.
+     * Nodes that are completely inside the sphere are counted without visiting their elements
+     */
+    size_t countClose(const Position& pos, double dist) const;
+
+    /**
+     * @brief Sum of values of elements that are not farer than dist from pos.
+     * Masses of nodes are used for nodes that are completely inside the sphere,
+     * outdated masses are recalculated first, see updateDirtyNodes()
+     */
+    double sumClose(const Position& pos, double dist) const;
+
+    /**
+     * @brief Find close elements for many points in parallel
+     * @param points   Query points
+     * @param radii    Search radius for every point
+     * @param count    Count of points
+     * @param offsets  Filled by count + 1 offsets, elements close to points[i] are
+     *                 elements[offsets[i]] .. elements[offsets[i+1] - 1]
+     * @param elements Filled by close elements of all points
+     * @param pool     Threads to use, ThreadPool::defaultPool() if nullptr
+     */
+    void getCloseMany(const Position* points, const double* radii, size_t count,
+                      std::vector<size_t>& offsets, std::vector<Element*>& elements, ThreadPool* pool = nullptr) const;
 	
+    /**
+     * @brief Root node. Aggregates of nodes are not recalculated, so they are outdated
+     * after changes made while center mass calculation was muted until updateDirtyNodes()
+     */
     const Node& root() const;
     double mass();
     const Position& massCenter();
 
+    /**
+     * @brief Center mass calculation may be muted while many elements are added.
+     * Muted octree marks changed nodes as dirty and recalculates only them
+     * on unmute, on updateDirtyNodes() or on next reading of aggregates by mass(),
+     * massCenter(), sumClose() or convolutions
+     */
     bool centerMassUpdatingEnabled() const;
     void muteCenterMassCalculation();
     void unmuteCenterMassCalculation();
 
+    /**
+     * @brief Recalculate aggregates of nodes that were changed while center mass calculation was muted.
+     * Large trees are updated by threads, see updateAggregates(). It does not write to up to date
+     * tree. Updates are serialized, so convolutions may run concurrently on the same const tree.
+     * Queries that do not read aggregates, like root() or getClose(), do not update them, so changed
+     * tree should be updated before it is shared with them
+     * @param pool Threads to use, ThreadPool::defaultPool() if nullptr
+     */
+    void updateDirtyNodes(ThreadPool* pool = nullptr) const;
+
+    /**
+     * @brief Notify octree that element value was changed. Aggregates are updated
+     * immediately or marked dirty if center mass calculation is muted
+     */
+    void elementChanged(const Element& element);
+
+    /**
+     * @brief Enable dipole and quadrupole moments calculation in nodes together with mass centers.
+     * Moments of existing nodes are calculated immediately if center mass updating is not muted
+     */
+    void setMultipolesEnabled(bool enabled);
+    bool multipolesEnabled() const;
+
+    /**
+     * @brief Sum of kernel over elements of leaf node, used by convolution when leaf is too
+     * large to be averaged. Leaf of Octree holds not more than one element
+     */
+    template<typename ResultType, typename Kernel>
+    ResultType directSum(const Node& leaf, const Position& target, const Kernel& kernel) const
+    {
+        if (leaf.element == nullptr)
+            return ResultType();
+        return kernel(target, leaf.element->pos, leaf.element->value);
+    }
+
 private:
+    void releaseNodes();
+    static void destroySubtree(Node* node);
+    void takeNodes(Octree& other);
+    void adoptSubtree(Node* node);
+    void createRoot(const Position& firstPos);
 	void enlargeSpaceIteration(const Position& p);
 	bool isPointInsideRoot(const Position& p);
 
-    std::unique_ptr<Node> m_root;
+    /**
+     * @brief Take element away from leaf. Counts are decreased from leaf up to stop node
+     * or up to root if stop is nullptr, nodes that became empty are deleted except stop and root
+     * @return The lowest node of path that was not deleted
+     */
+    Node* detachElement(Node* leaf, Node* stop);
+
+    /**
+     * @brief Move single element of subtree up to the highest ancestor of node that holds
+     * only this element, so there are no chains of nodes with one element
+     * @return Node that holds element after collapsing or node itself
+     */
+    Node* collapse(Node* node);
+
+    /**
+     * @brief Recalculate aggregates of all nodes or of dirty ones. Subtrees not larger than
+     * cutoff are updated by tasks of pool, nodes above them are updated serially bottom-up
+     * after that. Every node is calculated from its subnodes as serial pass does, so result
+     * does not depend on threads count
+     */
+    void updateAggregates(bool allNodes, ThreadPool& pool) const;
+    static void splitForAggregates(Node* node, bool allNodes, size_t cutoff,
+                                   std::vector<Node*>& splitted, std::vector<Node*>& tasks);
+
+    /**
+     * @brief Create internal nodes from root down to cell of given depth, see addMany()
+     * @param cell  Cell index, every level adds 3 bits of subnode index
+     * @return Node of cell
+     */
+    Node* createCellPath(size_t cell, int depth);
+
+    /**
+     * @brief Delete empty nodes and collapse nodes with one element in levels of
+     * subtree not deeper than depth. They are left by failed insertions of addMany()
+     */
+    void repairUpperLevels(Node* node, int depth);
+
+    struct BuildTask
+    {
+        Node* node;
+        std::shared_ptr<Element>* elements;
+        size_t count;
+    };
+
+    void createBuildRoot(const Position& boxMin, const Position& boxMax);
+    void buildSorted(std::vector<std::shared_ptr<Element>>& sorted, ThreadPool& pool);
+    void splitForBuild(Node* node, std::shared_ptr<Element>* elements, size_t count, size_t cutoff,
+                       std::vector<Node*>& splitted, std::vector<BuildTask>& tasks);
+    void buildSubtree(Node* node, std::shared_ptr<Element>* elements, size_t count);
+    void createSubnodesForBuild(Node* node, std::shared_ptr<Element>* elements, size_t count, size_t bounds[9]);
+
+    template<typename Stats>
+    void getClose(std::vector<Element*>& target, const Position& pos, double dist,
+                  std::vector<const Node*>& nodesVector, Stats& stats) const;
+
+    template<typename Stats>
+    void findKNearest(std::vector<const Element*>& result, const Position& pos, size_t k, double epsilon,
+                      Stats& stats) const;
+
+    template<typename Visitor>
+    static bool visitClose(const Node& node, const Position& pos, double dist, const Visitor& visitor)
+    {
+        DistToNode nodeDist = node.getDistsToNode(pos);
+        if (nodeDist.nearest > dist)
+            return true;
+        if (nodeDist.farest <= dist)
+            return visitAll(node, visitor);
+        return visitCloseSubnodes(node, pos, dist * dist, visitor);
+    }
+
+    /**
+     * @brief The same as visitClose() for subnodes of node that is partially close,
+     * distances to all subnodes are calculated at once
+     * @param squaredDist Squared search radius
+     */
+    template<typename Visitor>
+    static bool visitCloseSubnodes(const Node& node, const Position& pos, double squaredDist, const Visitor& visitor)
+    {
+        double nearest[8], farest[8];
+        node.getSubnodesSquaredDists(pos, nearest, farest);
+        for (int i=0; i<8; i++)
+        {
+            const Node* subnode = node.subnodes[i].get();
+            if (subnode == nullptr || nearest[i] > squaredDist)
+                continue;
+            if (subnode->element != nullptr)
+            {
+                // Element is checked by its position instead of its box
+                Position d = subnode->element->pos - pos;
+                if (d * d <= squaredDist && !visitor(subnode->element.get()))
+                    return false;
+            } else if (farest[i] <= squaredDist) {
+                if (!visitAll(*subnode, visitor))
+                    return false;
+            } else if (!visitCloseSubnodes(*subnode, pos, squaredDist, visitor)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template<typename Visitor>
+    static bool visitAll(const Node& node, const Visitor& visitor)
+    {
+        if (node.element != nullptr)
+            return visitor(node.element.get());
+        for (int i=0; i<8; i++)
+        {
+            const Node* subnode = node.subnodes[i].get();
+            if (subnode != nullptr && !visitAll(*subnode, visitor))
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Sum of nodeValue(node) for nodes that are completely close and for elements of other close nodes
+     */
+    template<typename T, typename NodeValue>
+    T reduceClose(const Node& node, const Position& pos, double dist, const NodeValue& nodeValue) const;
+    template<typename T, typename NodeValue>
+    T reduceCloseSubnodes(const Node& node, const Position& pos, double squaredDist, const NodeValue& nodeValue) const;
+
+    template<typename... Args>
+    NodePtr createNode(Args&&... args)
+    {
+        void* memory = allocateNode();
+        try {
+            return NodePtr(new (memory) Node(std::forward<Args>(args)...));
+        } catch (...) {
+            m_nodePool.release(memory);
+            throw;
+        }
+    }
+
+    /**
+     * @brief Take node memory from cache of current addMany() worker or from pool
+     */
+    void* allocateNode();
+
+    // Pool is declared before nodes, so it is destroyed after them
+    FixedSizePool m_nodePool{sizeof(Node)};
+    NodePtr m_root;
 	Position m_center;
 	double m_initialSize;
 	bool m_centerIsSet;
     bool m_centerMassUpdatingEnabled = true;
+    bool m_multipolesEnabled = false;
+    /// Multipoles were enabled while center mass calculation was muted, so every node should be updated
+    mutable bool m_allNodesDirty = false;
+    /// Serializes updateDirtyNodes() of concurrent const readers
+    mutable std::mutex m_aggregatesMutex;
 };
 
 /**
@@ -223,18 +677,65 @@ private:
     Octree& m_octree;
 };
 
+/**
+ * @brief Averaging scale allowed at given distance from target.
+ * Scale should not decrease when distance grows: convolutions accept nodes
+ * by per-level distance thresholds found by minDistance(), so for scales
+ * that decrease somewhere results are not the same as by findScale() for every node
+ */
 class IScalesConfig
 {
 public:
+    IScalesConfig() {}
+    /// Cache of minDistance() is not copied
+    IScalesConfig(const IScalesConfig&) {}
+    IScalesConfig& operator=(const IScalesConfig&);
     virtual ~IScalesConfig() {}
     virtual double findScale(double distance) const = 0;
+
+    /**
+     * @brief Minimal distance starting from which findScale() is not less than scale.
+     * Convolution calls it once per tree level instead of calling findScale() for every node.
+     * Default implementation finds distance by bisection, negative distances are not checked.
+     * Its results are cached, so levels of the same tree cost bisection only once
+     * @return Distance or infinity if scale is never reached
+     */
+    virtual double minDistance(double scale) const;
+
+protected:
+    /**
+     * @brief Drop cached results of default minDistance(). Subclass that uses it
+     * should call this method when its scales are changed
+     */
+    void scalesChanged();
+
+private:
+    /// Cached distances are dropped when there are more of them, so sizes of many trees do not grow cache
+    constexpr static size_t maxCachedDistances = 1024;
+
+    double findMinDistance(double scale) const;
+
+    mutable std::mutex m_cacheMutex;
+    mutable std::unordered_map<double, double> m_minDistances;
 };
 
-class LinearScales : public IScalesConfig
+/**
+ * @brief Scale proportional to distance. Class is final and findScale() is inline,
+ * so calls by LinearScales reference are not virtual, see StaticConvolution
+ */
+class LinearScales final : public IScalesConfig
 {
 public:
     LinearScales(double k=0.5);
-    double findScale(double distance) const override;
+    double findScale(double distance) const override
+    {
+        if (distance < 0.0)
+            return 0.0;
+        return distance*m_k;
+    }
+
+    double minDistance(double scale) const override;
+
 private:
     double m_k;
 };
@@ -243,12 +744,14 @@ private:
  * @brief The ScalesConfig class stores averaging scales and
  * corresponding minimal distances
  */
-class DiscreteScales : public IScalesConfig
+class DiscreteScales final : public IScalesConfig
 {
 public:
     DiscreteScales();
     /**
-     * @brief addScale Allow averaging with scale averagingScale when objects are farer than minDistance
+     * @brief addScale Allow averaging with scale averagingScale when objects are farer than minDistance.
+     * Scales should not decrease with distance, see IScalesConfig, otherwise std::invalid_argument
+     * is thrown and scales are not changed
      * @param minDistance Minimal distance that alow this averaging
      * @param averagingScale Space size of blocks where objects masses may be averaged
      */
@@ -256,11 +759,255 @@ public:
 
     double findScale(double distance) const override;
 
+    double minDistance(double scale) const override;
+
 private:
     void sortDistsScales();
     std::vector<std::pair<double, double>> m_distsScales;
 };
 
+namespace details {
+
+/**
+ * @brief Recalculate aggregates of Octree changed while center mass calculation was muted
+ * before convolution uses them. Aggregates of other trees are always up to date
+ */
+inline void refreshAggregates(const Octree& oct, ThreadPool* pool = nullptr)
+{
+    oct.updateDirtyNodes(pool);
+}
+
+template<typename OctreeType>
+void refreshAggregates(const OctreeType&, ThreadPool* = nullptr)
+{
+}
+
+/**
+ * @brief Checks if Kernel has method for sum over arrays of elements coordinates and values
+ */
+template<typename Kernel>
+struct HasDirectSum
+{
+    template<typename K>
+    static auto test(int) -> decltype(std::declval<const K&>().directSum(Position(), nullptr, nullptr, nullptr, nullptr, size_t()), std::true_type());
+    template<typename K>
+    static std::false_type test(...);
+
+    constexpr static bool value = decltype(test<Kernel>(0))::value;
+};
+
+/**
+ * @brief Sum of kernel for elements given as structure of arrays. Kernel::directSum()
+ * is used if kernel has it, so kernel may provide vectorized implementation
+ */
+template<typename ResultType, typename Kernel>
+typename std::enable_if<HasDirectSum<Kernel>::value, ResultType>::type
+directSum(const Kernel& kernel, const Position& target, const double* x, const double* y, const double* z,
+          const double* values, size_t count)
+{
+    return kernel.directSum(target, x, y, z, values, count);
+}
+
+template<typename ResultType, typename Kernel>
+typename std::enable_if<!HasDirectSum<Kernel>::value, ResultType>::type
+directSum(const Kernel& kernel, const Position& target, const double* x, const double* y, const double* z,
+          const double* values, size_t count)
+{
+    ResultType result = ResultType();
+    for (size_t i=0; i<count; i++)
+        result += kernel(target, Position(x[i], y[i], z[i]), values[i]);
+    return result;
+}
+
+/**
+ * @brief Acceptance thresholds of nodes by their level. Node of level has diameter
+ * dia = root dia / 2^level and it is accepted when dia <= findScale(distance to center - dia / 2),
+ * that is when squared distance to its center is not less than squaredDistance(level).
+ * Thresholds are calculated by ScalesType::minDistance() when they are requested
+ */
+template<typename ScalesType>
+class LevelThresholds
+{
+public:
+    LevelThresholds(const ScalesType& scales, double rootSize) :
+        m_scales(scales),
+        m_rootDia(rootSize * sqrt(3.0))
+    {
+    }
+
+    double squaredDistance(int level) const
+    {
+        double dia = std::ldexp(m_rootDia, -level);
+        double dist = m_scales.minDistance(dia) + dia * 0.5;
+        return dist > 0.0 ? dist * dist : 0.0;
+    }
+
+private:
+    const ScalesType& m_scales;
+    double m_rootDia;
+};
+
+/**
+ * @brief Thresholds calculated at once for many traversals. Levels deeper than maxLevels
+ * use threshold of the last level, which is not less than theirs
+ */
+class ThresholdsTable
+{
+public:
+    constexpr static int maxLevels = 64;
+
+    template<typename Thresholds>
+    explicit ThresholdsTable(const Thresholds& thresholds)
+    {
+        for (int i=0; i<maxLevels; i++)
+            m_squaredDistances[i] = thresholds.squaredDistance(i);
+    }
+
+    double squaredDistance(int level) const
+    {
+        return m_squaredDistances[level < maxLevels ? level : maxLevels - 1];
+    }
+
+private:
+    double m_squaredDistances[maxLevels];
+};
+
+/**
+ * @brief Traverse tree from root and sum contributions of nodes that are far enough
+ * for their level. Leafs that are too close are passed to visitNode.openLeaf()
+ * @param thresholds LevelThresholds or ThresholdsTable
+ * @param visitNode  Object with methods (target, node) giving contribution of node into result:
+ *                   operator() for averaged node and openLeaf() for leaf that should be summed directly
+ * @param stats      NoStats or TraversalStats
+ */
+template<typename ResultType, typename Thresholds, typename NodeType, typename NodeVisitor, typename Stats>
+ResultType convoluteByLevels(const Thresholds& thresholds, const NodeType* root, const Position& target,
+                             const NodeVisitor& visitNode, std::vector<const NodeType*>& nodesVector, Stats& stats)
+{
+    ResultType result = ResultType();
+    nodesVector.clear();
+    nodesVector.push_back(root);
+    stats.start();
+    // Subnodes are appended to the end, so nodes of one level are a continuous range of nodesVector
+    int level = -1;
+    size_t levelEnd = 0;
+    double threshold = 0.0;
+    for (size_t i=0; i != nodesVector.size(); i++)
+    {
+        if (i == levelEnd)
+        {
+            level++;
+            levelEnd = nodesVector.size();
+            threshold = thresholds.squaredDistance(level);
+        }
+        const NodeType *n = nodesVector[i];
+        stats.visitQueued(i, nodesVector.size());
+
+        // Node is approximated by a sphere, so distance is compared with threshold of its level
+        Position d = n->center - target;
+        if (d * d >= threshold)
+        {
+            // We can use averaging over this node
+            stats.accept();
+            result += visitNode(target, n);
+        } else if (n->isLeaf()) {
+            if (n->dia == 0.0)
+            {
+                // Leaf with single element has no size, so it is accepted at any distance
+                stats.accept();
+                result += visitNode(target, n);
+            } else {
+                // Leaf with several elements is near, so they are summed one by one
+                stats.leaf();
+                result += visitNode.openLeaf(target, n);
+            }
+        } else {
+            // Node is too large, so we should devide it
+            n->pushBackSubnodes(nodesVector);
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Traverse tree from root and sum contributions of nodes that are small enough.
+ * Leafs that are too large are passed to visitNode.openLeaf()
+ * @param scales    IScalesConfig or its final subclass, so minDistance() may be inlined
+ * @param visitNode Object with methods (target, node) giving contribution of node into result:
+ *                  operator() for averaged node and openLeaf() for leaf that should be summed directly
+ * @param stats     NoStats or TraversalStats
+ */
+template<typename ResultType, typename ScalesType, typename NodeType, typename NodeVisitor, typename Stats>
+ResultType convoluteNodes(const ScalesType& scales, const NodeType* root, const Position& target,
+                          const NodeVisitor& visitNode, std::vector<const NodeType*>& nodesVector, Stats& stats)
+{
+    LevelThresholds<ScalesType> thresholds(scales, root->size);
+    return convoluteByLevels<ResultType>(thresholds, root, target, visitNode, nodesVector, stats);
+}
+
+template<typename ResultType, typename ScalesType, typename NodeType, typename NodeVisitor>
+ResultType convoluteNodes(const ScalesType& scales, const NodeType* root, const Position& target,
+                          const NodeVisitor& visitNode, std::vector<const NodeType*>& nodesVector)
+{
+    NoStats stats;
+    return convoluteNodes<ResultType>(scales, root, target, visitNode, nodesVector, stats);
+}
+
+/**
+ * @brief Run convoluteNodes() for many targets in parallel in Morton order of targets
+ */
+template<typename ResultType, typename ScalesType, typename NodeType, typename NodeVisitor>
+void convoluteMany(const ScalesType& scales, ThreadPool& pool, const NodeType* root,
+                   const Position* targets, size_t count, ResultType* results, const NodeVisitor& visitNode)
+{
+    MortonGrid grid(root->center, root->size);
+    std::vector<MortonKey> order(count);
+    for (size_t i=0; i<count; i++)
+        order[i] = MortonKey(grid.key(targets[i]), i);
+    sortMortonKeys(order, pool);
+
+    // Thresholds are the same for all targets
+    ThresholdsTable thresholds(LevelThresholds<ScalesType>(scales, root->size));
+    std::vector<std::vector<const NodeType*>> buffers(pool.threadsCount());
+    pool.parallelFor(count, 64,
+        [&thresholds, root, targets, results, &order, &buffers, &visitNode](unsigned worker, size_t begin, size_t end)
+        {
+            std::vector<const NodeType*>& nodesVector = buffers[worker];
+            nodesVector.reserve(200);
+            NoStats stats;
+            for (size_t i=begin; i<end; i++)
+            {
+                size_t index = order[i].second;
+                results[index] = convoluteByLevels<ResultType>(thresholds, root, targets[index], visitNode, nodesVector, stats);
+            }
+        }
+    );
+}
+
+/**
+ * @brief Node visitor calling kernel (target, mass center, mass)
+ */
+template<typename ResultType, typename Kernel, typename OctreeType>
+struct MassVisitor
+{
+    template<typename NodeType>
+    ResultType operator()(const Position& target, const NodeType* n) const
+    {
+        return kernel(target, n->massCenter, n->mass);
+    }
+
+    template<typename NodeType>
+    ResultType openLeaf(const Position& target, const NodeType* n) const
+    {
+        return tree.template directSum<ResultType>(*n, target, kernel);
+    }
+
+    const Kernel& kernel;
+    const OctreeType& tree;
+};
+
+}
+
 template<typename ResultType = double>
 class Convolution
 {
@@ -275,45 +1022,216 @@ public:
     /**
      * @brief Calculate convolution by whole octree without exclusions
      * Algorythm is upgraded. No isInside check used
-     * @param oct       Octree
+     * @param oct       Octree or LinearOctree
      * @param target    Point where to calculate
      * @param v         Visitor function
      * @return Result of convolution
      */
-    ResultType convolute(const Octree& oct, const Position& target, Visitor v)
+    template<typename OctreeType>
+    ResultType convolute(const OctreeType& oct, const Position& target, Visitor v)
     {
+        NoStats stats;
+        return convolute(oct, target, v, stats);
+    }
+
+    /**
+     * @brief The same as convolute(), counters of tree traversal are added to stats
+     * @param stats NoStats or TraversalStats, for example TraversalStats::threadLocal()
+     */
+    template<typename OctreeType, typename Stats>
+    ResultType convolute(const OctreeType& oct, const Position& target, Visitor v, Stats& stats)
+    {
+        using NodeType = typename std::decay<decltype(oct.root())>::type;
         // Vector is used instead of list to prevent new/deletes for single pointers
+        std::vector<const NodeType*> nodesVector;
+        nodesVector.reserve(200);
+        if (oct.empty())
+            return ResultType();
+        details::refreshAggregates(oct);
+        return convoluteNodes(&oct.root(), target, MassVisitor<OctreeType>{v, oct}, nodesVector, stats);
+    }
+
+    /**
+     * @brief Visitor that uses node multipoles in addition to mass and mass center
+     */
+    using MultipoleVisitor = std::function<ResultType(const Position& target, const Position& object, double mass,
+                                                      const Multipoles& multipoles)>;
+
+    /**
+     * @brief Calculate convolution using multipole moments of nodes.
+     * Octree should have Octree::multipolesEnabled()
+     */
+    ResultType convoluteMultipoles(const Octree& oct, const Position& target, MultipoleVisitor v)
+    {
         std::vector<const Node*> nodesVector;
         nodesVector.reserve(200);
-        ResultType result = ResultType();
         if (oct.empty())
-            return result;
+            return ResultType();
+        oct.updateDirtyNodes();
+        return convoluteNodes(&oct.root(), target, MultipolesNodeVisitor{v}, nodesVector);
+    }
 
-        nodesVector.push_back(&oct.root());
-        for (size_t i=0; i != nodesVector.size(); i++)
+    /**
+     * @brief Calculate convolution for many targets in parallel.
+     * Targets are processed in Morton order of their positions, so targets that
+     * are processed together are close to each other and visit the same nodes.
+     * Visitor is called concurrently from different threads.
+     * @param oct       Octree or LinearOctree that is not modified during call
+     * @param targets   Array of points where to calculate
+     * @param count     Count of targets
+     * @param results   Array of count results
+     * @param v         Visitor function
+     */
+    template<typename OctreeType>
+    void convoluteMany(const OctreeType& oct, const Position* targets, size_t count, ResultType* results, Visitor v)
+    {
+        if (oct.empty())
         {
-            const Node *n = nodesVector[i];
-
-            // This variant approximate a cube by a sphere and it is faster,
-            // because it does not contain any ifs and min/max finding
-            double dia = n->dia;
-            double dist = n->getDistToCenter(target) - dia * 0.5;
-            double scale = m_scalesConfig.findScale(dist);
-            if (dia <= scale)
-            {
-                // We can use averaging over this node
-                result += v(target, n->massCenter, n->mass);
-            } else {
-                // Node is too large, so we should devide it
-                n->pushBackSubnodes(nodesVector);
-            }
+            std::fill(results, results + count, ResultType());
+            return;
         }
-        return result;
+        ThreadPool& pool = m_threadPool != nullptr ? *m_threadPool : ThreadPool::defaultPool();
+        // Aggregates are refreshed once before workers read them
+        details::refreshAggregates(oct, &pool);
+        details::convoluteMany(m_scalesConfig, pool, &oct.root(), targets, count, results, MassVisitor<OctreeType>{v, oct});
+    }
+
+    /**
+     * @brief Set threads used by convoluteMany()
+     * @param pool Thread pool or nullptr to use ThreadPool::defaultPool()
+     */
+    void setThreadPool(ThreadPool* pool)
+    {
+        m_threadPool = pool;
     }
 
 private:
+    template<typename OctreeType>
+    using MassVisitor = details::MassVisitor<ResultType, Visitor, OctreeType>;
+
+    struct MultipolesNodeVisitor
+    {
+        ResultType operator()(const Position& target, const Node* n) const
+        {
+            return v(target, n->massCenter, n->mass, n->multipoles);
+        }
+
+        ResultType openLeaf(const Position&, const Node*) const
+        {
+            // Octree leaf that is not accepted is empty
+            return ResultType();
+        }
+
+        const MultipoleVisitor& v;
+    };
+
+    template<typename NodeType, typename NodeVisitor>
+    ResultType convoluteNodes(const NodeType* root, const Position& target, const NodeVisitor& visitNode,
+                              std::vector<const NodeType*>& nodesVector) const
+    {
+        return details::convoluteNodes<ResultType>(m_scalesConfig, root, target, visitNode, nodesVector);
+    }
+
+    template<typename NodeType, typename NodeVisitor, typename Stats>
+    ResultType convoluteNodes(const NodeType* root, const Position& target, const NodeVisitor& visitNode,
+                              std::vector<const NodeType*>& nodesVector, Stats& stats) const
+    {
+        return details::convoluteNodes<ResultType>(m_scalesConfig, root, target, visitNode, nodesVector, stats);
+    }
 
     const IScalesConfig& m_scalesConfig;
+    ThreadPool* m_threadPool = nullptr;
+};
+
+/**
+ * @brief Convolution with kernel and scales policy known at compile time.
+ * Kernel calls are inlined into the traversal loop and ScalesType::minDistance() is
+ * called directly once per tree level, so it is much faster than Convolution for cheap kernels.
+ *
+ * Kernel is a callable object with
+ * ResultType operator()(const Position& target, const Position& object, double mass) const.
+ * Kernel may also have method ResultType directSum(const Position& target, const double* x,
+ * const double* y, const double* z, const double* values, size_t count) const that is used
+ * for leafs with several elements of LinearOctree, see CoulombPotentialKernel.
+ * ScalesType is LinearScales, DiscreteScales or any other class with non-virtual or final minDistance(),
+ * see IScalesConfig::minDistance().
+ */
+template<typename Kernel, typename ScalesType = LinearScales, typename ResultType = double>
+class StaticConvolution
+{
+public:
+    StaticConvolution(const ScalesType& scalesConfig, const Kernel& kernel = Kernel()) :
+        m_scalesConfig(scalesConfig),
+        m_kernel(kernel)
+    {
+    }
+
+    /**
+     * @brief Calculate convolution by whole octree, the same as Convolution::convolute()
+     * @param oct       Octree or LinearOctree
+     * @param target    Point where to calculate
+     */
+    template<typename OctreeType>
+    ResultType convolute(const OctreeType& oct, const Position& target) const
+    {
+        NoStats stats;
+        return convolute(oct, target, stats);
+    }
+
+    /**
+     * @brief The same as convolute(), counters of tree traversal are added to stats
+     * @param stats NoStats or TraversalStats
+     */
+    template<typename OctreeType, typename Stats>
+    ResultType convolute(const OctreeType& oct, const Position& target, Stats& stats) const
+    {
+        using NodeType = typename std::decay<decltype(oct.root())>::type;
+        std::vector<const NodeType*> nodesVector;
+        nodesVector.reserve(200);
+        if (oct.empty())
+            return ResultType();
+        details::refreshAggregates(oct);
+        return details::convoluteNodes<ResultType>(m_scalesConfig, &oct.root(), target, MassVisitor<OctreeType>{m_kernel, oct}, nodesVector, stats);
+    }
+
+    /**
+     * @brief Calculate convolution for many targets in parallel, the same as Convolution::convoluteMany()
+     */
+    template<typename OctreeType>
+    void convoluteMany(const OctreeType& oct, const Position* targets, size_t count, ResultType* results) const
+    {
+        if (oct.empty())
+        {
+            std::fill(results, results + count, ResultType());
+            return;
+        }
+        ThreadPool& pool = m_threadPool != nullptr ? *m_threadPool : ThreadPool::defaultPool();
+        // Aggregates are refreshed once before workers read them
+        details::refreshAggregates(oct, &pool);
+        details::convoluteMany(m_scalesConfig, pool, &oct.root(), targets, count, results, MassVisitor<OctreeType>{m_kernel, oct});
+    }
+
+    /**
+     * @brief Set threads used by convoluteMany()
+     * @param pool Thread pool or nullptr to use ThreadPool::defaultPool()
+     */
+    void setThreadPool(ThreadPool* pool)
+    {
+        m_threadPool = pool;
+    }
+
+    const Kernel& kernel() const
+    {
+        return m_kernel;
+    }
+
+private:
+    template<typename OctreeType>
+    using MassVisitor = details::MassVisitor<ResultType, Kernel, OctreeType>;
+
+    const ScalesType& m_scalesConfig;
+    Kernel m_kernel;
+    ThreadPool* m_threadPool = nullptr;
 };
 
 }
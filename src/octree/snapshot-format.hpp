@@ -0,0 +1,48 @@
+#ifndef OCTREE_SNAPSHOT_FORMAT_HPP_INCLUDED
+#define OCTREE_SNAPSHOT_FORMAT_HPP_INCLUDED
+
+#include <cstdint>
+
+namespace octree {
+
+namespace details {
+
+/**
+ * @brief Layout of LinearOctree snapshot file. It is written by LinearOctree::save() and
+ * StreamingBuilder and is mapped by LinearOctree::load()
+ */
+const char snapshotMagic[8] = {'O', 'C', 'T', 'L', 'I', 'N', 'E', 'A'};
+const uint32_t snapshotVersion = 2;
+const uint32_t byteOrderMark = 0x01020304;
+const uint64_t tableAlignment = 64;
+
+/**
+ * @brief Header of snapshot file. Tables offsets are counted from file beginning,
+ * tables may follow header in any order
+ */
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t nodeSize;
+    uint32_t reserved;
+    uint64_t fileSize;
+    uint64_t nodesCount;
+    uint64_t elementsCount;
+    uint64_t nodesOffset;
+    uint64_t coordinatesOffset[3];
+    uint64_t valuesOffset;
+    uint64_t sourceIndexesOffset;
+};
+
+inline uint64_t alignTable(uint64_t offset)
+{
+    return (offset + tableAlignment - 1) / tableAlignment * tableAlignment;
+}
+
+}
+
+}
+
+#endif // OCTREE_SNAPSHOT_FORMAT_HPP_INCLUDED
@@ -0,0 +1,326 @@
+#include "streaming-builder.hpp"
+#include "snapshot-format.hpp"
+
+#include <stdexcept>
+#include <limits>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+
+#include <unistd.h>
+
+using namespace octree;
+using namespace octree::details;
+
+namespace {
+
+/// Estimation of memory that cell built in memory takes per point: records, keys, element tables and nodes
+const size_t bytesPerPoint = 256;
+/// Count of records read from file at once
+const size_t chunkSize = 1 << 16;
+/// Number of build() in this process, used in names of temporary files
+std::atomic<uint64_t> buildsCount{0};
+
+}
+
+StreamingBuilder::StreamingBuilder(size_t memoryBudget, const std::string& tempDirectory, uint32_t bucketSize) :
+    m_memoryBudget(memoryBudget),
+    m_tempDirectory(tempDirectory),
+    m_bucketSize(bucketSize == 0 ? 1 : bucketSize)
+{
+}
+
+void StreamingBuilder::build(const std::string& inputPath, const std::string& outputPath, ThreadPool* pool)
+{
+    m_pool = pool;
+    m_cellsCount = 0;
+    // Builders may share temporary directory, so files of each build have unique prefix
+    m_tempPrefix = m_tempDirectory + "/octree-" + std::to_string(getpid()) + "-" + std::to_string(buildsCount++);
+    CellFile input{inputPath, true};
+
+    uint64_t count = 0;
+    Position boxMin, boxMax;
+    readRecords(input,
+        [&count, &boxMin, &boxMax](const Record* records, size_t n)
+        {
+            for (size_t i=0; i<n; i++)
+            {
+                Position p(records[i].x[0], records[i].x[1], records[i].x[2]);
+                if (count == 0 && i == 0)
+                    boxMin = boxMax = p;
+                for (int j=0; j<3; j++)
+                {
+                    boxMin.x[j] = std::min(boxMin.x[j], p.x[j]);
+                    boxMax.x[j] = std::max(boxMax.x[j], p.x[j]);
+                }
+            }
+            count += n;
+        }
+    );
+    if (count == 0)
+    {
+        LinearOctree().save(outputPath);
+        return;
+    }
+    if (count > std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("Too many points for linear representation");
+
+    // Root box is the same as LinearOctree::build() takes
+    LinearNode root{};
+    root.center = (boxMin + boxMax) * 0.5;
+    root.size = LinearOctree::rootSize(boxMin, boxMax);
+    root.childrenOffset = 0;
+    root.childrenMask = 0;
+    root.elementsBegin = 0;
+    root.elementsCount = count;
+    m_grid = MortonGrid(root.center, root.size);
+
+    // Sizes of element tables are known, so nodes table is the last one
+    uint64_t offset = alignTable(sizeof(SnapshotHeader));
+    for (int j=0; j<3; j++)
+    {
+        m_coordinatesOffset[j] = offset;
+        offset = alignTable(offset + count * sizeof(double));
+    }
+    m_valuesOffset = offset;
+    offset = alignTable(offset + count * sizeof(double));
+    m_sourceIndexesOffset = offset;
+    m_nodesOffset = alignTable(offset + count * sizeof(uint32_t));
+
+    m_output.open(outputPath, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!m_output)
+        throw std::runtime_error("Cannot open file " + outputPath + " for writing");
+    try {
+        m_nodesCount = 1;
+        root = buildNode(input, root, 0, 0);
+        writeNode(0, root);
+
+        SnapshotHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+        header.version = snapshotVersion;
+        header.byteOrder = byteOrderMark;
+        header.nodeSize = sizeof(LinearNode);
+        header.nodesCount = m_nodesCount;
+        header.elementsCount = count;
+        header.nodesOffset = m_nodesOffset;
+        for (int j=0; j<3; j++)
+            header.coordinatesOffset[j] = m_coordinatesOffset[j];
+        header.valuesOffset = m_valuesOffset;
+        header.sourceIndexesOffset = m_sourceIndexesOffset;
+        header.fileSize = m_nodesOffset + m_nodesCount * sizeof(LinearNode);
+        write(0, &header, sizeof(header));
+        m_output.close();
+    } catch (...) {
+        m_output.close();
+        throw;
+    }
+}
+
+size_t StreamingBuilder::cellsCount() const
+{
+    return m_cellsCount;
+}
+
+template<typename Function>
+void StreamingBuilder::readRecords(const CellFile& file, Function function)
+{
+    std::ifstream stream(file.path, std::ios::binary);
+    if (!stream)
+        throw std::runtime_error("Cannot open file " + file.path);
+    std::vector<Record> records(chunkSize);
+    std::vector<Point> points(file.isInput ? chunkSize : 0);
+    uint64_t index = 0;
+    while (stream)
+    {
+        size_t count = 0;
+        if (file.isInput)
+        {
+            stream.read(reinterpret_cast<char*>(points.data()), chunkSize * sizeof(Point));
+            if (stream.gcount() % sizeof(Point) != 0)
+                throw std::runtime_error("File " + file.path + " has incomplete point record");
+            count = stream.gcount() / sizeof(Point);
+            for (size_t i=0; i<count; i++)
+            {
+                for (int j=0; j<3; j++)
+                    records[i].x[j] = points[i].x[j];
+                records[i].value = points[i].value;
+                records[i].index = index++;
+            }
+        } else {
+            stream.read(reinterpret_cast<char*>(records.data()), chunkSize * sizeof(Record));
+            count = stream.gcount() / sizeof(Record);
+        }
+        if (count != 0)
+            function(records.data(), count);
+    }
+    if (stream.bad())
+        throw std::runtime_error("Cannot read file " + file.path);
+}
+
+LinearNode StreamingBuilder::buildNode(const CellFile& file, LinearNode node, int level, uint64_t index)
+{
+    if (node.elementsCount <= m_bucketSize
+            || node.elementsCount * bytesPerPoint <= m_memoryBudget
+            || level == MortonGrid::bitsPerAxis)
+        return buildInMemory(file, node, level, index);
+
+    // Cell is split to files of children by next digit of Morton key
+    int shift = 3 * (MortonGrid::bitsPerAxis - 1 - level);
+    CellFile children[8];
+    uint32_t counts[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    try {
+        std::ofstream streams[8];
+        for (int i=0; i<8; i++)
+        {
+            children[i].path = m_tempPrefix + "-cell-" + std::to_string(index) + "-" + std::to_string(i) + ".tmp";
+            children[i].isInput = false;
+            streams[i].open(children[i].path, std::ios::binary | std::ios::trunc);
+            if (!streams[i])
+                throw std::runtime_error("Cannot open temporary file " + children[i].path);
+        }
+        readRecords(file,
+            [this, shift, &streams, &counts](const Record* records, size_t n)
+            {
+                for (size_t i=0; i<n; i++)
+                {
+                    Position p(records[i].x[0], records[i].x[1], records[i].x[2]);
+                    int digit = (m_grid.key(p) >> shift) & 7;
+                    streams[digit].write(reinterpret_cast<const char*>(records + i), sizeof(Record));
+                    counts[digit]++;
+                }
+            }
+        );
+        for (int i=0; i<8; i++)
+        {
+            streams[i].close();
+            if (!streams[i])
+                throw std::runtime_error("Cannot write temporary file " + children[i].path);
+        }
+        if (!file.isInput)
+            std::remove(file.path.c_str());
+
+        // Children block is reserved before subtrees of children, as LinearOctree::build() does
+        uint64_t first = m_nodesCount;
+        uint8_t mask = 0;
+        for (int i=0; i<8; i++)
+        {
+            if (counts[i] == 0)
+                continue;
+            mask |= 1 << i;
+            m_nodesCount++;
+        }
+        node.childrenMask = mask;
+        node.childrenOffset = first - index;
+
+        node.massCenter = {0.0, 0.0, 0.0};
+        node.mass = 0.0;
+        node.absMass = 0.0;
+        uint32_t begin = node.elementsBegin;
+        uint64_t childIndex = first;
+        const double childSize = node.size * 0.5;
+        for (int i=0; i<8; i++)
+        {
+            if (counts[i] == 0)
+            {
+                std::remove(children[i].path.c_str());
+                continue;
+            }
+            LinearNode child{};
+            for (int k=0; k<3; k++)
+                child.center.x[k] = node.center.x[k] + ((i >> k) & 1 ? childSize : -childSize) * 0.5;
+            child.size = childSize;
+            child.childrenOffset = 0;
+            child.childrenMask = 0;
+            child.elementsBegin = begin;
+            child.elementsCount = counts[i];
+            begin += counts[i];
+
+            child = buildNode(children[i], child, level + 1, childIndex);
+            writeNode(childIndex++, child);
+            node.massCenter += child.massCenter * child.mass;
+            node.mass += child.mass;
+            node.absMass += child.absMass;
+        }
+    } catch (...) {
+        for (int i=0; i<8; i++)
+            std::remove(children[i].path.c_str());
+        throw;
+    }
+
+    // Aggregates are calculated the same way as LinearOctree does
+    node.dia = node.size * sqrt(3.0);
+    if (node.mass != 0.0)
+        node.massCenter /= node.mass;
+    else
+        node.massCenter = node.center;
+    return node;
+}
+
+LinearNode StreamingBuilder::buildInMemory(const CellFile& file, LinearNode node, int level, uint64_t index)
+{
+    std::vector<Position> positions;
+    std::vector<double> values;
+    std::vector<uint64_t> indexes;
+    positions.reserve(node.elementsCount);
+    values.reserve(node.elementsCount);
+    indexes.reserve(node.elementsCount);
+    readRecords(file,
+        [&positions, &values, &indexes](const Record* records, size_t n)
+        {
+            for (size_t i=0; i<n; i++)
+            {
+                positions.push_back(Position(records[i].x[0], records[i].x[1], records[i].x[2]));
+                values.push_back(records[i].value);
+                indexes.push_back(records[i].index);
+            }
+        }
+    );
+    if (!file.isInput)
+        std::remove(file.path.c_str());
+
+    LinearOctree cell;
+    cell.buildCell(m_grid, node.center, node.size, level, positions.data(), values.data(), positions.size(),
+                   m_bucketSize, m_pool);
+    m_cellsCount++;
+
+    uint64_t begin = node.elementsBegin;
+    size_t count = cell.count();
+    for (int j=0; j<3; j++)
+        write(m_coordinatesOffset[j] + begin * sizeof(double), cell.coordinates(j), count * sizeof(double));
+    write(m_valuesOffset + begin * sizeof(double), cell.values(), count * sizeof(double));
+    std::vector<uint32_t> sourceIndexes(count);
+    for (uint32_t i=0; i<count; i++)
+        sourceIndexes[i] = indexes[cell.sourceIndex(i)];
+    write(m_sourceIndexesOffset + begin * sizeof(uint32_t), sourceIndexes.data(), count * sizeof(uint32_t));
+
+    // Descendants of cell root keep their relative offsets, they are placed after all reserved nodes
+    const LinearNode* nodes = &cell.root();
+    std::vector<LinearNode> descendants(nodes + 1, nodes + cell.nodesCount());
+    for (LinearNode& n : descendants)
+        n.elementsBegin += begin;
+    uint64_t first = m_nodesCount;
+    if (!descendants.empty())
+        write(m_nodesOffset + first * sizeof(LinearNode), descendants.data(), descendants.size() * sizeof(LinearNode));
+    m_nodesCount += descendants.size();
+
+    LinearNode root = nodes[0];
+    root.elementsBegin += begin;
+    if (!root.isLeaf())
+        root.childrenOffset = first - index;
+    return root;
+}
+
+void StreamingBuilder::write(uint64_t offset, const void* data, size_t size)
+{
+    m_output.seekp(offset);
+    m_output.write(static_cast<const char*>(data), size);
+    if (!m_output)
+        throw std::runtime_error("Cannot write snapshot");
+}
+
+void StreamingBuilder::writeNode(uint64_t index, const LinearNode& node)
+{
+    write(m_nodesOffset + index * sizeof(LinearNode), &node, sizeof(LinearNode));
+}
@@ -0,0 +1,109 @@
+#ifndef OCTREE_STREAMING_BUILDER_HPP_INCLUDED
+#define OCTREE_STREAMING_BUILDER_HPP_INCLUDED
+
+#include "linear-octree.hpp"
+
+#include <cstdint>
+#include <string>
+#include <fstream>
+
+namespace octree {
+
+/**
+ * @brief Builder of LinearOctree snapshots for point sets that do not fit in memory.
+ *
+ * Points are read from file by chunks. Cell that is too large for memory budget is split
+ * to 8 temporary files by next digit of Morton key, starting from the root. Cells that fit
+ * are built in memory by LinearOctree::buildCell() and their nodes and elements are written
+ * to snapshot file at once. Nodes above such cells are written when their subtrees are done.
+ *
+ * Result is the same tree that LinearOctree::build() gives for all points with the same
+ * bucket size. It is loaded by LinearOctree::load(), which maps the file, so subtrees are
+ * read from disk only when queries touch them.
+ */
+class StreamingBuilder
+{
+public:
+    /**
+     * @brief Record of input file. Input is a sequence of such records without header
+     */
+    struct Point
+    {
+        double x[3];
+        double value;
+    };
+
+    /**
+     * @param memoryBudget  Bytes that cell built in memory may use
+     * @param tempDirectory Directory for temporary files of split cells, may be shared by builders
+     * @param bucketSize    Maximal count of points in leaf, see LinearOctree::build()
+     */
+    StreamingBuilder(size_t memoryBudget, const std::string& tempDirectory, uint32_t bucketSize = 1);
+
+    /**
+     * @brief Build snapshot from file of Point records. Source index of element is index
+     * of its record in input file
+     * @param pool Threads used for sorting cells, ThreadPool::defaultPool() if nullptr
+     * @throws std::runtime_error if files cannot be read or written
+     */
+    void build(const std::string& inputPath, const std::string& outputPath, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Count of cells built in memory by last build()
+     */
+    size_t cellsCount() const;
+
+private:
+    /**
+     * @brief Point with index in input file, the record of temporary files
+     */
+    struct Record
+    {
+        double x[3];
+        double value;
+        uint64_t index;
+    };
+
+    struct CellFile
+    {
+        std::string path;
+        /// Input file has Point records, temporary files have Record ones
+        bool isInput;
+    };
+
+    template<typename Function>
+    void readRecords(const CellFile& file, Function function);
+
+    /**
+     * @brief Build subtree of node and write it to output
+     * @param node  Node with center, size and elements range set
+     * @param index Index of node in nodes table
+     * @return Node with children and aggregates
+     */
+    LinearNode buildNode(const CellFile& file, LinearNode node, int level, uint64_t index);
+    LinearNode buildInMemory(const CellFile& file, LinearNode node, int level, uint64_t index);
+
+    void write(uint64_t offset, const void* data, size_t size);
+    void writeNode(uint64_t index, const LinearNode& node);
+
+    size_t m_memoryBudget;
+    std::string m_tempDirectory;
+    uint32_t m_bucketSize;
+
+    // State of current build()
+    ThreadPool* m_pool = nullptr;
+    /// Path prefix of temporary files, unique for each build
+    std::string m_tempPrefix;
+    MortonGrid m_grid{Position(), 1.0};
+    std::fstream m_output;
+    uint64_t m_nodesOffset = 0;
+    uint64_t m_coordinatesOffset[3] = {0, 0, 0};
+    uint64_t m_valuesOffset = 0;
+    uint64_t m_sourceIndexesOffset = 0;
+    uint64_t m_nodesCount = 0;
+    size_t m_cellsCount = 0;
+};
+
+}
+
+#endif // OCTREE_STREAMING_BUILDER_HPP_INCLUDED
@@ -0,0 +1,167 @@
+#include "thread-pool.hpp"
+
+#include <algorithm>
+
+using namespace octree;
+
+namespace {
+
+/// Loop of pool that thread runs with given worker index, loops are linked from inner to outer
+struct LoopFrame
+{
+    const ThreadPool* pool;
+    unsigned worker;
+    const LoopFrame* outer;
+};
+
+thread_local const LoopFrame* currentLoop = nullptr;
+
+/**
+ * @brief Marks that thread runs loop of pool, previous state is restored on exit
+ */
+class LoopScope
+{
+public:
+    LoopScope(const ThreadPool* pool, unsigned worker) :
+        m_frame{pool, worker, currentLoop}
+    {
+        currentLoop = &m_frame;
+    }
+
+    ~LoopScope()
+    {
+        currentLoop = m_frame.outer;
+    }
+
+    /// Thread runs loop of other pool too
+    bool isNested() const { return m_frame.outer != nullptr; }
+
+    LoopScope(const LoopScope&) = delete;
+    LoopScope& operator=(const LoopScope&) = delete;
+
+private:
+    LoopFrame m_frame;
+};
+
+}
+
+ThreadPool::ThreadPool(unsigned threadsCount)
+{
+    if (threadsCount == 0)
+        threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i=1; i<threadsCount; i++)
+        m_threads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_startCondition.notify_all();
+    for (auto& thread : m_threads)
+        thread.join();
+}
+
+unsigned ThreadPool::threadsCount() const
+{
+    return m_threads.size() + 1;
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grain, const Task& task)
+{
+    if (count == 0)
+        return;
+    if (grain == 0)
+        grain = 1;
+
+    // Nested call of this pool runs in calling thread, which keeps its worker index
+    for (const LoopFrame* frame = currentLoop; frame != nullptr; frame = frame->outer)
+    {
+        if (frame->pool == this)
+        {
+            task(frame->worker, 0, count);
+            return;
+        }
+    }
+
+    // Other threads take index 0 of calling thread only while no other loop of this pool runs
+    std::lock_guard<std::mutex> loopLock(m_loopMutex);
+    LoopScope scope(this, 0);
+    if (scope.isNested() || m_threads.empty() || count <= grain)
+    {
+        task(0, 0, count);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_task = &task;
+        m_count = count;
+        m_grain = grain;
+        m_nextChunk = 0;
+        m_exception = nullptr;
+        m_busyWorkers = m_threads.size();
+        m_loopId++;
+    }
+    m_startCondition.notify_all();
+
+    runChunks(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_doneCondition.wait(lock, [this] { return m_busyWorkers == 0; });
+    m_task = nullptr;
+    if (m_exception)
+        std::rethrow_exception(m_exception);
+}
+
+ThreadPool& ThreadPool::defaultPool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::workerLoop(unsigned worker)
+{
+    LoopScope scope(this, worker);
+    uint64_t lastLoop = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_startCondition.wait(lock, [this, lastLoop] { return m_stop || m_loopId != lastLoop; });
+            if (m_stop)
+                return;
+            lastLoop = m_loopId;
+        }
+        runChunks(worker);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_busyWorkers == 0)
+                m_doneCondition.notify_one();
+        }
+    }
+}
+
+void ThreadPool::runChunks(unsigned worker)
+{
+    size_t chunks = (m_count + m_grain - 1) / m_grain;
+    for (;;)
+    {
+        size_t chunk = m_nextChunk.fetch_add(1);
+        if (chunk >= chunks)
+            return;
+        size_t begin = chunk * m_grain;
+        size_t end = std::min(begin + m_grain, m_count);
+        try {
+            (*m_task)(worker, begin, end);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_exception)
+                m_exception = std::current_exception();
+            // Other chunks are skipped
+            m_nextChunk = chunks;
+        }
+    }
+}
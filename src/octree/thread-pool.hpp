@@ -0,0 +1,80 @@
+#ifndef OCTREE_THREAD_POOL_HPP_INCLUDED
+#define OCTREE_THREAD_POOL_HPP_INCLUDED
+
+#include <functional>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <cstdint>
+
+namespace octree {
+
+/**
+ * @brief Simple pool of worker threads running parallel loops.
+ * Only one loop runs at a time. Calling thread participates in the loop,
+ * so pool with threadsCount == 1 has no worker threads at all.
+ */
+class ThreadPool
+{
+public:
+    /**
+     * @brief Task for chunk [begin, end) of loop
+     * @param worker Index of thread running the chunk, it is less than threadsCount()
+     *               and may be used to index per-thread scratch buffers
+     */
+    using Task = std::function<void(unsigned worker, size_t begin, size_t end)>;
+
+    /**
+     * @param threadsCount Total threads count including calling thread,
+     *                     0 means std::thread::hardware_concurrency()
+     */
+    ThreadPool(unsigned threadsCount = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned threadsCount() const;
+
+    /**
+     * @brief Split [0, count) into chunks of grain size and run task for them in parallel.
+     * Function returns when all chunks are done. Exception thrown by task is rethrown here.
+     * Nested calls from inside of a task are executed in the calling thread. Nested call of
+     * the same pool gets worker index of the calling thread. Other threads get index 0 after
+     * loop of this pool that runs now, so threads never share worker index. Pools nested into
+     * each other should be nested in the same order by all threads, otherwise they may deadlock.
+     */
+    void parallelFor(size_t count, size_t grain, const Task& task);
+
+    /**
+     * @brief Pool with hardware_concurrency() threads created on first use
+     */
+    static ThreadPool& defaultPool();
+
+private:
+    void workerLoop(unsigned worker);
+    void runChunks(unsigned worker);
+
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_loopMutex;
+    std::mutex m_mutex;
+    std::condition_variable m_startCondition;
+    std::condition_variable m_doneCondition;
+
+    const Task* m_task = nullptr;
+    size_t m_count = 0;
+    size_t m_grain = 1;
+    std::atomic<size_t> m_nextChunk{0};
+    unsigned m_busyWorkers = 0;
+    uint64_t m_loopId = 0;
+    bool m_stop = false;
+    std::exception_ptr m_exception;
+};
+
+}
+
+#endif // OCTREE_THREAD_POOL_HPP_INCLUDED
@@ -0,0 +1,124 @@
+#ifndef OCTREE_TRAVERSAL_STATS_HPP_INCLUDED
+#define OCTREE_TRAVERSAL_STATS_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+
+namespace octree {
+
+/**
+ * @brief Statistics policy of tree traversals that collects nothing.
+ * All methods are empty and inline, so traversal with NoStats compiles
+ * to the same code as traversal without statistics.
+ *
+ * Traversal calls start() once, then visit() or visitQueued() for every node
+ * taken from its queue, accept() for node used as aggregate and leaf() for
+ * leaf that is processed element by element.
+ */
+struct NoStats
+{
+    void start() {}
+    void visit(int, size_t) {}
+    void visitQueued(size_t, size_t) {}
+    void accept() {}
+    void leaf() {}
+};
+
+/**
+ * @brief Counters of tree traversals. Counters are accumulated over calls,
+ * so one object may collect statistics of one call, of many calls or of all
+ * calls of a thread, see threadLocal()
+ */
+struct TraversalStats
+{
+    constexpr static int maxDepth = 64;
+
+    uint64_t traversals = 0;
+    uint64_t nodesVisited = 0;
+    /// Nodes whose aggregates were used instead of their elements
+    uint64_t nodesAccepted = 0;
+    /// Leafs processed element by element
+    uint64_t leavesReached = 0;
+    /// Maximal count of nodes kept in traversal queue
+    uint64_t maxFrontier = 0;
+    /// Visited nodes by depth counted from root, deeper nodes are counted in the last item
+    uint64_t depthHistogram[maxDepth] = {};
+
+    void start()
+    {
+        traversals++;
+        m_depth = -1;
+        m_levelEnd = 0;
+    }
+
+    void visit(int depth, size_t frontier)
+    {
+        nodesVisited++;
+        if (frontier > maxFrontier)
+            maxFrontier = frontier;
+        depthHistogram[depth < maxDepth ? depth : maxDepth - 1]++;
+    }
+
+    /**
+     * @brief Visit node queue[index] of breadth-first traversal where subnodes are
+     * appended to the queue. Nodes of one depth are a continuous range of queue,
+     * so depth is found without storing it in queue
+     * @param frontier Current queue size
+     */
+    void visitQueued(size_t index, size_t frontier)
+    {
+        if (index == m_levelEnd)
+        {
+            m_depth++;
+            m_levelEnd = frontier;
+        }
+        visit(m_depth, frontier);
+    }
+
+    void accept()
+    {
+        nodesAccepted++;
+    }
+
+    void leaf()
+    {
+        leavesReached++;
+    }
+
+    void clear()
+    {
+        *this = TraversalStats();
+    }
+
+    TraversalStats& operator+=(const TraversalStats& other)
+    {
+        traversals += other.traversals;
+        nodesVisited += other.nodesVisited;
+        nodesAccepted += other.nodesAccepted;
+        leavesReached += other.leavesReached;
+        if (other.maxFrontier > maxFrontier)
+            maxFrontier = other.maxFrontier;
+        for (int i=0; i<maxDepth; i++)
+            depthHistogram[i] += other.depthHistogram[i];
+        return *this;
+    }
+
+    /**
+     * @brief Statistics object of calling thread, it may be given to all calls
+     * of the thread to aggregate them
+     */
+    static TraversalStats& threadLocal()
+    {
+        thread_local TraversalStats stats;
+        return stats;
+    }
+
+private:
+    // State of current breadth-first traversal
+    int m_depth = -1;
+    size_t m_levelEnd = 0;
+};
+
+}
+
+#endif // OCTREE_TRAVERSAL_STATS_HPP_INCLUDED
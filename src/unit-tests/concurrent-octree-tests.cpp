@@ -0,0 +1,137 @@
+#include "concurrent-octree.hpp"
+
+#include "gtest/gtest.h"
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cmath>
+
+using namespace std;
+using namespace octree;
+
+TEST(ConcurrentOctree, SnapshotIsKeptForReader)
+{
+    ConcurrentOctree oct(10.0);
+    {
+        auto reader = oct.read();
+        ASSERT_EQ(reader.snapshot().version, 0u);
+        ASSERT_TRUE(reader.tree().empty());
+    }
+
+    for (int i=0; i<10; i++)
+        oct.add(make_shared<ElementValue>(Position(i, i * 0.5, -i), 1.0));
+    oct.publish();
+
+    auto reader = oct.read();
+    ASSERT_EQ(reader.snapshot().version, 1u);
+    ASSERT_EQ(reader.tree().count(), 10u);
+
+    // Removed element is kept alive by snapshot of reader
+    const Element* first = reader.snapshot().elements.front().get();
+    oct.modify([first](Octree& o)
+        {
+            o.remove(const_cast<Element&>(*first));
+            o.add(make_shared<ElementValue>(Position(20.0, 0.0, 0.0), 2.0));
+        }
+    );
+    ASSERT_EQ(oct.retiredCount(), 1u);
+    ASSERT_EQ(reader.tree().count(), 10u);
+    ASSERT_EQ(reader.tree().mass(), 10.0);
+    ASSERT_TRUE(std::isfinite(first->pos.x[0]));
+
+    auto newer = oct.read();
+    ASSERT_EQ(newer.snapshot().version, 2u);
+    ASSERT_EQ(newer.tree().count(), 10u);
+    ASSERT_EQ(newer.tree().mass(), 11.0);
+
+    {
+        ConcurrentOctree::Reader moved(std::move(reader));
+        ASSERT_EQ(moved.snapshot().version, 1u);
+    }
+    // Tree is not rebuilt without changes
+    oct.publish();
+    ASSERT_EQ(oct.read().snapshot().version, 2u);
+
+    oct.add(make_shared<ElementValue>(Position(21.0, 0.0, 0.0), 1.0));
+    oct.publish();
+    // Snapshot 2 is used by newer reader yet
+    ASSERT_EQ(oct.retiredCount(), 1u);
+}
+
+TEST(ConcurrentOctree, ManyReaders)
+{
+    ConcurrentOctree oct(10.0);
+    std::vector<std::shared_ptr<Element>> elements;
+    for (int i=0; i<100; i++)
+        elements.push_back(make_shared<ElementValue>(Position(i, sin(i), cos(i)), 1.0));
+    oct.addMany(elements);
+    oct.publish();
+
+    // Readers are not limited by slots of one block
+    std::vector<ConcurrentOctree::Reader> readers;
+    for (size_t i=0; i<ConcurrentOctree::slotsPerBlock * 2 + 10; i++)
+        readers.push_back(oct.read());
+    oct.add(make_shared<ElementValue>(Position(-1.0, 0.0, 0.0), 1.0));
+    oct.publish();
+    // Old snapshot is kept for readers of the last block too
+    ASSERT_EQ(oct.retiredCount(), 1u);
+    ASSERT_EQ(readers.back().tree().count(), 100u);
+    readers.clear();
+
+    oct.add(make_shared<ElementValue>(Position(-2.0, 0.0, 0.0), 1.0));
+    oct.publish();
+    ASSERT_EQ(oct.retiredCount(), 0u);
+    ASSERT_EQ(oct.read().tree().count(), 102u);
+}
+
+TEST(ConcurrentOctree, ReadersDuringIngestion)
+{
+    ConcurrentOctree oct(10.0);
+    const int batches = 50, batchSize = 40;
+    std::atomic<bool> done{false};
+    std::atomic<int> failures{0};
+
+    std::vector<std::thread> readers;
+    for (int r=0; r<3; r++)
+    {
+        readers.push_back(std::thread([&oct, &done, &failures]()
+            {
+                uint64_t lastVersion = 0;
+                while (!done.load())
+                {
+                    auto reader = oct.read();
+                    const ConcurrentOctree::Snapshot& snapshot = reader.snapshot();
+                    size_t count = snapshot.tree.empty() ? 0 : snapshot.tree.count();
+                    double mass = snapshot.tree.empty() ? 0.0 : snapshot.tree.mass();
+                    // Every published snapshot contains whole batches
+                    if (snapshot.version < lastVersion || count != snapshot.elements.size()
+                            || count % batchSize != 0 || mass != static_cast<double>(count))
+                        failures++;
+                    lastVersion = snapshot.version;
+                }
+            }
+        ));
+    }
+
+    for (int b=0; b<batches; b++)
+    {
+        oct.modify([b](Octree& o)
+            {
+                for (int i=0; i<batchSize; i++)
+                {
+                    int n = b * batchSize + i;
+                    o.add(make_shared<ElementValue>(Position(sin(n * 0.3) * 5.0, cos(n * 0.7) * 5.0, sin(n * 1.1) * 5.0), 1.0));
+                }
+            }
+        );
+    }
+    done = true;
+    for (std::thread& t : readers)
+        t.join();
+
+    ASSERT_EQ(failures.load(), 0);
+    auto reader = oct.read();
+    ASSERT_EQ(reader.snapshot().version, static_cast<uint64_t>(batches));
+    ASSERT_EQ(reader.tree().count(), static_cast<size_t>(batches * batchSize));
+}
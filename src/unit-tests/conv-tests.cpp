@@ -1,10 +1,15 @@
 #include "octree.hpp"
+#include "dual-tree-convolution.hpp"
+#include "adaptive-convolution.hpp"
+#include "linear-octree.hpp"
+#include "kernels.hpp"
 
 #include "test-utils.hpp"
 
 #include "gtest/gtest.h"
 
 #include <iostream>
+#include <thread>
 
 using namespace std;
 using namespace octree;
@@ -22,6 +27,99 @@ TEST(DiscreteScales, FindScales)
     ASSERT_EQ(c.findScale(31), 3);
 }
 
+namespace {
+
+/**
+ * @brief User defined scales without own minDistance()
+ */
+class SqrtScales : public IScalesConfig
+{
+public:
+    double findScale(double distance) const override
+    {
+        calls++;
+        return distance < 0.0 ? 0.0 : m_factor * sqrt(distance);
+    }
+
+    void setFactor(double factor)
+    {
+        m_factor = factor;
+        scalesChanged();
+    }
+
+    mutable size_t calls = 0;
+
+private:
+    double m_factor = 1.0;
+};
+
+}
+
+TEST(DiscreteScales, MinDistance)
+{
+    DiscreteScales c;
+    c.addScale(20, 2);
+    c.addScale(10, 1);
+    c.addScale(30, 3);
+    ASSERT_EQ(c.minDistance(0.5), 10);
+    ASSERT_EQ(c.minDistance(1.0), 10);
+    ASSERT_EQ(c.minDistance(2.5), 30);
+    ASSERT_TRUE(std::isinf(c.minDistance(4.0)));
+    ASSERT_LT(c.minDistance(0.0), 0.0);
+
+    LinearScales linear(0.5);
+    ASSERT_EQ(linear.minDistance(2.0), 4.0);
+
+    SqrtScales user;
+    for (double scale : {0.3, 1.0, 7.5})
+    {
+        double dist = user.minDistance(scale);
+        ASSERT_GE(user.findScale(dist), scale);
+        ASSERT_LT(user.findScale(dist * (1.0 - 1e-12)), scale);
+    }
+}
+
+TEST(DiscreteScales, DecreasingScale)
+{
+    DiscreteScales c;
+    c.addScale(20, 2);
+    c.addScale(10, 1);
+    c.addScale(30, 3);
+    // Scale decreasing with distance is rejected and scales are not changed
+    ASSERT_THROW(c.addScale(25, 0.5), std::invalid_argument);
+    ASSERT_THROW(c.addScale(5, 1.5), std::invalid_argument);
+    ASSERT_EQ(c.minDistance(2.5), 30);
+    ASSERT_EQ(c.findScale(26), 2);
+    ASSERT_EQ(c.findScale(7), 0);
+    c.addScale(25, 2.5);
+    ASSERT_EQ(c.findScale(26), 2.5);
+}
+
+TEST(ScalesConfig, MinDistanceIsCached)
+{
+    SqrtScales user;
+    double dist = user.minDistance(2.0);
+    size_t calls = user.calls;
+    ASSERT_GT(calls, 0u);
+    ASSERT_EQ(user.minDistance(2.0), dist);
+    ASSERT_EQ(user.calls, calls);
+    // Changed scales drop cached distances
+    user.setFactor(2.0);
+    ASSERT_LT(user.minDistance(2.0), dist);
+    ASSERT_GT(user.calls, calls);
+
+    // Thresholds of tree levels are found once for many convolutions
+    Octree oct;
+    PointsGenerator::addGrid(10, 10, oct, nullptr);
+    Convolution<double> conv(user);
+    Convolution<double>::Visitor visitor = [](const Position&, const Position&, double mass) { return mass; };
+    double first = conv.convolute(oct, Position(30.0, 0.0, 0.0), visitor);
+    calls = user.calls;
+    ASSERT_EQ(conv.convolute(oct, Position(30.0, 0.0, 0.0), visitor), first);
+    ASSERT_NEAR(conv.convolute(oct, Position(0.0, -40.0, 5.0), visitor), first, 1e-9);
+    ASSERT_EQ(user.calls, calls);
+}
+
 class ConvolutionTests : public ::testing::Test
 {
 public:
@@ -191,6 +289,425 @@ TEST_F(ConvolutionTests, ConvoluteCoulomb2)
     //cout << realField << " " << convField << endl;
 }
 
+TEST_F(ConvolutionTests, ConvoluteMany)
+{
+    addManyPoints();
+    scales.addScale(5, 3);
+    scales.addScale(7, 10);
+    std::vector<Position> targets;
+    for (int i=0; i<1000; i++)
+        targets.push_back(Position(sin(i * 0.1) * 12.0, cos(i * 0.37) * 8.0, sin(i * 0.71) * 15.0));
+
+    ThreadPool pool(4);
+    conv.setThreadPool(&pool);
+    std::vector<double> results(targets.size());
+    conv.convoluteMany(oct, targets.data(), targets.size(), results.data(), coulomb);
+    for (size_t i=0; i<targets.size(); i++)
+        ASSERT_EQ(results[i], conv.convolute(oct, targets[i], coulomb));
+
+    Octree empty;
+    conv.convoluteMany(empty, targets.data(), targets.size(), results.data(), coulomb);
+    for (double r : results)
+        ASSERT_EQ(r, 0.0);
+}
+TEST_F(ConvolutionTests, StaticConvolution)
+{
+    addManyPoints();
+    scales.addScale(5, 3);
+    scales.addScale(7, 10);
+    StaticConvolution<CoulombPotentialKernel, DiscreteScales> staticConv(scales);
+    std::vector<Position> targets;
+    for (int i=0; i<100; i++)
+        targets.push_back(Position(sin(i * 0.1) * 12.0, cos(i * 0.37) * 8.0, sin(i * 0.71) * 15.0));
+    for (const Position& target : targets)
+        ASSERT_EQ(staticConv.convolute(oct, target), conv.convolute(oct, target, coulomb));
+
+    LinearScales linear(0.3);
+    Convolution<double> linearConv(linear);
+    StaticConvolution<CoulombPotentialKernel> staticLinearConv(linear);
+    std::vector<double> results(targets.size());
+    staticLinearConv.convoluteMany(oct, targets.data(), targets.size(), results.data());
+    for (size_t i=0; i<targets.size(); i++)
+        ASSERT_EQ(results[i], linearConv.convolute(oct, targets[i], coulomb));
+
+    Octree empty;
+    ASSERT_EQ(staticConv.convolute(empty, targets[0]), 0.0);
+}
+
+TEST_F(ConvolutionTests, TraversalStats)
+{
+    addManyPoints();
+    scales.addScale(5, 3);
+    scales.addScale(7, 10);
+    Position target(1.123, 2.345, 3.456);
+
+    TraversalStats stats;
+    ASSERT_EQ(conv.convolute(oct, target, coulomb, stats), conv.convolute(oct, target, coulomb));
+    ASSERT_EQ(stats.traversals, 1u);
+    ASSERT_GT(stats.nodesAccepted, 0u);
+    // Octree leafs have zero diameter, so they are always accepted
+    ASSERT_EQ(stats.leavesReached, 0u);
+    ASSERT_LT(stats.nodesAccepted, stats.nodesVisited);
+    ASSERT_GT(stats.maxFrontier, 1u);
+    uint64_t histogramSum = 0;
+    for (int i=0; i<TraversalStats::maxDepth; i++)
+        histogramSum += stats.depthHistogram[i];
+    ASSERT_EQ(histogramSum, stats.nodesVisited);
+    ASSERT_EQ(stats.depthHistogram[0], 1u);
+
+    // Counters are accumulated over calls
+    TraversalStats twice = stats;
+    twice += stats;
+    conv.convolute(oct, target, coulomb, stats);
+    ASSERT_EQ(stats.traversals, 2u);
+    ASSERT_EQ(stats.nodesVisited, twice.nodesVisited);
+
+    // Queries give the same results with statistics
+    TraversalStats& queries = TraversalStats::threadLocal();
+    queries.clear();
+    std::vector<Element*> close, closeWithStats;
+    oct.getClose(close, target, 5.0);
+    oct.getClose(closeWithStats, target, 5.0, queries);
+    ASSERT_EQ(close, closeWithStats);
+    ASSERT_GT(queries.nodesVisited, 0u);
+    uint64_t leaves = queries.leavesReached;
+    ASSERT_EQ(&oct.getNearest(target), &oct.getNearest(target, queries));
+    ASSERT_EQ(queries.traversals, 2u);
+    ASSERT_GT(queries.leavesReached, leaves);
+}
+
+TEST_F(ConvolutionTests, AdaptivePotential)
+{
+    addManyPoints();
+    Position target(1.123, 2.345, 3.456);
+    double exact = getCoulombFieldBruteForce(target);
+    uint64_t previousVisited = 0;
+    for (double tolerance : {1e-2, 1e-1, 3e-1})
+    {
+        AdaptiveConvolution<CoulombPotentialKernel> adaptive(tolerance);
+        TraversalStats stats;
+        auto result = adaptive.convolute(oct, target, stats);
+        ASSERT_LE(fabs(result.value - exact), result.errorBound * (1.0 + 1e-9) + 1e-12);
+        ASSERT_LE(result.errorBound, tolerance * exact);
+        // Less work is done for larger tolerance
+        if (previousVisited != 0)
+        {
+            ASSERT_LT(stats.nodesVisited, previousVisited);
+        }
+        previousVisited = stats.nodesVisited;
+    }
+
+    AdaptiveConvolution<CoulombPotentialKernel> absolute(0.0, 1e-3);
+    auto result = absolute.convolute(oct, target);
+    ASSERT_LE(fabs(result.value - exact), result.errorBound * (1.0 + 1e-9) + 1e-12);
+    ASSERT_LE(result.errorBound, 1e-3);
+}
+
+TEST_F(ConvolutionTests, AdaptiveFieldMixedSigns)
+{
+    std::vector<Position> points;
+    std::vector<double> values;
+    for (int i=0; i<2000; i++)
+    {
+        points.push_back(Position(sin(i * 0.13) * 10.0, cos(i * 0.29) * 10.0, sin(i * 0.47 + 1.0) * 10.0));
+        values.push_back(i % 3 == 0 ? -2.0 : 1.0);
+    }
+    LinearOctree linear;
+    linear.build(points.data(), values.data(), points.size(), 8);
+
+    CoulombFieldKernel kernel;
+    const double tolerance = 1e-3;
+    AdaptiveConvolution<CoulombFieldKernel> adaptive(tolerance);
+    for (int i=0; i<20; i++)
+    {
+        Position target(sin(i * 0.7) * 15.0, cos(i * 0.3) * 15.0, sin(i * 0.9) * 15.0);
+        Position exact;
+        double magnitudes = 0.0;
+        for (size_t j=0; j<points.size(); j++)
+        {
+            Position field = kernel(target, points[j], values[j]);
+            exact += field;
+            magnitudes += field.len();
+        }
+        auto result = adaptive.convolute(linear, target);
+        ASSERT_LE((result.value - exact).len(), result.errorBound * (1.0 + 1e-9) + 1e-12);
+        ASSERT_LE(result.errorBound, tolerance * magnitudes);
+    }
+}
+
+TEST_F(ConvolutionTests, DualTreeNoScale)
+{
+    addSomePoints();
+    DualTreeConvolution<double> dual(scales);
+    std::vector<const Element*> elements;
+    std::vector<double> results;
+    dual.convolute(oct, coulomb, elements, results);
+    ASSERT_EQ(elements.size(), positions.size());
+    ASSERT_EQ(results.size(), positions.size());
+    for (size_t i=0; i<elements.size(); i++)
+        ASSERT_NEAR_RELATIVE(results[i], conv.convolute(oct, elements[i]->pos, coulomb), 1e-12);
+}
+
+TEST_F(ConvolutionTests, DualTreeWithScales)
+{
+    addManyPoints();
+    scales.addScale(5, 3);
+    scales.addScale(7, 10);
+    ThreadPool single(1);
+    DualTreeConvolution<double> dual(scales);
+    dual.setThreadPool(&single);
+
+    std::vector<const Element*> elements;
+    std::vector<double> results;
+    dual.convolute(oct, coulomb, elements, results);
+    ASSERT_EQ(elements.size(), positions.size());
+    for (size_t i=0; i<elements.size(); i++)
+    {
+        double real = getCoulombFieldBruteForce(elements[i]->pos);
+        ASSERT_NEAR(results[i], real, 1e-2 * real);
+    }
+
+    int dualCalls = 0;
+    DualTreeConvolution<double>::GradientVisitor coulombWithGradient =
+        [&dualCalls](const Position& target, const Position& object, double mass, double* gradient)
+        {
+            dualCalls++;
+            double d = (target-object).len();
+            if (d == 0.0)
+                return 0.0;
+            if (gradient != nullptr)
+            {
+                for (int i=0; i<3; i++)
+                    gradient[i] = -mass * (target.x[i] - object.x[i]) / (d*d*d);
+            }
+            return mass/d;
+        };
+    std::vector<double> resultsWithGradient;
+    dual.convoluteWithGradient(oct, coulombWithGradient, elements, resultsWithGradient);
+
+    int singleCalls = 0;
+    for (size_t i=0; i<elements.size(); i++)
+    {
+        ASSERT_NEAR_RELATIVE(resultsWithGradient[i], results[i], 1e-3);
+        conv.convolute(oct, elements[i]->pos,
+            [this, &singleCalls](const Position& target, const Position& object, double mass)
+            {
+                singleCalls++;
+                return coulomb(target, object, mass);
+            }
+        );
+    }
+    ASSERT_LT(dualCalls, singleCalls);
+
+    ThreadPool pool(4);
+    std::vector<const Element*> elementsParallel;
+    std::vector<double> resultsParallel;
+    dual.setThreadPool(&pool);
+    dual.convolute(oct, coulomb, elementsParallel, resultsParallel);
+    ASSERT_EQ(elementsParallel, elements);
+    ASSERT_EQ(resultsParallel, results);
+}
+
+TEST_F(ConvolutionTests, DualTreeAfterMutedChanges)
+{
+    addManyPoints();
+    scales.addScale(5, 3);
+    scales.addScale(7, 10);
+    DualTreeConvolution<double> dual(scales);
+    std::vector<const Element*> elements;
+    std::vector<double> results;
+    dual.convolute(oct, coulomb, elements, results);
+    Position target(3.0, -2.0, 25.0);
+    double single = conv.convolute(oct, target, coulomb);
+
+    // Aggregates are not updated after changes, so convolutions update them
+    oct.muteCenterMassCalculation();
+    for (const Element* e : elements)
+    {
+        Element* changed = const_cast<Element*>(e);
+        changed->value *= 2.0;
+        oct.elementChanged(*changed);
+    }
+    std::vector<double> changedResults;
+    dual.convolute(oct, coulomb, elements, changedResults);
+    for (size_t i=0; i<elements.size(); i++)
+        ASSERT_NEAR_RELATIVE(changedResults[i], 2.0 * results[i], 1e-12);
+
+    // Concurrent convolutions of the same const tree update it once
+    for (const Element* e : elements)
+    {
+        Element* changed = const_cast<Element*>(e);
+        changed->value *= 2.0;
+        oct.elementChanged(*changed);
+    }
+    const Octree& shared = oct;
+    double concurrent[2] = {0.0, 0.0};
+    std::thread other([this, &shared, &target, &concurrent]() { concurrent[1] = conv.convolute(shared, target, coulomb); });
+    concurrent[0] = conv.convolute(shared, target, coulomb);
+    other.join();
+    ASSERT_NEAR_RELATIVE(concurrent[0], 4.0 * single, 1e-12);
+    ASSERT_EQ(concurrent[1], concurrent[0]);
+    oct.unmuteCenterMassCalculation();
+}
+
+class MultipolesTests : public ::testing::Test
+{
+public:
+    void addPoints(int count)
+    {
+        for (int i=0; i<count; i++)
+        {
+            // Not symmetric distribution so nodes have noticeable moments
+            Position p(sin(i * 1.3) * 5.0 + 2.0 * sin(i * 0.1), cos(i * 0.71) * 4.0, sin(i * 0.37 + 1.0) * cos(i * 0.11) * 6.0);
+            double value = 1.0 + 0.5 * sin(i * 0.9);
+            oct.add(make_shared<ElementValue>(p, value));
+            positions.push_back(p);
+            values.push_back(value);
+        }
+    }
+
+    double potentialBruteForce(const Position& target)
+    {
+        double result = 0.0;
+        for (size_t i=0; i<positions.size(); i++)
+            result += values[i] / (target - positions[i]).len();
+        return result;
+    }
+
+    Octree oct;
+    std::vector<Position> positions;
+    std::vector<double> values;
+
+    Convolution<double>::Visitor monopole =
+        [](const Position& target, const Position& object, double mass)
+        {
+            double d = (target-object).len();
+            if (d == 0.0)
+                return 0.0;
+            return mass/d;
+        };
+};
+
+TEST_F(MultipolesTests, Moments)
+{
+    oct.setMultipolesEnabled(true);
+    addPoints(50);
+    const Node& root = oct.root();
+    Position dipole;
+    double q[6] = {0, 0, 0, 0, 0, 0};
+    for (size_t i=0; i<positions.size(); i++)
+    {
+        Position r = positions[i] - root.massCenter;
+        double r2 = r * r;
+        double m = values[i];
+        dipole += r * m;
+        q[0] += m * (3 * r[0] * r[0] - r2);
+        q[1] += m * (3 * r[1] * r[1] - r2);
+        q[2] += m * (3 * r[2] * r[2] - r2);
+        q[3] += m * 3 * r[0] * r[1];
+        q[4] += m * 3 * r[0] * r[2];
+        q[5] += m * 3 * r[1] * r[2];
+    }
+    for (int i=0; i<3; i++)
+        ASSERT_NEAR(root.multipoles.dipole[i], dipole[i], 1e-9);
+    for (int i=0; i<6; i++)
+        ASSERT_NEAR(root.multipoles.quadrupole[i], q[i], 1e-9);
+    // Dipole relative to mass center is zero for positive values
+    ASSERT_NEAR(root.multipoles.dipole.len(), 0.0, 1e-9);
+}
+
+TEST_F(MultipolesTests, EnableLater)
+{
+    addPoints(50);
+    ASSERT_EQ(oct.root().multipoles.quadrupole[0], 0.0);
+    oct.setMultipolesEnabled(true);
+    ASSERT_NE(oct.root().multipoles.quadrupole[0], 0.0);
+}
+
+TEST_F(MultipolesTests, BetterPrecision)
+{
+    oct.setMultipolesEnabled(true);
+    addPoints(2000);
+    LinearScales coarse(0.8);
+    Convolution<double> conv(coarse);
+    // Errors of single targets may cancel occasionally, so sums of squares are compared
+    double monoError = 0.0, multiError = 0.0;
+    for (int i=0; i<30; i++)
+    {
+        Position target(12.0 * cos(i * 0.7) * sin(i * 0.4 + 0.2), 12.0 * sin(i * 0.7) * sin(i * 0.4 + 0.2), 12.0 * cos(i * 0.4 + 0.2));
+        double real = potentialBruteForce(target);
+        double mono = conv.convolute(oct, target, monopole);
+        double multi = conv.convoluteMultipoles(oct, target, multipolePotential);
+        monoError += (mono - real) * (mono - real);
+        multiError += (multi - real) * (multi - real);
+        ASSERT_NEAR(multi, real, 1e-3 * real);
+    }
+    ASSERT_LT(multiError, monoError * 0.1);
+}
+
+TEST_F(MultipolesTests, Field)
+{
+    oct.setMultipolesEnabled(true);
+    addPoints(2000);
+    LinearScales coarse(0.8);
+    Convolution<Position> conv(coarse);
+    Position target(12.0, -7.0, 3.0);
+    Position real;
+    for (size_t i=0; i<positions.size(); i++)
+    {
+        Position r = target - positions[i];
+        real += r * (values[i] / pow(r.len(), 3));
+    }
+    Position field = conv.convoluteMultipoles(oct, target, multipoleField);
+    ASSERT_NEAR((field - real).len(), 0.0, 1e-3 * real.len());
+}
+
+TEST_F(MultipolesTests, RemovedAndMoved)
+{
+    oct.setMultipolesEnabled(true);
+    std::vector<std::shared_ptr<ElementValue>> elements;
+    for (int i=0; i<2000; i++)
+    {
+        Position p(sin(i * 1.3) * 5.0 + 2.0 * sin(i * 0.1), cos(i * 0.71) * 4.0, sin(i * 0.37 + 1.0) * cos(i * 0.11) * 6.0);
+        elements.push_back(make_shared<ElementValue>(p, 1.0 + 0.5 * sin(i * 0.9)));
+        oct.add(elements.back());
+    }
+    // Removing and moving collapse chains of nodes to single elements
+    for (size_t i=0; i<elements.size(); i += 3)
+        ASSERT_TRUE(oct.remove(*elements[i]));
+    for (size_t i=1; i<elements.size(); i += 3)
+    {
+        elements[i]->pos = elements[i]->pos * 0.5;
+        oct.update(*elements[i]);
+    }
+
+    // Nodes of single elements have no moments
+    for (size_t i=0; i<elements.size(); i++)
+    {
+        if (i % 3 == 0)
+            continue;
+        const Multipoles& m = elements[i]->parent->multipoles;
+        ASSERT_EQ(m.dipole, Position());
+        for (int j=0; j<6; j++)
+            ASSERT_EQ(m.quadrupole[j], 0.0);
+    }
+
+    Octree fresh;
+    fresh.setMultipolesEnabled(true);
+    for (size_t i=0; i<elements.size(); i++)
+    {
+        if (i % 3 != 0)
+            fresh.add(make_shared<ElementValue>(elements[i]->pos, elements[i]->value));
+    }
+    LinearScales fine(0.2);
+    Convolution<double> conv(fine);
+    for (int i=0; i<30; i++)
+    {
+        Position target(12.0 * cos(i * 0.7) * sin(i * 0.4 + 0.2), 12.0 * sin(i * 0.7) * sin(i * 0.4 + 0.2), 12.0 * cos(i * 0.4 + 0.2));
+        double expected = conv.convoluteMultipoles(fresh, target, multipolePotential);
+        ASSERT_NEAR(conv.convoluteMultipoles(oct, target, multipolePotential), expected, 1e-5 * expected);
+    }
+}
 
 class ConvolutionTestsTempated : public ::testing::Test
 {
@@ -0,0 +1,466 @@
+#include "linear-octree.hpp"
+#include "kernels.hpp"
+#include "streaming-builder.hpp"
+
+#include "test-utils.hpp"
+
+#include "gtest/gtest.h"
+
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include <cstddef>
+#include <thread>
+
+using namespace std;
+using namespace octree;
+
+class LinearOctreeTests : public ::testing::Test
+{
+public:
+    void addManyPoints()
+    {
+        PointsGenerator::addGrid(10, 10, oct, &positions);
+    }
+
+    Octree oct{Position(0.0, 0.0, 0.0), 20};
+    std::vector<Position> positions;
+
+    DiscreteScales scales;
+    Convolution<double> conv{scales};
+    Convolution<double>::Visitor coulomb =
+        [](const Position& target, const Position& object, double mass)
+        {
+            double d = (target-object).len();
+            if (d == 0.0)
+                return 0.0;
+            return mass/d;
+        };
+};
+
+TEST_F(LinearOctreeTests, EmptyTree)
+{
+    LinearOctree lin(oct);
+    ASSERT_TRUE(lin.empty());
+    ASSERT_EQ(lin.count(), 0);
+    ASSERT_EQ(lin.mass(), 0.0);
+    ASSERT_EQ(conv.convolute(lin, Position(0.0, 0.0, 0.0), coulomb), 0.0);
+    ASSERT_THROW(lin.getNearest(Position(0.0, 0.0, 0.0)), std::runtime_error);
+}
+
+TEST_F(LinearOctreeTests, Structure)
+{
+    addManyPoints();
+    LinearOctree lin(oct);
+    ASSERT_EQ(lin.count(), oct.count());
+    ASSERT_EQ(lin.root().elementsCount, oct.count());
+    ASSERT_NEAR(lin.mass(), oct.mass(), 1e-10);
+    ASSERT_EQ(lin.massCenter(), oct.massCenter());
+
+    for (int i=0; i<8; i++)
+    {
+        const LinearNode* child = lin.root().child(i);
+        ASSERT_EQ(child == nullptr, oct.root().subnodes[i] == nullptr);
+        if (child == nullptr)
+            continue;
+        ASSERT_EQ(child->center, oct.root().subnodes[i]->center);
+        ASSERT_EQ(child->elementsCount, oct.root().subnodes[i]->elementsCount());
+    }
+
+    std::vector<const Element*> elements;
+    oct.root().pushBackAllElements(elements);
+    for (uint32_t i=0; i<lin.count(); i++)
+    {
+        ASSERT_NE(lin.element(i), nullptr);
+        ASSERT_EQ(lin.element(i)->pos, lin.position(i));
+        ASSERT_EQ(lin.element(i), elements[lin.sourceIndex(i)]);
+    }
+}
+
+TEST_F(LinearOctreeTests, ConvoluteSameAsOctree)
+{
+    addManyPoints();
+    LinearOctree lin(oct);
+    Position p1 = {1.123, 2.345, 3.456};
+    ASSERT_EQ(conv.convolute(oct, p1, coulomb), conv.convolute(lin, p1, coulomb));
+
+    scales.addScale(5, 3);
+    scales.addScale(7, 10);
+    ASSERT_EQ(conv.convolute(oct, p1, coulomb), conv.convolute(lin, p1, coulomb));
+}
+
+TEST_F(LinearOctreeTests, FindNearest)
+{
+    addManyPoints();
+    LinearOctree lin(oct);
+    std::vector<Position> targets = {
+        {0.1, -0.8, 0.5}, {10, -678, -0.0001}, {1.0, -0.8, 0.5}, positions.front()
+    };
+    for (const auto& target : targets)
+    {
+        Position& brute = PointsGenerator::findNearestBruteForce(target, positions);
+        ASSERT_EQ(lin.position(lin.getNearest(target)), brute);
+    }
+}
+
+TEST_F(LinearOctreeTests, FindClose)
+{
+    addManyPoints();
+    LinearOctree lin(oct);
+    Position target(1.001, 1.001, 1.001);
+    for (double dist : {0.1, 1.1, 3.0, 100.0})
+    {
+        std::vector<Element*> expected;
+        std::vector<uint32_t> close;
+        oct.getClose(expected, target, dist);
+        lin.getClose(close, target, dist);
+        ASSERT_EQ(close.size(), expected.size());
+        for (uint32_t index : close)
+            ASSERT_LE(lin.position(index).distTo(target), dist);
+    }
+}
+
+class BucketedLinearOctreeTests : public ::testing::Test
+{
+public:
+    BucketedLinearOctreeTests()
+    {
+        for (int i=0; i<3000; i++)
+        {
+            positions.push_back(Position(sin(i * 1.3) * 5.0 + 2.0 * sin(i * 0.1), cos(i * 0.71) * 4.0, sin(i * 0.37 + 1.0) * cos(i * 0.11) * 6.0));
+            values.push_back(1.0 + 0.5 * sin(i * 0.9));
+        }
+    }
+
+    double potentialBruteForce(const Position& target)
+    {
+        double result = 0.0;
+        for (size_t i=0; i<positions.size(); i++)
+        {
+            double d = (target - positions[i]).len();
+            if (d != 0.0)
+                result += values[i] / d;
+        }
+        return result;
+    }
+
+    std::vector<Position> positions;
+    std::vector<double> values;
+    Convolution<double>::Visitor coulomb = CoulombPotentialKernel();
+};
+
+TEST_F(BucketedLinearOctreeTests, Structure)
+{
+    const uint32_t bucketSize = 16;
+    LinearOctree lin(positions.data(), values.data(), positions.size(), bucketSize);
+    ASSERT_EQ(lin.count(), positions.size());
+    ASSERT_EQ(lin.root().elementsCount, positions.size());
+    ASSERT_EQ(lin.element(0), nullptr);
+
+    double mass = 0.0;
+    for (double value : values)
+        mass += value;
+    ASSERT_NEAR(lin.mass(), mass, 1e-9);
+
+    LinearOctree single(positions.data(), values.data(), positions.size());
+    ASSERT_LT(lin.nodesCount() * 4, single.nodesCount());
+
+    for (size_t i=0; i<lin.nodesCount(); i++)
+    {
+        const LinearNode& n = (&lin.root())[i];
+        if (!n.isLeaf())
+            continue;
+        ASSERT_LE(n.elementsCount, bucketSize);
+        for (uint32_t j = n.elementsBegin; j != n.elementsBegin + n.elementsCount; j++)
+            ASSERT_TRUE(n.isInside(lin.position(j)));
+    }
+}
+
+TEST_F(BucketedLinearOctreeTests, CoincidentPoints)
+{
+    positions.push_back(positions.front());
+    values.push_back(2.0);
+    LinearOctree lin(positions.data(), values.data(), positions.size(), 1);
+    ASSERT_EQ(lin.count(), positions.size());
+    ASSERT_EQ(lin.position(lin.getNearest(positions.front())), positions.front());
+}
+
+TEST_F(BucketedLinearOctreeTests, ConvoluteWithDirectSums)
+{
+    LinearOctree lin(positions.data(), values.data(), positions.size(), 32);
+    LinearScales linear(0.3);
+    Convolution<double> conv(linear);
+    StaticConvolution<CoulombPotentialKernel> staticConv(linear);
+
+    // No averaging, so all leafs are summed directly
+    LinearScales exact(0.0);
+    StaticConvolution<CoulombPotentialKernel> exactConv(exact);
+
+    for (const Position& target : {Position(0.1, 0.2, 0.3), Position(7.0, -3.0, 2.0), positions[10]})
+    {
+        double real = potentialBruteForce(target);
+        ASSERT_NEAR(exactConv.convolute(lin, target), real, 1e-10 * real);
+        // Scalar sums by std::function visitor and vectorized ones differ by rounding only
+        ASSERT_NEAR(staticConv.convolute(lin, target), conv.convolute(lin, target, coulomb), 1e-10 * real);
+        ASSERT_NEAR(staticConv.convolute(lin, target), real, 1e-2 * real);
+    }
+}
+
+TEST_F(BucketedLinearOctreeTests, FindNearestAndClose)
+{
+    LinearOctree lin(positions.data(), values.data(), positions.size(), 8);
+    Position target(1.001, 1.001, 1.001);
+    Position& brute = PointsGenerator::findNearestBruteForce(target, positions);
+    ASSERT_EQ(lin.position(lin.getNearest(target)), brute);
+
+    std::vector<double> dists;
+    for (const Position& p : positions)
+        dists.push_back(p.distTo(target));
+    std::sort(dists.begin(), dists.end());
+    std::vector<uint32_t> nearest;
+    lin.getKNearest(nearest, target, 20);
+    ASSERT_EQ(nearest.size(), 20);
+    for (size_t i=0; i<nearest.size(); i++)
+        ASSERT_EQ(lin.position(nearest[i]).distTo(target), dists[i]);
+
+    for (double dist : {0.1, 1.1, 3.0, 100.0})
+    {
+        size_t expected = 0;
+        for (const Position& p : positions)
+            if (p.distTo(target) <= dist)
+                expected++;
+        std::vector<uint32_t> close;
+        lin.getClose(close, target, dist);
+        ASSERT_EQ(close.size(), expected);
+        for (uint32_t index : close)
+            ASSERT_LE(lin.position(index).distTo(target), dist);
+    }
+}
+
+TEST(Kernels, CoulombPotentialSum)
+{
+    std::vector<double> x, y, z, values;
+    for (int i=0; i<37; i++)
+    {
+        x.push_back(sin(i * 0.3));
+        y.push_back(cos(i * 0.7));
+        z.push_back(sin(i * 1.1));
+        values.push_back(1.0 + i * 0.1);
+    }
+    Position target(x[5], y[5], z[5]);
+    double expected = 0.0;
+    for (size_t i=0; i<x.size(); i++)
+    {
+        if (i != 5)
+            expected += values[i] / target.distTo(Position(x[i], y[i], z[i]));
+    }
+    for (SimdLevel level : {SimdLevel::scalar, SimdLevel::avx2, SimdLevel::avx512})
+    {
+        ASSERT_NEAR(coulombPotentialSum(target, x.data(), y.data(), z.data(), values.data(), x.size(), level), expected, 1e-12 * expected);
+        ASSERT_EQ(coulombPotentialSum(target, x.data(), y.data(), z.data(), values.data(), 0, level), 0.0);
+    }
+}
+
+TEST_F(BucketedLinearOctreeTests, SourceIndexesAndValuesUpdate)
+{
+    LinearOctree lin(positions.data(), values.data(), positions.size(), 8);
+    for (uint32_t i=0; i<lin.count(); i++)
+    {
+        uint32_t source = lin.sourceIndex(i);
+        ASSERT_EQ(lin.position(i), positions[source]);
+        ASSERT_EQ(lin.value(i), values[source]);
+    }
+
+    for (size_t i=0; i<values.size(); i++)
+        values[i] = i % 2 == 0 ? 1.0 : 3.0;
+    lin.updateValues(values.data());
+    LinearOctree rebuilt(positions.data(), values.data(), positions.size(), 8);
+    ASSERT_EQ(lin.nodesCount(), rebuilt.nodesCount());
+    for (size_t i=0; i<lin.nodesCount(); i++)
+    {
+        ASSERT_EQ((&lin.root())[i].mass, (&rebuilt.root())[i].mass);
+        ASSERT_EQ((&lin.root())[i].massCenter, (&rebuilt.root())[i].massCenter);
+    }
+}
+
+TEST_F(BucketedLinearOctreeTests, BatchQueries)
+{
+    LinearOctree lin(positions.data(), values.data(), positions.size(), 8);
+    std::vector<Position> points;
+    std::vector<double> radii;
+    for (int i=0; i<500; i++)
+    {
+        points.push_back(Position(sin(i * 0.1) * 6.0, cos(i * 0.37) * 5.0, sin(i * 0.71) * 7.0));
+        radii.push_back(0.2 + (i % 7) * 0.1);
+    }
+
+    ThreadPool pool(4);
+    std::vector<uint32_t> nearest(points.size());
+    lin.getNearestMany(points.data(), points.size(), nearest.data(), &pool);
+    std::vector<size_t> offsets;
+    std::vector<uint32_t> indexes;
+    lin.getCloseMany(points.data(), radii.data(), points.size(), offsets, indexes, &pool);
+    ASSERT_EQ(offsets.size(), points.size() + 1);
+    ASSERT_EQ(offsets.back(), indexes.size());
+
+    for (size_t i=0; i<points.size(); i++)
+    {
+        ASSERT_EQ(nearest[i], lin.getNearest(points[i]));
+        std::vector<uint32_t> close;
+        lin.getClose(close, points[i], radii[i]);
+        ASSERT_EQ(std::vector<uint32_t>(indexes.begin() + offsets[i], indexes.begin() + offsets[i + 1]), close);
+    }
+}
+
+TEST_F(BucketedLinearOctreeTests, SnapshotSaveAndMap)
+{
+    const std::string path = "linear-octree-snapshot.bin";
+    LinearOctree lin(positions.data(), values.data(), positions.size(), 8);
+    lin.save(path);
+
+    LinearOctree mapped;
+    mapped.load(path);
+    ASSERT_TRUE(mapped.isMapped());
+    ASSERT_EQ(mapped.count(), lin.count());
+    ASSERT_EQ(mapped.nodesCount(), lin.nodesCount());
+    ASSERT_EQ(mapped.mass(), lin.mass());
+    for (uint32_t i=0; i<lin.count(); i++)
+    {
+        ASSERT_EQ(mapped.position(i), lin.position(i));
+        ASSERT_EQ(mapped.sourceIndex(i), lin.sourceIndex(i));
+        ASSERT_EQ(mapped.element(i), nullptr);
+    }
+
+    LinearScales scales(0.3);
+    StaticConvolution<CoulombPotentialKernel> conv(scales);
+    Position target(0.1, 0.2, 0.3);
+    ASSERT_EQ(conv.convolute(mapped, target), conv.convolute(lin, target));
+    std::vector<uint32_t> expected, found;
+    lin.getKNearest(expected, target, 10);
+    mapped.getKNearest(found, target, 10);
+    ASSERT_EQ(found, expected);
+
+    // Values of mapped tree are changed in private pages only
+    LinearOctree moved(std::move(mapped));
+    ASSERT_TRUE(mapped.empty());
+    std::vector<double> ones(values.size(), 1.0);
+    moved.updateValues(ones.data());
+    ASSERT_NEAR(moved.mass(), values.size(), 1e-9);
+    LinearOctree reloaded;
+    reloaded.load(path);
+    ASSERT_EQ(reloaded.mass(), lin.mass());
+
+    // Copy of mapped tree has own tables
+    LinearOctree copy(reloaded);
+    ASSERT_FALSE(copy.isMapped());
+    copy.updateValues(ones.data());
+    ASSERT_NEAR(copy.mass(), values.size(), 1e-9);
+    ASSERT_EQ(reloaded.mass(), lin.mass());
+    ASSERT_EQ(copy.getNearest(target), reloaded.getNearest(target));
+
+    // Octree is saved through linear representation
+    Octree oct;
+    oct.build(positions.data(), values.data(), positions.size());
+    const std::string octreePath = "octree-snapshot.bin";
+    oct.save(octreePath);
+    Octree loaded;
+    loaded.load(octreePath);
+    std::remove(octreePath.c_str());
+    ASSERT_EQ(loaded.count(), oct.count());
+    ASSERT_NEAR(loaded.mass(), oct.mass(), 1e-9);
+    ASSERT_EQ(loaded.getNearest(positions[7]).pos, positions[7]);
+
+    // Mapped file should not be changed, so other file is damaged
+    const std::string wrongPath = "linear-octree-wrong.bin";
+    std::ofstream(wrongPath, std::ios::binary | std::ios::trunc) << "not a snapshot";
+    ASSERT_THROW(reloaded.load(wrongPath), std::runtime_error);
+    ASSERT_EQ(reloaded.mass(), lin.mass());
+    std::remove(wrongPath.c_str());
+    ASSERT_THROW(reloaded.load(wrongPath), std::runtime_error);
+
+    // Nodes are saved without uninitialized padding and their links are validated on load
+    std::ifstream file(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+    const LinearNode& root = lin.root();
+    size_t rootOffset = data.find(std::string(reinterpret_cast<const char*>(&root), sizeof(LinearNode)));
+    ASSERT_NE(rootOffset, std::string::npos);
+    for (size_t i=0; i<lin.nodesCount(); i++)
+    {
+        const char* node = data.data() + rootOffset + i * sizeof(LinearNode);
+        for (size_t j = offsetof(LinearNode, childrenMask) + 1; j < sizeof(LinearNode); j++)
+            ASSERT_EQ(node[j], 0);
+    }
+    uint32_t damagedOffset = lin.nodesCount();
+    data.replace(rootOffset + offsetof(LinearNode, childrenOffset), sizeof(uint32_t),
+                 reinterpret_cast<const char*>(&damagedOffset), sizeof(uint32_t));
+    std::ofstream(wrongPath, std::ios::binary | std::ios::trunc) << data;
+    ASSERT_THROW(reloaded.load(wrongPath), std::runtime_error);
+    std::remove(wrongPath.c_str());
+    std::remove(path.c_str());
+}
+
+TEST_F(BucketedLinearOctreeTests, StreamingBuilder)
+{
+    const std::string inputPath = "streaming-input.bin";
+    const std::string outputPath = "streaming-snapshot.bin";
+    {
+        std::ofstream input(inputPath, std::ios::binary | std::ios::trunc);
+        for (size_t i=0; i<positions.size(); i++)
+        {
+            StreamingBuilder::Point point = {{positions[i][0], positions[i][1], positions[i][2]}, values[i]};
+            input.write(reinterpret_cast<const char*>(&point), sizeof(point));
+        }
+    }
+    LinearOctree lin(positions.data(), values.data(), positions.size(), 8);
+
+    // Budget is enough for a few hundreds of points, so cells are split to temporary files
+    StreamingBuilder builder(300 * 256, ".", 8);
+    builder.build(inputPath, outputPath);
+    ASSERT_GT(builder.cellsCount(), 8u);
+
+    LinearOctree streamed;
+    streamed.load(outputPath);
+    ASSERT_EQ(streamed.count(), lin.count());
+    ASSERT_EQ(streamed.nodesCount(), lin.nodesCount());
+    for (size_t i=0; i<lin.nodesCount(); i++)
+    {
+        const LinearNode& expected = (&lin.root())[i];
+        const LinearNode& node = (&streamed.root())[i];
+        ASSERT_EQ(node.center, expected.center);
+        ASSERT_EQ(node.childrenOffset, expected.childrenOffset);
+        ASSERT_EQ(node.childrenMask, expected.childrenMask);
+        ASSERT_EQ(node.elementsBegin, expected.elementsBegin);
+        ASSERT_EQ(node.elementsCount, expected.elementsCount);
+        ASSERT_NEAR(node.mass, expected.mass, 1e-9);
+    }
+    for (uint32_t i=0; i<lin.count(); i++)
+    {
+        ASSERT_EQ(streamed.position(i), lin.position(i));
+        ASSERT_EQ(streamed.sourceIndex(i), lin.sourceIndex(i));
+    }
+
+    // Builders that share temporary directory do not use the same files
+    const std::string otherPath = "streaming-snapshot-other.bin";
+    StreamingBuilder other(300 * 256, ".", 8);
+    std::thread otherBuild([&other, &inputPath, &otherPath]() { other.build(inputPath, otherPath); });
+    builder.build(inputPath, outputPath);
+    otherBuild.join();
+    LinearOctree otherStreamed;
+    otherStreamed.load(otherPath);
+    streamed.load(outputPath);
+    ASSERT_EQ(otherStreamed.nodesCount(), lin.nodesCount());
+    for (uint32_t i=0; i<lin.count(); i++)
+    {
+        ASSERT_EQ(otherStreamed.position(i), lin.position(i));
+        ASSERT_EQ(streamed.position(i), lin.position(i));
+    }
+    std::remove(otherPath.c_str());
+
+    // The whole input fits in memory
+    StreamingBuilder large(positions.size() * 1024, ".", 8);
+    large.build(inputPath, outputPath);
+    ASSERT_EQ(large.cellsCount(), 1u);
+    std::remove(inputPath.c_str());
+    std::remove(outputPath.c_str());
+}
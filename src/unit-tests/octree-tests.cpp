@@ -1,4 +1,7 @@
 #include "octree.hpp"
+#include "thread-pool.hpp"
+#include "memory.hpp"
+#include "kernels.hpp"
 
 #include "test-utils.hpp"
 
@@ -6,6 +9,11 @@
 
 #include <iostream>
 #include <fstream>
+#include <random>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
 
 using namespace std;
 using namespace octree;
@@ -35,6 +43,34 @@ TEST(Node, DistToNode)
 	EXPECT_NEAR(d2.farest, 3*sqrt(3.0), 1e-6);
 }
 
+TEST(Node, SubnodesSquaredDists)
+{
+    const double x[] = {10.0, 20.0, 30.0};
+    Node n(nullptr, x, 4.0);
+    for (const Position& pos : {Position(10.5, 19.0, 30.2), Position(13.0, 20.5, 30.0), Position(2.0, 25.0, 41.0)})
+    {
+        for (SimdLevel level : {SimdLevel::scalar, SimdLevel::avx2, SimdLevel::avx512})
+        {
+            double nearest[8], farest[8];
+            childrenSquaredDists(pos, n.center, n.size, nearest, farest, level);
+            for (int i=0; i<8; i++)
+            {
+                SubdivisionPos subdivision;
+                for (int k=0; k<3; k++)
+                    subdivision.s[k] = (i >> k) & 1;
+                ASSERT_EQ(subdivision.index(), i);
+                Node child(nullptr, subdivision, &n);
+                DistToNode d = child.getDistsToNode(pos);
+                ASSERT_NEAR(sqrt(nearest[i]), d.nearest, 1e-12);
+                ASSERT_NEAR(sqrt(farest[i]), d.farest, 1e-12);
+            }
+        }
+    }
+    // Nearest distance is measured to box face, not to the nearest corner
+    DistToNode d = n.getDistsToNode(Position(13.0, 20.5, 30.0));
+    ASSERT_NEAR(d.nearest, 1.0, 1e-12);
+}
+
 TEST(OctreeBase, Instantiation)
 {
 	ASSERT_NO_THROW(Octree());
@@ -325,6 +361,106 @@ TEST_F(OctreeAccessAutoSize, FindNearest20)
     // @todo: empty, only one
 }
 
+TEST_F(OctreeAccessAutoSize, FindKNearest)
+{
+    for (int i=0; i<500; i++)
+        addElement(Position(sin(i * 1.3) * 5.0, cos(i * 0.71) * 4.0, sin(i * 0.37 + 1.0) * 6.0));
+
+    std::vector<const Element*> nearest;
+    oct.getKNearest(nearest, Position(0.0, 0.0, 0.0), 0);
+    ASSERT_TRUE(nearest.empty());
+
+    for (const Position& target : {Position(0.1, -0.8, 0.5), Position(10.0, -20.0, 3.0), positions[7]})
+    {
+        std::vector<double> dists;
+        for (const Position& p : positions)
+            dists.push_back(p.distTo(target));
+        std::sort(dists.begin(), dists.end());
+
+        oct.getKNearest(nearest, target, 10);
+        ASSERT_EQ(nearest.size(), 10);
+        for (size_t i=0; i<nearest.size(); i++)
+            ASSERT_EQ(nearest[i]->pos.distTo(target), dists[i]);
+        ASSERT_EQ(&oct.getNearest(target), nearest.front());
+
+        // Approximate search gives not too far elements
+        const double epsilon = 0.5;
+        oct.getKNearest(nearest, target, 10, epsilon);
+        ASSERT_EQ(nearest.size(), 10);
+        for (size_t i=0; i<nearest.size(); i++)
+            ASSERT_LE(nearest[i]->pos.distTo(target), dists[i] * (1.0 + epsilon));
+    }
+
+    oct.getKNearest(nearest, Position(0.0, 0.0, 0.0), 1000);
+    ASSERT_EQ(nearest.size(), positions.size());
+}
+
+TEST_F(OctreeAccessAutoSize, BatchQueries)
+{
+    PointsGenerator::addGrid(10, 1.0, oct, &positions);
+    std::vector<Position> points;
+    std::vector<double> radii;
+    for (int i=0; i<300; i++)
+    {
+        points.push_back(Position(sin(i * 0.1) * 6.0, cos(i * 0.37) * 5.0, sin(i * 0.71) * 7.0));
+        radii.push_back(0.5 + (i % 5) * 0.5);
+    }
+
+    ThreadPool pool(4);
+    std::vector<const Element*> nearest(points.size());
+    oct.getNearestMany(points.data(), points.size(), nearest.data(), &pool);
+    std::vector<size_t> offsets;
+    std::vector<Element*> elements;
+    oct.getCloseMany(points.data(), radii.data(), points.size(), offsets, elements, &pool);
+    ASSERT_EQ(offsets.size(), points.size() + 1);
+    ASSERT_EQ(offsets.back(), elements.size());
+
+    for (size_t i=0; i<points.size(); i++)
+    {
+        ASSERT_EQ(nearest[i], &oct.getNearest(points[i]));
+        std::vector<Element*> close;
+        oct.getClose(close, points[i], radii[i]);
+        ASSERT_EQ(std::vector<Element*>(elements.begin() + offsets[i], elements.begin() + offsets[i + 1]), close);
+    }
+
+    Octree empty;
+    empty.getCloseMany(points.data(), radii.data(), points.size(), offsets, elements, &pool);
+    ASSERT_EQ(offsets.size(), points.size() + 1);
+    ASSERT_TRUE(elements.empty());
+}
+
+TEST_F(OctreeAccessAutoSize, CloseCallbacksAndCounts)
+{
+    PointsGenerator::addGrid(10, 1.0, oct, &positions);
+    Position target(1.001, 1.001, 1.001);
+    for (double dist : {0.1, 1.1, 3.0, 100.0})
+    {
+        std::vector<Element*> expected;
+        oct.getClose(expected, target, dist);
+
+        std::vector<Element*> visited;
+        ASSERT_TRUE(oct.getClose(target, dist, [&visited](Element* e) { visited.push_back(e); return true; }));
+        std::sort(visited.begin(), visited.end());
+        std::sort(expected.begin(), expected.end());
+        ASSERT_EQ(visited, expected);
+
+        double sum = 0.0;
+        for (Element* e : expected)
+            sum += e->value;
+        ASSERT_EQ(oct.countClose(target, dist), expected.size());
+        ASSERT_NEAR(oct.sumClose(target, dist), sum, 1e-9);
+    }
+
+    // Early exit
+    size_t calls = 0;
+    ASSERT_FALSE(oct.getClose(target, 100.0, [&calls](Element*) { return ++calls < 5; }));
+    ASSERT_EQ(calls, 5);
+
+    Octree empty;
+    ASSERT_EQ(empty.countClose(target, 100.0), 0);
+    ASSERT_EQ(empty.sumClose(target, 100.0), 0.0);
+}
+
 TEST_F(OctreeAccessAutoSize, FindClose0)
 {
     std::vector<Element*> close;
@@ -400,3 +536,515 @@ TEST(MassCenter, ManyPoints)
     ASSERT_NEAR(c[2], 0.0, 1e-10);
 }
 
+
+//////////////////////////
+// Memory
+TEST(FixedSizePool, ReusesReleasedBlocks)
+{
+    FixedSizePool pool(24, 4);
+    std::vector<void*> blocks;
+    for (int i=0; i<10; i++)
+        blocks.push_back(pool.allocate());
+    ASSERT_EQ(pool.slabsCount(), 3);
+    ASSERT_EQ(pool.usedCount(), 10);
+    for (void* block : blocks)
+        ASSERT_EQ(reinterpret_cast<uintptr_t>(block) % alignof(std::max_align_t), 0);
+
+    void* released = blocks[3];
+    pool.release(released);
+    ASSERT_EQ(pool.allocate(), released);
+    ASSERT_EQ(pool.slabsCount(), 3);
+
+    pool.clear();
+    ASSERT_EQ(pool.slabsCount(), 0);
+    ASSERT_EQ(pool.usedCount(), 0);
+}
+
+TEST(Arena, AllocateShared)
+{
+    std::weak_ptr<Arena> weakArena;
+    std::shared_ptr<ElementValue> element;
+    {
+        auto arena = std::make_shared<Arena>(256);
+        weakArena = arena;
+        ArenaAllocator<ElementValue> allocator(arena);
+        for (int i=0; i<100; i++)
+            element = std::allocate_shared<ElementValue>(allocator, Position(i, 0.0, 0.0), i);
+        ASSERT_GT(arena->reservedBytes(), 100 * sizeof(ElementValue));
+    }
+    // Element keeps its arena alive
+    ASSERT_FALSE(weakArena.expired());
+    ASSERT_EQ(element->value, 99.0);
+    element.reset();
+    ASSERT_TRUE(weakArena.expired());
+}
+
+TEST(OctreeMemory, ClearAndRefill)
+{
+    Octree oct;
+    std::vector<Position> positions;
+    for (int round=0; round<2; round++)
+    {
+        PointsGenerator::addGrid(10, 10, oct, &positions);
+        auto kept = std::make_shared<ElementValue>(Position(100.0, 0.0, 0.0), 1.0);
+        oct.add(kept);
+        ASSERT_EQ(oct.count(), positions.size() + 1);
+        oct.clear();
+        positions.clear();
+        ASSERT_TRUE(oct.empty());
+        // Nodes released their elements
+        ASSERT_EQ(kept.use_count(), 1);
+    }
+}
+
+TEST(OctreeAggregates, DirtyNodesUpdate)
+{
+    Octree oct;
+    PointsGenerator::addGrid(8, 10, oct, nullptr);
+
+    // Several elements are added far from the grid, so the root is enlarged while muted
+    std::vector<std::shared_ptr<ElementValue>> added;
+    {
+        CenterMassUpdatingMute m(oct);
+        added.push_back(std::make_shared<ElementValue>(Position(40.0, 1.0, 2.0), 3.0));
+        added.push_back(std::make_shared<ElementValue>(Position(1.0, 1.0, 1.0), 2.0));
+        for (auto& e : added)
+            oct.add(e);
+        // Root is not recalculated by itself while muted
+        ASSERT_TRUE(oct.root().isDirty());
+        EXPECT_NEAR(oct.mass(), 8*8*8 + 5.0, 1e-9);
+        ASSERT_FALSE(oct.root().isDirty());
+        added.back()->storedValue = 4.0;
+        oct.elementChanged(*added.back());
+    }
+
+    Octree fresh;
+    PointsGenerator::addGrid(8, 10, fresh, nullptr);
+    fresh.add(std::make_shared<ElementValue>(Position(40.0, 1.0, 2.0), 3.0));
+    fresh.add(std::make_shared<ElementValue>(Position(1.0, 1.0, 1.0), 4.0));
+
+    EXPECT_NEAR(oct.mass(), fresh.mass(), 1e-9);
+    for (int i=0; i<3; i++)
+        EXPECT_NEAR(oct.massCenter().x[i], fresh.massCenter().x[i], 1e-9);
+    EXPECT_FALSE(added.back()->parent->isDirty());
+
+    // Enabled calculation updates immediately
+    added.back()->storedValue = 1.0;
+    oct.elementChanged(*added.back());
+    EXPECT_NEAR(oct.root().mass, fresh.mass() - 3.0, 1e-9);
+}
+
+TEST(OctreeAggregates, ParallelUpdateIsDeterministic)
+{
+    const int count = 60000;
+    Octree trees[2];
+    std::vector<std::shared_ptr<ElementValue>> elements[2];
+    for (int t=0; t<2; t++)
+    {
+        trees[t].muteCenterMassCalculation();
+        // Multipoles enabled while muted make all nodes dirty
+        trees[t].setMultipolesEnabled(true);
+        for (int i=0; i<count; i++)
+        {
+            Position p(sin(i * 1.1) * 10.0, cos(i * 0.7) * 3.0, sin(i * 0.3 + 1.0) * 5.0);
+            elements[t].push_back(std::make_shared<ElementValue>(p, 0.1 + i % 7 * 0.37));
+            trees[t].add(elements[t].back());
+        }
+    }
+
+    auto compare = [&trees]()
+    {
+        std::vector<const Node*> nodes[2];
+        for (int t=0; t<2; t++)
+            nodes[t].push_back(&trees[t].root());
+        for (size_t i=0; i<nodes[0].size(); i++)
+        {
+            const Node& a = *nodes[0][i];
+            const Node& b = *nodes[1][i];
+            // Results should be the same bit to bit
+            ASSERT_EQ(a.mass, b.mass);
+            ASSERT_EQ(a.absMass, b.absMass);
+            ASSERT_EQ(a.massCenter, b.massCenter);
+            ASSERT_EQ(a.multipoles.dipole, b.multipoles.dipole);
+            for (int j=0; j<6; j++)
+                ASSERT_EQ(a.multipoles.quadrupole[j], b.multipoles.quadrupole[j]);
+            ASSERT_FALSE(a.isDirty());
+            a.pushBackSubnodes(nodes[0]);
+            b.pushBackSubnodes(nodes[1]);
+            ASSERT_EQ(nodes[0].size(), nodes[1].size());
+        }
+    };
+
+    ThreadPool single(1), several(4);
+    trees[0].updateDirtyNodes(&single);
+    trees[1].updateDirtyNodes(&several);
+    compare();
+
+    // Only changed paths are updated
+    for (int t=0; t<2; t++)
+    {
+        for (int i=0; i<count; i+=13)
+        {
+            elements[t][i]->storedValue = -1.0;
+            trees[t].elementChanged(*elements[t][i]);
+        }
+    }
+    trees[0].updateDirtyNodes(&several);
+    trees[1].updateDirtyNodes(&single);
+    compare();
+}
+
+namespace {
+
+/// Check that stored counts match subtrees, there are no empty nodes except root
+/// and single elements are held by the highest possible nodes
+size_t checkSubtree(const Node& node, bool isRoot)
+{
+    std::vector<const Node*> subnodes;
+    node.pushBackSubnodes(subnodes);
+    size_t count = node.element != nullptr ? 1 : 0;
+    for (const Node* subnode : subnodes)
+        count += checkSubtree(*subnode, false);
+    EXPECT_EQ(node.elementsCount(), count);
+    if (!isRoot)
+    {
+        EXPECT_GT(count, 0u);
+    }
+    if (count == 1)
+    {
+        EXPECT_NE(node.element, nullptr);
+    }
+    return count;
+}
+
+}
+
+TEST(OctreeUpdate, MovedElements)
+{
+    std::mt19937 generator(17);
+    std::uniform_real_distribution<double> coordinate(-5.0, 5.0);
+    std::normal_distribution<double> step(0.0, 0.3);
+
+    Octree oct;
+    std::vector<std::shared_ptr<ElementValue>> elements;
+    for (int i=0; i<3000; i++)
+    {
+        elements.push_back(std::make_shared<ElementValue>(
+            Position(coordinate(generator), coordinate(generator), coordinate(generator)), 1.0 + i % 3));
+        oct.add(elements.back());
+    }
+
+    for (int round=0; round<3; round++)
+    {
+        for (auto& e : elements)
+            for (int i=0; i<3; i++)
+                e->pos.x[i] += step(generator);
+        oct.update();
+
+        ASSERT_EQ(oct.count(), elements.size());
+        checkSubtree(oct.root(), true);
+        Position massCenter;
+        double mass = 0.0;
+        for (auto& e : elements)
+        {
+            ASSERT_NE(e->parent, nullptr);
+            ASSERT_EQ(e->parent->element.get(), e.get());
+            ASSERT_TRUE(e->parent->isInside(e->pos));
+            massCenter += e->pos * e->value;
+            mass += e->value;
+        }
+        massCenter /= mass;
+        EXPECT_NEAR(oct.mass(), mass, 1e-9);
+        for (int i=0; i<3; i++)
+            EXPECT_NEAR(oct.massCenter().x[i], massCenter.x[i], 1e-9);
+    }
+
+    // Element of other octree is not touched
+    Octree other;
+    auto alien = std::make_shared<ElementValue>(Position(20.0, 0.0, 0.0), 1.0);
+    other.add(alien);
+    alien->pos = Position(21.0, 0.0, 0.0);
+    EXPECT_FALSE(oct.update(*alien));
+    EXPECT_EQ(oct.count(), elements.size());
+    EXPECT_EQ(other.count(), 1u);
+    EXPECT_EQ(alien->parent, &other.root());
+
+    // Element is kept by tree when its new place is taken
+    std::weak_ptr<ElementValue> moved = elements[1];
+    Node* leaf = elements[1]->parent;
+    Position old = elements[1]->pos;
+    elements[1]->pos = elements[2]->pos;
+    EXPECT_THROW(oct.update(*elements[1]), std::runtime_error);
+    EXPECT_EQ(elements[1]->parent, leaf);
+    EXPECT_EQ(oct.count(), elements.size());
+    checkSubtree(oct.root(), true);
+    elements[1]->pos = old;
+    elements[1].reset();
+    EXPECT_FALSE(moved.expired());
+    EXPECT_FALSE(oct.update(*moved.lock()));
+    elements[1] = moved.lock();
+
+    // Element leaving the root goes to enlarged root
+    elements[0]->pos = Position(100.0, 0.0, 0.0);
+    EXPECT_TRUE(oct.update(*elements[0]));
+    EXPECT_EQ(oct.count(), elements.size());
+    checkSubtree(oct.root(), true);
+    EXPECT_EQ(&oct.getNearest(Position(99.0, 0.0, 0.0)), elements[0].get());
+}
+
+TEST(OctreeUpdate, RemoveElements)
+{
+    std::mt19937 generator(23);
+    std::uniform_real_distribution<double> coordinate(-5.0, 5.0);
+
+    Octree oct;
+    std::vector<std::shared_ptr<ElementValue>> elements;
+    for (int i=0; i<2000; i++)
+    {
+        elements.push_back(std::make_shared<ElementValue>(
+            Position(coordinate(generator), coordinate(generator), coordinate(generator)), 1.0));
+        oct.add(elements.back());
+    }
+    ElementValue alien(Position(0.0, 0.0, 0.0), 1.0);
+    EXPECT_FALSE(oct.remove(alien));
+
+    std::shuffle(elements.begin(), elements.end(), generator);
+    while (elements.size() > 1)
+    {
+        size_t removed = elements.size() / 2;
+        for (size_t i=0; i<removed; i++)
+        {
+            ASSERT_TRUE(oct.remove(*elements.back()));
+            EXPECT_EQ(elements.back()->parent, nullptr);
+            elements.pop_back();
+        }
+        ASSERT_EQ(oct.count(), elements.size());
+        checkSubtree(oct.root(), true);
+        EXPECT_NEAR(oct.mass(), elements.size(), 1e-9);
+        std::vector<Element*> found;
+        oct.getClose(found, Position(0.0, 0.0, 0.0), 100.0);
+        EXPECT_EQ(found.size(), elements.size());
+    }
+
+    // Last element is held by root itself
+    EXPECT_EQ(oct.root().element.get(), elements[0].get());
+    ASSERT_TRUE(oct.remove(*elements[0]));
+    EXPECT_TRUE(oct.empty());
+    oct.add(elements[0]);
+    EXPECT_EQ(oct.count(), 1u);
+}
+
+TEST(OctreeMemory, Move)
+{
+    Octree oct;
+    std::vector<Position> positions;
+    PointsGenerator::addGrid(10, 10, oct, &positions);
+    double mass = oct.mass();
+
+    Octree moved(std::move(oct));
+    ASSERT_TRUE(oct.empty());
+    ASSERT_EQ(moved.count(), positions.size());
+    ASSERT_EQ(moved.getNearest(positions[17]).pos, positions[17]);
+    // Nodes belong to new octree, so they are created and deleted by its pool
+    auto far = std::make_shared<ElementValue>(Position(100.0, 0.0, 0.0), 1.0);
+    moved.add(far);
+    ASSERT_NEAR(moved.mass(), mass + 1.0, 1e-9);
+    ASSERT_TRUE(moved.remove(*far));
+    checkSubtree(moved.root(), true);
+
+    // Moved octree may be used again
+    PointsGenerator::addGrid(3, 1, oct, nullptr);
+    ASSERT_EQ(oct.count(), 27u);
+    moved = std::move(oct);
+    ASSERT_TRUE(oct.empty());
+    ASSERT_EQ(moved.count(), 27u);
+    ASSERT_NEAR(moved.mass(), 27.0, 1e-9);
+    checkSubtree(moved.root(), true);
+}
+
+//////////////////////////
+// Bulk building
+TEST(ThreadPool, ParallelForCoversRange)
+{
+    ThreadPool pool(4);
+    std::vector<int> hits(10000, 0);
+    pool.parallelFor(hits.size(), 100,
+        [&hits](unsigned worker, size_t begin, size_t end)
+        {
+            for (size_t i=begin; i<end; i++)
+                hits[i]++;
+        }
+    );
+    for (int h : hits)
+        ASSERT_EQ(h, 1);
+    ASSERT_THROW(
+        pool.parallelFor(1000, 10, [](unsigned, size_t, size_t) { throw std::runtime_error("test"); }),
+        std::runtime_error
+    );
+    // Nested call of smaller pool gets worker index valid for it
+    ThreadPool small(2);
+    std::atomic<unsigned> maxInner{0};
+    pool.parallelFor(64, 1,
+        [&small, &maxInner](unsigned, size_t, size_t)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            small.parallelFor(10, 1,
+                [&maxInner](unsigned worker, size_t, size_t)
+                {
+                    unsigned current = maxInner.load();
+                    while (worker > current && !maxInner.compare_exchange_weak(current, worker))
+                        ;
+                }
+            );
+        }
+    );
+    ASSERT_LT(maxInner.load(), small.threadsCount());
+
+    // Threads of other pool do not share worker index, and index of outer loop is restored after inner one
+    std::atomic<bool> busy[2] = {{false}, {false}};
+    std::atomic<int> shared{0}, lost{0};
+    pool.parallelFor(16, 1,
+        [&pool, &small, &busy, &shared, &lost](unsigned outer, size_t, size_t)
+        {
+            small.parallelFor(1, 1,
+                [&busy, &shared](unsigned worker, size_t, size_t)
+                {
+                    if (busy[worker].exchange(true))
+                        shared++;
+                    std::this_thread::sleep_for(std::chrono::microseconds(500));
+                    busy[worker] = false;
+                }
+            );
+            pool.parallelFor(1, 1,
+                [outer, &lost](unsigned worker, size_t, size_t)
+                {
+                    if (worker != outer)
+                        lost++;
+                }
+            );
+        }
+    );
+    ASSERT_EQ(shared.load(), 0);
+    ASSERT_EQ(lost.load(), 0);
+}
+
+TEST(OctreeBuild, SameAsAdding)
+{
+    Octree added;
+    std::vector<Position> positions;
+    PointsGenerator::addGrid(10, 1.0, added, &positions);
+    std::vector<double> values(positions.size(), 1.0);
+
+    ThreadPool pool(4);
+    Octree built;
+    ASSERT_NO_THROW(built.build(positions.data(), values.data(), positions.size(), &pool));
+    ASSERT_EQ(built.count(), added.count());
+    ASSERT_NEAR(built.mass(), added.mass(), 1e-10);
+    ASSERT_NEAR(built.massCenter()[0], added.massCenter()[0], 1e-10);
+    ASSERT_NEAR(built.massCenter()[1], added.massCenter()[1], 1e-10);
+    ASSERT_NEAR(built.massCenter()[2], added.massCenter()[2], 1e-10);
+
+    Position target(0.1, -0.8, 0.5);
+    ASSERT_EQ(built.getNearest(target).pos, PointsGenerator::findNearestBruteForce(target, positions));
+    std::vector<Element*> close, closeAdded;
+    built.getClose(close, target, 0.3);
+    added.getClose(closeAdded, target, 0.3);
+    ASSERT_EQ(close.size(), closeAdded.size());
+
+    // Tree may be extended after building
+    ASSERT_NO_THROW(built.add(make_shared<ElementValue>(Position(10.0, 10.0, 10.0), 1.0)));
+    ASSERT_EQ(built.count(), positions.size() + 1);
+}
+
+TEST(OctreeBuild, ManyElements)
+{
+    std::vector<std::shared_ptr<Element>> elements;
+    std::vector<Position> positions;
+    double mass = 0.0;
+    for (int i=0; i<100000; i++)
+    {
+        Position p(sin(i * 1.1) * 10.0, cos(i * 0.7) * 3.0, sin(i * 0.3 + 1.0) * 5.0);
+        elements.push_back(make_shared<ElementValue>(p, i % 7));
+        positions.push_back(p);
+        mass += i % 7;
+    }
+    ThreadPool pool(4);
+    Octree oct(Position(100.0, 0.0, 0.0), 1.0);
+    ASSERT_NO_THROW(oct.build(elements, &pool));
+    ASSERT_EQ(oct.count(), elements.size());
+    ASSERT_NEAR(oct.mass(), mass, 1e-6);
+    for (auto& e : elements)
+    {
+        ASSERT_NE(e->parent, nullptr);
+        ASSERT_EQ(e->parent->element.get(), e.get());
+    }
+    Position target(1.0, 2.0, 3.0);
+    ASSERT_EQ(oct.getNearest(target).pos, PointsGenerator::findNearestBruteForce(target, positions));
+}
+
+TEST(OctreeBuild, SamePlace)
+{
+    std::vector<Position> positions = {{1.0, 2.0, 3.0}, {0.0, 0.0, 0.0}, {1.0, 2.0, 3.0}};
+    Octree oct;
+    ASSERT_THROW(oct.build(positions.data(), nullptr, positions.size()), std::runtime_error);
+    ASSERT_TRUE(oct.empty());
+}
+
+TEST(OctreeAddMany, SameAsAdding)
+{
+    std::mt19937 generator(5);
+    std::uniform_real_distribution<double> coordinate(-5.0, 5.0);
+    std::vector<std::shared_ptr<Element>> first, second;
+    for (int i=0; i<300; i++)
+        first.push_back(make_shared<ElementValue>(Position(coordinate(generator), coordinate(generator), coordinate(generator)), 1.0));
+    // Second part is clustered and goes out of initial root
+    for (int i=0; i<20000; i++)
+        second.push_back(make_shared<ElementValue>(
+            Position(coordinate(generator) * 0.1 + 20.0, coordinate(generator), coordinate(generator) * 0.01), 1.0 + i % 3));
+
+    Octree added, addedMany;
+    for (auto& e : first)
+        added.add(e);
+    for (auto& e : second)
+        added.add(make_shared<ElementValue>(e->pos, e->value));
+
+    ThreadPool pool(4);
+    for (auto& e : first)
+        addedMany.add(make_shared<ElementValue>(e->pos, e->value));
+    ASSERT_NO_THROW(addedMany.addMany(second, &pool));
+    ASSERT_EQ(addedMany.count(), added.count());
+    ASSERT_NEAR(addedMany.mass(), added.mass(), 1e-8);
+    for (int i=0; i<3; i++)
+        ASSERT_NEAR(addedMany.massCenter()[i], added.massCenter()[i], 1e-10);
+    checkSubtree(addedMany.root(), true);
+    for (auto& e : second)
+    {
+        ASSERT_NE(e->parent, nullptr);
+        ASSERT_EQ(e->parent->element.get(), e.get());
+        ASSERT_TRUE(e->parent->isInside(e->pos));
+    }
+
+    // Empty octree is filled too
+    Octree empty;
+    ASSERT_NO_THROW(empty.addMany(first, &pool));
+    ASSERT_EQ(empty.count(), first.size());
+    checkSubtree(empty.root(), true);
+}
+
+TEST(OctreeAddMany, SamePlace)
+{
+    std::vector<std::shared_ptr<Element>> elements;
+    for (int i=0; i<1000; i++)
+        elements.push_back(make_shared<ElementValue>(Position(sin(i * 1.3), cos(i * 0.9), sin(i * 0.2)), 1.0));
+    Octree oct;
+    oct.add(make_shared<ElementValue>(elements[10]->pos, 1.0));
+    elements.push_back(make_shared<ElementValue>(elements[500]->pos, 1.0));
+
+    ThreadPool pool(3);
+    ASSERT_THROW(oct.addMany(elements, &pool), std::runtime_error);
+    // All elements except two ones at the same places are added
+    ASSERT_EQ(oct.count(), elements.size() - 1);
+    ASSERT_NEAR(oct.mass(), static_cast<double>(elements.size() - 1), 1e-10);
+    ASSERT_TRUE(oct.centerMassUpdatingEnabled());
+    checkSubtree(oct.root(), true);
+}